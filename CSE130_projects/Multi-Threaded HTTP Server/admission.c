@@ -0,0 +1,79 @@
+#include "admission.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+// structure for the admission controller
+typedef struct admission {
+    uint64_t target_ns;
+    uint64_t interval_ns;
+    uint64_t first_above_ns; // when the wait will have been above target for an interval, 0 if below
+    pthread_mutex_t lock; // covers first_above_ns, workers report from every thread
+    atomic_bool dropping; // shedding, read without the lock on every arrival
+} admission_t;
+
+admission_t *admission_new(int target_ms, int interval_ms) {
+    admission_t *a = calloc(1, sizeof(admission_t));
+    if (!a) {
+        return NULL;
+    }
+    a->target_ns = (uint64_t) (target_ms > 0 ? target_ms : 1) * 1000000;
+    a->interval_ns = (uint64_t) (interval_ms > 0 ? interval_ms : 1) * 1000000;
+    pthread_mutex_init(&a->lock, NULL);
+    atomic_init(&a->dropping, false);
+    return a;
+}
+
+void admission_delete(admission_t **a) {
+    if (!a || !*a) {
+        return;
+    }
+    pthread_mutex_destroy(&(*a)->lock);
+    free(*a);
+    *a = NULL;
+}
+
+bool admission_admit(admission_t *a, int64_t depth) {
+    if (!atomic_load_explicit(&a->dropping, memory_order_relaxed)) {
+        return true;
+    }
+    if (depth == 0) {
+        // the backlog is gone, nobody would be left to report a short wait
+        atomic_store(&a->dropping, false);
+        return true;
+    }
+    return false;
+}
+
+bool admission_dequeue(admission_t *a, uint64_t wait_ns, uint64_t now_ns) {
+    if (wait_ns < a->target_ns) {
+        // a short wait ends a burst, and shedding if it was on
+        pthread_mutex_lock(&a->lock);
+        a->first_above_ns = 0;
+        pthread_mutex_unlock(&a->lock);
+        atomic_store(&a->dropping, false);
+        return true;
+    }
+
+    if (atomic_load(&a->dropping)) {
+        return false;
+    }
+
+    // above target, shedding starts once that has lasted a whole interval
+    pthread_mutex_lock(&a->lock);
+    bool sustained = false;
+    if (a->first_above_ns == 0) {
+        a->first_above_ns = now_ns + a->interval_ns;
+    } else if (now_ns >= a->first_above_ns) {
+        sustained = true;
+        a->first_above_ns = 0;
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    if (sustained) {
+        atomic_store(&a->dropping, true);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// CoDel-style admission control for the request queue. workers report how
+// long each connection waited. a wait above target is tolerated while it
+// lasts less than an interval, as a burst. once it has stayed above target
+// for a whole interval the controller starts shedding: new connections are
+// refused right away and queued ones that already waited past target are
+// refused when a worker takes them, until a connection is taken within
+// target or the queue has drained. served requests so never wait much longer
+// than target plus interval, however far the offered load exceeds capacity.
+typedef struct admission admission_t;
+
+// creates an admission controller aiming for a queue wait below target_ms,
+// tolerating longer waits for up to interval_ms
+admission_t *admission_new(int target_ms, int interval_ms);
+
+// frees the admission controller
+void admission_delete(admission_t **a);
+
+// a connection arrives while depth connections are queued. returns whether
+// to queue it, or to shed it with a 503
+bool admission_admit(admission_t *a, int64_t depth);
+
+// a worker took a connection that waited wait_ns. returns whether to serve
+// it, or to shed it with a 503
+bool admission_dequeue(admission_t *a, uint64_t wait_ns, uint64_t now_ns);
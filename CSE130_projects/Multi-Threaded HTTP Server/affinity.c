@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include "affinity.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// structure for the placement
+typedef struct affinity {
+    int count; // allowed CPUs
+    int cpus[CPU_SETSIZE]; // CPU of each slot, in CPU number order
+    int slot_of[CPU_SETSIZE]; // slot of each CPU, -1 if not allowed
+    int node_of[CPU_SETSIZE]; // NUMA node of each allowed CPU
+} affinity_t;
+
+// reads the NUMA node of a CPU from sysfs, 0 when the machine has no NUMA information
+static int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && sscanf(entry->d_name + 4, "%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+affinity_t *affinity_new(void) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return NULL;
+    }
+
+    affinity_t *a = calloc(1, sizeof(affinity_t));
+    if (!a) {
+        return NULL;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        a->slot_of[cpu] = -1;
+        if (CPU_ISSET(cpu, &set)) {
+            a->slot_of[cpu] = a->count;
+            a->cpus[a->count++] = cpu;
+            a->node_of[cpu] = cpu_node(cpu);
+        }
+    }
+    if (a->count == 0) {
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+void affinity_delete(affinity_t **a) {
+    if (!a || !*a) {
+        return;
+    }
+    free(*a);
+    *a = NULL;
+}
+
+int affinity_cpus(affinity_t *a) {
+    return a->count;
+}
+
+int affinity_cpu(affinity_t *a, int slot) {
+    return a->cpus[slot % a->count];
+}
+
+bool affinity_set(affinity_t *a, pthread_attr_t *attr, int slot) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(affinity_cpu(a, slot), &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0;
+}
+
+int affinity_worker_for(affinity_t *a, int cpu, int workers, unsigned rr) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE || a->slot_of[cpu] < 0) {
+        return -1;
+    }
+
+    // workers k, k + count, k + 2 * count, ... share the CPU of slot k
+    int k = a->slot_of[cpu];
+    if (k < workers) {
+        int sharing = (workers - k + a->count - 1) / a->count;
+        return k + a->count * (int) (rr % sharing);
+    }
+
+    // more CPUs than workers, take a worker whose memory is on the same node
+    for (int slot = 0; slot < workers && slot < a->count; slot++) {
+        if (a->node_of[a->cpus[slot]] == a->node_of[cpu]) {
+            return slot;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// placement of threads on the CPUs the process may run on. thread slot i is
+// pinned to the i-th allowed CPU, wrapping around when there are more threads
+// than CPUs. a pinned thread touches its stack, its metrics slot and anything
+// else it allocates first from its own CPU, so the kernel's first-touch
+// policy puts that memory on the thread's NUMA node.
+typedef struct affinity affinity_t;
+
+// reads the allowed CPUs and the NUMA node of each. returns NULL if the
+// affinity mask cannot be read
+affinity_t *affinity_new(void);
+
+// frees the placement
+void affinity_delete(affinity_t **a);
+
+// number of CPUs the threads are spread over
+int affinity_cpus(affinity_t *a);
+
+// the CPU thread slot i is pinned to
+int affinity_cpu(affinity_t *a, int slot);
+
+// makes threads created with attr start on the CPU of slot i
+bool affinity_set(affinity_t *a, pthread_attr_t *attr, int slot);
+
+// picks one of the first workers slots for work that arrived on cpu: a
+// worker pinned to that CPU, rotating by rr when there are several, or else
+// one on the same NUMA node. returns -1 when there is no such worker
+int affinity_worker_for(affinity_t *a, int cpu, int workers, unsigned rr);
@@ -0,0 +1,293 @@
+#include "audit_log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// entries in each per-thread ring, a power of two
+#define RING_SIZE 1024
+// longest log line kept, longer lines are truncated
+#define LINE_MAX_LEN 256
+// size of the flusher's output batch
+#define BATCH_SIZE 65536
+// longest the flusher sleeps when there is nothing to write
+#define MAX_IDLE_US 8000
+
+// one formatted log line
+typedef struct entry {
+    uint64_t seq; // global order of the line
+    uint16_t len;
+    char line[LINE_MAX_LEN];
+} entry_t;
+
+// single producer, single consumer ring owned by one thread
+typedef struct ring {
+    entry_t entries[RING_SIZE];
+    _Atomic uint64_t head; // next entry the flusher reads
+    _Atomic uint64_t tail; // next entry the owner writes
+    atomic_bool in_use; // claimed by a live thread
+    struct ring *next; // next ring in the log's list
+} ring_t;
+
+// structure for the audit log
+typedef struct audit_log {
+    int fd; // where lines are written
+    _Atomic uint64_t next_seq; // next sequence number to stamp
+    _Atomic(ring_t *) rings; // every ring ever created, newest first
+    pthread_key_t ring_key; // the calling thread's ring
+    atomic_bool stop;
+    pthread_t flusher;
+
+    // flusher state, only touched by the flusher thread
+    entry_t *heap; // lines drained from the rings, min-heap by seq
+    size_t heap_len, heap_cap;
+    _Atomic uint64_t emit_seq; // next sequence number to emit
+    char batch[BATCH_SIZE];
+    size_t batch_len;
+} audit_log_t;
+
+// gives the ring back when its thread exits so a new thread can reuse it
+static void ring_release(void *arg) {
+    ring_t *r = arg;
+    atomic_store(&r->in_use, false);
+}
+
+// returns the calling thread's ring, claiming a free one or creating it
+static ring_t *ring_get(audit_log_t *log) {
+    ring_t *r = pthread_getspecific(log->ring_key);
+    if (r) {
+        return r;
+    }
+
+    for (r = atomic_load(&log->rings); r; r = r->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, true)) {
+            break;
+        }
+    }
+
+    if (!r) {
+        r = calloc(1, sizeof(ring_t));
+        if (!r) {
+            return NULL;
+        }
+        atomic_store(&r->in_use, true);
+        r->next = atomic_load(&log->rings);
+        while (!atomic_compare_exchange_weak(&log->rings, &r->next, r)) {
+        }
+    }
+
+    pthread_setspecific(log->ring_key, r);
+    return r;
+}
+
+// min-heap helpers for the flusher
+static void heap_swap(entry_t *a, entry_t *b) {
+    entry_t t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static bool heap_push(audit_log_t *log, const entry_t *e) {
+    if (log->heap_len == log->heap_cap) {
+        size_t cap = log->heap_cap ? log->heap_cap * 2 : RING_SIZE;
+        entry_t *heap = realloc(log->heap, cap * sizeof(entry_t));
+        if (!heap) {
+            return false;
+        }
+        log->heap = heap;
+        log->heap_cap = cap;
+    }
+
+    size_t i = log->heap_len++;
+    log->heap[i] = *e;
+    while (i > 0 && log->heap[(i - 1) / 2].seq > log->heap[i].seq) {
+        heap_swap(&log->heap[(i - 1) / 2], &log->heap[i]);
+        i = (i - 1) / 2;
+    }
+    return true;
+}
+
+static void heap_pop(audit_log_t *log) {
+    log->heap[0] = log->heap[--log->heap_len];
+    size_t i = 0;
+    while (1) {
+        size_t l = 2 * i + 1, r = l + 1, min = i;
+        if (l < log->heap_len && log->heap[l].seq < log->heap[min].seq) {
+            min = l;
+        }
+        if (r < log->heap_len && log->heap[r].seq < log->heap[min].seq) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+        heap_swap(&log->heap[i], &log->heap[min]);
+        i = min;
+    }
+}
+
+// writes the whole batch, retrying short writes
+static void batch_flush(audit_log_t *log) {
+    size_t off = 0;
+    while (off < log->batch_len) {
+        ssize_t n = write(log->fd, log->batch + off, log->batch_len - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        off += n;
+    }
+    log->batch_len = 0;
+}
+
+// moves every line from the rings into the heap, returns how many were moved
+static size_t drain_rings(audit_log_t *log) {
+    size_t moved = 0;
+    for (ring_t *r = atomic_load(&log->rings); r; r = r->next) {
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        while (head < tail) {
+            if (!heap_push(log, &r->entries[head & (RING_SIZE - 1)])) {
+                break; // out of memory, leave the rest in the ring
+            }
+            head++;
+            moved++;
+        }
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    return moved;
+}
+
+// emits lines in sequence order. a line whose predecessor is still in some
+// ring waits until the predecessor arrives
+static void emit_in_order(audit_log_t *log) {
+    uint64_t seq = atomic_load(&log->emit_seq);
+    while (log->heap_len > 0 && log->heap[0].seq == seq) {
+        entry_t *e = &log->heap[0];
+        if (log->batch_len + e->len > BATCH_SIZE) {
+            batch_flush(log);
+        }
+        memcpy(log->batch + log->batch_len, e->line, e->len);
+        log->batch_len += e->len;
+        seq++;
+        heap_pop(log);
+    }
+    batch_flush(log);
+
+    // published after the write so audit_log_flush sees the lines on disk
+    atomic_store(&log->emit_seq, seq);
+}
+
+// flusher thread, drains the rings and writes batches until stopped
+static void *flush_thread(void *arg) {
+    audit_log_t *log = arg;
+    useconds_t idle_us = 1000;
+
+    while (1) {
+        bool stopping = atomic_load(&log->stop);
+        size_t moved = drain_rings(log);
+        emit_in_order(log);
+
+        if (stopping && moved == 0 && atomic_load(&log->emit_seq) == atomic_load(&log->next_seq)) {
+            break;
+        }
+
+        // back off while the server is quiet
+        if (moved == 0) {
+            usleep(idle_us);
+            idle_us = idle_us * 2 > MAX_IDLE_US ? MAX_IDLE_US : idle_us * 2;
+        } else {
+            idle_us = 1000;
+        }
+    }
+    return NULL;
+}
+
+// creates a new audit log and starts its flusher thread
+audit_log_t *audit_log_new(int fd) {
+    audit_log_t *log = calloc(1, sizeof(audit_log_t));
+    if (!log) {
+        return NULL;
+    }
+
+    log->fd = fd;
+    if (pthread_key_create(&log->ring_key, ring_release) != 0) {
+        free(log);
+        return NULL;
+    }
+    if (pthread_create(&log->flusher, NULL, flush_thread, log) != 0) {
+        pthread_key_delete(log->ring_key);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+// flushes pending lines, stops the flusher and frees the audit log
+void audit_log_delete(audit_log_t **log) {
+    if (!log || !*log) {
+        return;
+    }
+
+    atomic_store(&(*log)->stop, true);
+    pthread_join((*log)->flusher, NULL);
+    pthread_key_delete((*log)->ring_key);
+
+    for (ring_t *r = atomic_load(&(*log)->rings); r;) {
+        ring_t *next = r->next;
+        free(r);
+        r = next;
+    }
+    free((*log)->heap);
+    free(*log);
+    *log = NULL;
+}
+
+// waits for the flusher to write everything stamped so far
+void audit_log_flush(audit_log_t *log) {
+    uint64_t target = atomic_load(&log->next_seq);
+    while (atomic_load(&log->emit_seq) < target) {
+        usleep(1000);
+    }
+}
+
+// appends one line to the calling thread's ring
+void audit_log_write(
+    audit_log_t *log, const char *operation, const char *uri, int status, const char *request_id) {
+    ring_t *r = ring_get(log);
+    if (!r) {
+        return;
+    }
+
+    // wait for the flusher if the ring is full
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&r->head, memory_order_acquire) >= RING_SIZE) {
+        sched_yield();
+    }
+
+    entry_t *e = &r->entries[tail & (RING_SIZE - 1)];
+    int len = snprintf(e->line, LINE_MAX_LEN, "%s,%s,%d,%s\n", operation, uri, status,
+        request_id ? request_id : "0");
+    if (len < 0) {
+        len = 0;
+    } else if (len >= LINE_MAX_LEN) {
+        // keep the line terminated when it was cut short
+        len = LINE_MAX_LEN - 1;
+        e->line[len - 1] = '\n';
+    }
+    e->len = (uint16_t) len;
+
+    // the stamp is taken under the caller's rwlock, which fixes the line's place in the log
+    e->seq = atomic_fetch_add(&log->next_seq, 1);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+
+// asynchronous audit log. each thread appends formatted lines to its own ring
+// buffer without locking, and a background flusher drains the rings and
+// writes the lines to the output in large batches.
+//
+// every line is stamped with a global sequence number when it is written.
+// callers write while holding the per-URI rwlock, so the stamps follow the
+// order in which the locks were acquired. the flusher only emits lines in
+// unbroken sequence order, so the log order matches the lock order.
+typedef struct audit_log audit_log_t;
+
+// creates a new audit log writing to fd and starts its flusher thread
+audit_log_t *audit_log_new(int fd);
+
+// flushes every pending line, stops the flusher and frees the audit log
+void audit_log_delete(audit_log_t **log);
+
+// waits until every line stamped before the call has been written
+void audit_log_flush(audit_log_t *log);
+
+// appends one operation,uri,status,request_id line. blocks only while the
+// calling thread's ring is full
+void audit_log_write(
+    audit_log_t *log, const char *operation, const char *uri, int status, const char *request_id);
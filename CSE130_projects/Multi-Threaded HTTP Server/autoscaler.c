@@ -0,0 +1,139 @@
+#include "autoscaler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// how often the scaler samples the pool
+#define TICK_MS 100
+// ticks a worker has to stay idle before the pool shrinks (5 seconds)
+#define SHRINK_TICKS 50
+
+// structure for the autoscaler
+typedef struct autoscaler {
+    int min, max;
+    uint64_t target_wait_ns;
+    autoscaler_spawn_t spawn;
+    autoscaler_retire_t retire;
+    pthread_t scaler;
+
+    _Atomic int workers; // live workers, including ones asked to retire
+    _Atomic int retiring; // workers asked to exit that have not exited yet
+    _Atomic int idle; // workers waiting for work
+    _Atomic int depth; // connections queued and not yet taken
+    _Atomic uint64_t wait_sum_ns; // queue wait of jobs started this tick
+    _Atomic uint64_t wait_count;
+
+    int min_idle; // fewest idle workers seen since the last shrink check
+    int idle_ticks; // ticks since the last shrink check
+} autoscaler_t;
+
+// starts n workers, stopping early if a spawn fails
+static void grow(autoscaler_t *a, int n) {
+    for (int i = 0; i < n; i++) {
+        if (a->spawn() != 0) {
+            return;
+        }
+        atomic_fetch_add(&a->workers, 1);
+    }
+}
+
+// one sample of the pool. grows by half the pool at a time so a burst is
+// absorbed in a few ticks, shrinks by half of the workers that stayed idle
+// through a whole shrink window
+static void tick(autoscaler_t *a) {
+    uint64_t count = atomic_exchange(&a->wait_count, 0);
+    uint64_t sum = atomic_exchange(&a->wait_sum_ns, 0);
+    uint64_t avg_wait = count ? sum / count : 0;
+    int depth = atomic_load(&a->depth);
+    int idle = atomic_load(&a->idle);
+    int active = atomic_load(&a->workers) - atomic_load(&a->retiring);
+
+    if ((avg_wait > a->target_wait_ns || depth > active) && active < a->max) {
+        int n = active / 2 > 0 ? active / 2 : 1;
+        grow(a, n < a->max - active ? n : a->max - active);
+        a->min_idle = 0;
+        a->idle_ticks = 0;
+        return;
+    }
+
+    if (a->idle_ticks == 0 || idle < a->min_idle) {
+        a->min_idle = idle;
+    }
+    if (++a->idle_ticks < SHRINK_TICKS) {
+        return;
+    }
+
+    int n = a->min_idle / 2 > 0 ? a->min_idle / 2 : a->min_idle;
+    if (n > active - a->min) {
+        n = active - a->min;
+    }
+    for (int i = 0; i < n; i++) {
+        atomic_fetch_add(&a->retiring, 1);
+        a->retire();
+    }
+    a->min_idle = 0;
+    a->idle_ticks = 0;
+}
+
+// scaler thread, samples the pool every tick
+static void *scaler_thread(void *arg) {
+    autoscaler_t *a = arg;
+    while (1) {
+        usleep(TICK_MS * 1000);
+        tick(a);
+    }
+    return NULL;
+}
+
+// creates an autoscaler
+autoscaler_t *autoscaler_new(
+    int min, int max, int target_wait_ms, autoscaler_spawn_t spawn, autoscaler_retire_t retire) {
+    if (min < 1 || max < min || !spawn || !retire) {
+        return NULL;
+    }
+
+    autoscaler_t *a = calloc(1, sizeof(autoscaler_t));
+    if (!a) {
+        return NULL;
+    }
+    a->min = min;
+    a->max = max;
+    a->target_wait_ns = (uint64_t) target_wait_ms * 1000000;
+    a->spawn = spawn;
+    a->retire = retire;
+    return a;
+}
+
+// starts the initial workers and the scaler thread
+bool autoscaler_start(autoscaler_t *a, int initial) {
+    grow(a, initial < a->min ? a->min : (initial > a->max ? a->max : initial));
+    if (atomic_load(&a->workers) < a->min) {
+        return false;
+    }
+    return pthread_create(&a->scaler, NULL, scaler_thread, a) == 0;
+}
+
+void autoscaler_job_queued(autoscaler_t *a) {
+    atomic_fetch_add(&a->depth, 1);
+}
+
+void autoscaler_job_started(autoscaler_t *a, uint64_t wait_ns) {
+    atomic_fetch_sub(&a->depth, 1);
+    atomic_fetch_add(&a->wait_sum_ns, wait_ns);
+    atomic_fetch_add(&a->wait_count, 1);
+}
+
+void autoscaler_worker_idle(autoscaler_t *a) {
+    atomic_fetch_add(&a->idle, 1);
+}
+
+void autoscaler_worker_busy(autoscaler_t *a) {
+    atomic_fetch_sub(&a->idle, 1);
+}
+
+void autoscaler_worker_exited(autoscaler_t *a) {
+    atomic_fetch_sub(&a->retiring, 1);
+    atomic_fetch_sub(&a->workers, 1);
+}
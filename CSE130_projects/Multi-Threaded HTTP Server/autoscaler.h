@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// grows and shrinks the worker pool with the load. a scaler thread samples
+// the queue depth and how long connections waited for a worker: it starts
+// workers while the wait is above target (or the queue is deeper than the
+// pool) and retires workers that have been idle for a while.
+typedef struct autoscaler autoscaler_t;
+
+// starts one worker thread, returns 0 on success
+typedef int (*autoscaler_spawn_t)(void);
+// asks one worker to exit, e.g. by queueing a stop job
+typedef void (*autoscaler_retire_t)(void);
+
+// creates an autoscaler that keeps between min and max workers, aiming for
+// a queue wait below target_wait_ms
+autoscaler_t *autoscaler_new(
+    int min, int max, int target_wait_ms, autoscaler_spawn_t spawn, autoscaler_retire_t retire);
+
+// starts the initial workers (clamped to min and max) and the scaler thread.
+// workers report to the autoscaler, so it must be reachable before this
+bool autoscaler_start(autoscaler_t *a, int initial);
+
+// a connection was queued for the workers
+void autoscaler_job_queued(autoscaler_t *a);
+
+// a worker took a connection that waited wait_ns in the queue
+void autoscaler_job_started(autoscaler_t *a, uint64_t wait_ns);
+
+// a worker is about to wait for work, or got work
+void autoscaler_worker_idle(autoscaler_t *a);
+void autoscaler_worker_busy(autoscaler_t *a);
+
+// a worker thread exited after being retired
+void autoscaler_worker_exited(autoscaler_t *a);
@@ -0,0 +1,24 @@
+#!/bin/bash
+# measures what pinning (-p) does: runs the suite once without and once with
+# it, on the same per-worker deque setup, and compares the pinned run with
+# the unpinned one. on a single socket machine expect lower tail latency from
+# fewer migrations, on a NUMA machine higher throughput as well
+#
+# usage: affinity.sh <server> [results_dir]
+# environment: everything bench.sh takes, SERVER_ARGS defaults to one
+# acceptor and two workers per CPU
+
+set -u
+
+SERVER=$(realpath "${1:?usage: affinity.sh <server> [results_dir]}")
+RESULTS=$(realpath -m "${2:-results/affinity}")
+CPUS=$(nproc)
+ARGS=${SERVER_ARGS:--A $CPUS -t $((2 * CPUS))}
+BENCH=$(dirname "$(realpath "$0")")/bench.sh
+
+echo "### unpinned: $ARGS"
+SERVER_ARGS="$ARGS" BASELINE= "$BENCH" "$SERVER" "$RESULTS/unpinned" || exit 1
+echo "### pinned: $ARGS -p"
+# a change either way is reported, not failed on
+SERVER_ARGS="$ARGS -p" BASELINE="$RESULTS/unpinned" THRESHOLD=1000 \
+    "$BENCH" "$SERVER" "$RESULTS/pinned"
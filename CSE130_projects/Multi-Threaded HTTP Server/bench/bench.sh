@@ -0,0 +1,56 @@
+#!/bin/bash
+# runs the benchmark suite against an httpserver binary. every scenario starts
+# a fresh server in an empty directory, drives it with loadgen and keeps the
+# result in the results directory. with BASELINE set to the results directory
+# of an earlier build, each scenario is compared and regressions fail the run
+#
+# usage: bench.sh <server> [results_dir]
+# environment: PORT, DURATION, CLIENTS, RATE, SERVER_ARGS, BASELINE, THRESHOLD
+
+set -u
+
+SERVER=$(realpath "${1:?usage: bench.sh <server> [results_dir]}")
+RESULTS=$(realpath -m "${2:-results/latest}")
+PORT=${PORT:-8089}
+DURATION=${DURATION:-10}
+CLIENTS=${CLIENTS:-16}
+RATE=${RATE:-2000}
+SERVER_ARGS=${SERVER_ARGS:-}
+BASELINE=${BASELINE:-}
+THRESHOLD=${THRESHOLD:-10}
+LOADGEN=$(dirname "$(realpath "$0")")/loadgen
+
+# name and loadgen arguments of every scenario
+SCENARIOS=(
+    "closed-get-shared    -c $CLIENTS -g 100"
+    "closed-mixed-shared  -c $CLIENTS -g 90"
+    "closed-mixed-disjoint -c $CLIENTS -g 90 -D"
+    "open-get-shared      -c $CLIENTS -g 100 -r $RATE"
+    "open-mixed-shared    -c $CLIENTS -g 90 -r $RATE"
+)
+
+mkdir -p "$RESULTS"
+failed=0
+for scenario in "${SCENARIOS[@]}"; do
+    read -r name args <<<"$scenario"
+    dir=$(mktemp -d)
+    (cd "$dir" && exec "$SERVER" $SERVER_ARGS "$PORT" 2>/dev/null) &
+    pid=$!
+    sleep 0.5
+
+    compare=()
+    if [ -n "$BASELINE" ]; then
+        compare=(-b "$(realpath "$BASELINE")/$name.txt" -T "$THRESHOLD")
+    fi
+    echo "== $name"
+    "$LOADGEN" -p "$PORT" -d "$DURATION" $args -o "$RESULTS/$name.txt" "${compare[@]}"
+    status=$?
+
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+    rm -rf "$dir"
+    if [ $status -ne 0 ]; then
+        failed=1
+    fi
+done
+exit $failed
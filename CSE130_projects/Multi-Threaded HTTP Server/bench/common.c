@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <errno.h>
+#include <math.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// largest response head that is accepted
+#define HEAD_MAX 4096
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t t) {
+    struct timespec ts = { .tv_sec = t / 1000000000, .tv_nsec = t % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+bool samples_add(samples_t *s, uint64_t v) {
+    if (s->n == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 4096;
+        uint64_t *grown = realloc(s->v, cap * sizeof(uint64_t));
+        if (!grown) {
+            return false;
+        }
+        s->v = grown;
+        s->cap = cap;
+    }
+    s->v[s->n++] = v;
+    return true;
+}
+
+bool samples_merge(samples_t *to, const samples_t *from) {
+    for (size_t i = 0; i < from->n; i++) {
+        if (!samples_add(to, from->v[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void samples_sort(samples_t *s) {
+    qsort(s->v, s->n, sizeof(uint64_t), compare_u64);
+}
+
+double percentile_us(const samples_t *s, double q) {
+    if (s->n == 0) {
+        return 0;
+    }
+    size_t i = (size_t) ceil(q * s->n);
+    return s->v[i ? i - 1 : 0] / 1000.0;
+}
+
+int http_connect(const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// reads one response and returns its status code, 0 if the connection was
+// closed before any byte arrived and -1 on a malformed or cut response
+static int read_response(int fd) {
+    char head[HEAD_MAX + 1];
+    size_t len = 0;
+    char *end = NULL;
+    while (!end) {
+        if (len == HEAD_MAX) {
+            return -1;
+        }
+        ssize_t n = recv(fd, head + len, HEAD_MAX - len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return len == 0 ? 0 : -1;
+        }
+        len += n;
+        head[len] = '\0';
+        end = strstr(head, "\r\n\r\n");
+    }
+
+    int status;
+    if (sscanf(head, "HTTP/1.1 %d", &status) != 1) {
+        return -1;
+    }
+    size_t body = 0;
+    char *cl = strcasestr(head, "\r\nContent-Length:");
+    if (cl && cl < end) {
+        body = strtoull(cl + 17, NULL, 10);
+    }
+
+    // drain the body, part of it may have come with the head
+    size_t have = len - (end + 4 - head);
+    char scratch[65536];
+    while (have < body) {
+        size_t want = body - have < sizeof(scratch) ? body - have : sizeof(scratch);
+        ssize_t n = recv(fd, scratch, want, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        have += n;
+    }
+    return status;
+}
+
+int http_request(const struct sockaddr_in *addr, int *fd, bool keep_alive, bool get,
+    const char *uri, uint64_t request_id, const char *body, size_t size) {
+    char head[512];
+    int head_len;
+    if (get) {
+        head_len = snprintf(
+            head, sizeof(head), "GET /%s HTTP/1.1\r\nRequest-Id: %lu\r\n\r\n", uri, request_id);
+    } else {
+        head_len = snprintf(head, sizeof(head),
+            "PUT /%s HTTP/1.1\r\nRequest-Id: %lu\r\nContent-Length: %zu\r\n\r\n", uri, request_id,
+            size);
+    }
+    if (head_len < 0 || head_len >= (int) sizeof(head)) {
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = *fd >= 0;
+        if (!reused && (*fd = http_connect(addr)) < 0) {
+            return -1;
+        }
+        int status = -1;
+        if (write_all(*fd, head, head_len) && (get || write_all(*fd, body, size))) {
+            status = read_response(*fd);
+        }
+        if (status <= 0 || !keep_alive) {
+            close(*fd);
+            *fd = -1;
+        }
+        if (status > 0 || !reused) {
+            return status > 0 ? status : -1;
+        }
+    }
+    return -1;
+}
+
+// looks up key in a result file written by an earlier run
+static bool baseline_value(const char *path, const char *key, double *value) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    char line[128];
+    size_t key_len = strlen(key);
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == '=') {
+            *value = atof(line + key_len + 1);
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+bool regressed(const char *baseline, const char *key, double now, bool higher_is_better,
+    double threshold) {
+    double before;
+    if (!baseline || !baseline_value(baseline, key, &before) || before <= 0) {
+        return false;
+    }
+    double change = (now - before) / before * 100;
+    bool worse = higher_is_better ? change < -threshold : change > threshold;
+    printf("%-16s %12.1f -> %12.1f  %+6.1f%%%s\n", key, before, now, change,
+        worse ? "  REGRESSION" : "");
+    return worse;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// pieces shared by the benchmark tools: clocks, latency samples, a minimal
+// HTTP/1.1 client for the server's GET and PUT, and baseline comparison of
+// result files
+
+// monotonic time in nanoseconds
+uint64_t now_ns(void);
+
+// sleeps until the monotonic time t
+void sleep_until(uint64_t t);
+
+// latencies in nanoseconds
+typedef struct samples {
+    uint64_t *v;
+    size_t n, cap;
+} samples_t;
+
+bool samples_add(samples_t *s, uint64_t v);
+
+// appends every sample of from to to
+bool samples_merge(samples_t *to, const samples_t *from);
+
+// sorts the samples, percentile_us needs them sorted
+void samples_sort(samples_t *s);
+
+// the q-quantile of sorted samples in microseconds, 0 when there are none
+double percentile_us(const samples_t *s, double q);
+
+// opens a connection to the server with Nagle's algorithm off
+int http_connect(const struct sockaddr_in *addr);
+
+// sends one request on *fd and waits for its answer. a PUT sends size bytes of
+// body. *fd is opened when it is -1, and closed again unless keep_alive is
+// set or when the request failed. a kept-alive connection the server already
+// closed is reopened once. returns the status or -1
+int http_request(const struct sockaddr_in *addr, int *fd, bool keep_alive, bool get,
+    const char *uri, uint64_t request_id, const char *body, size_t size);
+
+// compares one metric with the value stored under key in a baseline result
+// file, higher_is_better picks the direction. prints the change and returns
+// whether it got worse by more than threshold percent
+bool regressed(const char *baseline, const char *key, double now, bool higher_is_better,
+    double threshold);
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// load generator for the HTTP servers. closed loop: every client sends its
+// next request as soon as the previous answer arrived. open loop: requests
+// are scheduled at a fixed rate and latency is measured from the scheduled
+// time, so a stalled server is not hidden by clients that stopped sending
+
+typedef struct config {
+    const char *host;
+    int port;
+    int clients; // concurrent connections
+    double rate; // requests per second, 0 for closed loop
+    double duration; // seconds of measured load
+    int get_percent; // share of GETs, the rest are PUTs
+    int files; // URIs per set
+    bool disjoint; // every client uses its own URIs
+    size_t size; // bytes per PUT body
+    bool keep_alive; // reuse connections between requests
+    const char *out; // result file
+    const char *baseline; // earlier result to compare against
+    double threshold; // allowed change in percent before a regression is flagged
+} config_t;
+
+static config_t cfg = {
+    .host = "127.0.0.1",
+    .port = 8080,
+    .clients = 8,
+    .duration = 10,
+    .get_percent = 90,
+    .files = 16,
+    .size = 4096,
+    .threshold = 10,
+};
+
+typedef struct client {
+    int id;
+    pthread_t tid;
+    int fd; // kept-alive connection or -1
+    unsigned seed;
+    samples_t latency;
+    uint64_t errors;
+} client_t;
+
+static char *put_body;
+static uint64_t start_ns, end_ns;
+static _Atomic uint64_t next_slot = 0; // open loop schedule position
+static struct sockaddr_in server_addr;
+
+// names a URI of the client's set, shared URIs are the same for every client
+static void pick_uri(client_t *c, char *uri, size_t size) {
+    int file = rand_r(&c->seed) % cfg.files;
+    if (cfg.disjoint) {
+        snprintf(uri, size, "bench-c%d-%d", c->id, file);
+    } else {
+        snprintf(uri, size, "bench-s-%d", file);
+    }
+}
+
+// sends one request on the client's connection, returns the status or -1
+static int do_request(client_t *c, bool get, const char *uri, uint64_t request_id) {
+    return http_request(
+        &server_addr, &c->fd, cfg.keep_alive, get, uri, request_id, put_body, cfg.size);
+}
+
+static void *client_thread(void *arg) {
+    client_t *c = arg;
+    uint64_t interval = cfg.rate > 0 ? (uint64_t) (1e9 / cfg.rate) : 0;
+    uint64_t request_id = (uint64_t) c->id << 32;
+
+    while (1) {
+        uint64_t issued;
+        if (interval) {
+            issued = start_ns + atomic_fetch_add(&next_slot, 1) * interval;
+            if (issued >= end_ns) {
+                break;
+            }
+            sleep_until(issued);
+        } else {
+            issued = now_ns();
+            if (issued >= end_ns) {
+                break;
+            }
+        }
+
+        char uri[64];
+        pick_uri(c, uri, sizeof(uri));
+        bool get = (int) (rand_r(&c->seed) % 100) < cfg.get_percent;
+        int status = do_request(c, get, uri, ++request_id);
+        if (status == 200 || status == 201) {
+            samples_add(&c->latency, now_ns() - issued);
+        } else {
+            c->errors++;
+        }
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    return NULL;
+}
+
+// PUTs every URI once so GETs never miss
+static bool populate(client_t *clients) {
+    int sets = cfg.disjoint ? cfg.clients : 1;
+    for (int s = 0; s < sets; s++) {
+        for (int f = 0; f < cfg.files; f++) {
+            char uri[64];
+            if (cfg.disjoint) {
+                snprintf(uri, sizeof(uri), "bench-c%d-%d", s, f);
+            } else {
+                snprintf(uri, sizeof(uri), "bench-s-%d", f);
+            }
+            int status = do_request(&clients[0], false, uri, 0);
+            if (status != 200 && status != 201) {
+                fprintf(stderr, "loadgen: populating /%s failed\n", uri);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-h host] [-p port] [-c clients] [-r rate] [-d seconds]\n"
+        "          [-g get_percent] [-n files] [-D] [-s put_bytes] [-K]\n"
+        "          [-o result_file] [-b baseline_file] [-T threshold_percent]\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:r:d:g:n:Ds:Ko:b:T:")) != -1) {
+        if (opt == 'h') {
+            cfg.host = optarg;
+        } else if (opt == 'p') {
+            cfg.port = atoi(optarg);
+        } else if (opt == 'c') {
+            cfg.clients = atoi(optarg);
+        } else if (opt == 'r') {
+            cfg.rate = atof(optarg);
+        } else if (opt == 'd') {
+            cfg.duration = atof(optarg);
+        } else if (opt == 'g') {
+            cfg.get_percent = atoi(optarg);
+        } else if (opt == 'n') {
+            cfg.files = atoi(optarg);
+        } else if (opt == 'D') {
+            cfg.disjoint = true;
+        } else if (opt == 's') {
+            cfg.size = strtoull(optarg, NULL, 10);
+        } else if (opt == 'K') {
+            cfg.keep_alive = true;
+        } else if (opt == 'o') {
+            cfg.out = optarg;
+        } else if (opt == 'b') {
+            cfg.baseline = optarg;
+        } else if (opt == 'T') {
+            cfg.threshold = atof(optarg);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (cfg.clients < 1 || cfg.files < 1 || cfg.duration <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(cfg.port);
+    if (inet_pton(AF_INET, cfg.host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "loadgen: bad address %s\n", cfg.host);
+        return EXIT_FAILURE;
+    }
+
+    put_body = malloc(cfg.size ? cfg.size : 1);
+    client_t *clients = calloc(cfg.clients, sizeof(client_t));
+    if (!put_body || !clients) {
+        return EXIT_FAILURE;
+    }
+    memset(put_body, 'x', cfg.size);
+    for (int i = 0; i < cfg.clients; i++) {
+        clients[i].id = i;
+        clients[i].fd = -1;
+        clients[i].seed = 0x9e3779b9u * (i + 1);
+    }
+
+    if (!populate(clients)) {
+        return EXIT_FAILURE;
+    }
+
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t) (cfg.duration * 1e9);
+    for (int i = 0; i < cfg.clients; i++) {
+        pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+    }
+
+    samples_t all = { 0 };
+    uint64_t errors = 0;
+    for (int i = 0; i < cfg.clients; i++) {
+        pthread_join(clients[i].tid, NULL);
+        errors += clients[i].errors;
+        samples_merge(&all, &clients[i].latency);
+        free(clients[i].latency.v);
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    samples_sort(&all);
+
+    char result[512];
+    snprintf(result, sizeof(result),
+        "mode=%s\nclients=%d\nrate=%.0f\nget_percent=%d\ndisjoint=%d\nrequests=%zu\n"
+        "errors=%lu\nthroughput_rps=%.1f\np50_us=%.1f\np90_us=%.1f\np99_us=%.1f\n"
+        "p999_us=%.1f\nmax_us=%.1f\n",
+        cfg.rate > 0 ? "open" : "closed", cfg.clients, cfg.rate, cfg.get_percent, cfg.disjoint,
+        all.n, (unsigned long) errors, all.n / elapsed, percentile_us(&all, 0.5),
+        percentile_us(&all, 0.9), percentile_us(&all, 0.99), percentile_us(&all, 0.999),
+        percentile_us(&all, 1.0));
+    fputs(result, stdout);
+    if (cfg.out) {
+        FILE *f = fopen(cfg.out, "w");
+        if (!f || fputs(result, f) < 0 || fclose(f) != 0) {
+            fprintf(stderr, "loadgen: cannot write %s\n", cfg.out);
+        }
+    }
+
+    int status = EXIT_SUCCESS;
+    if (cfg.baseline) {
+        bool worse = regressed(cfg.baseline, "throughput_rps", all.n / elapsed, true, cfg.threshold);
+        worse |= regressed(cfg.baseline, "p50_us", percentile_us(&all, 0.5), false, cfg.threshold);
+        worse |= regressed(cfg.baseline, "p99_us", percentile_us(&all, 0.99), false, cfg.threshold);
+        status = worse ? 2 : EXIT_SUCCESS;
+    }
+    free(all.v);
+    free(clients);
+    free(put_body);
+    return status;
+}
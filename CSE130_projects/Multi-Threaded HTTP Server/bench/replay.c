@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// replays an audit log of the server (operation,uri,status,request_id lines,
+// as log_request writes them) against a running server and reports
+// throughput and latency. the log records the order in which requests took
+// effect on each URI, so every URI is given to one client which issues its
+// requests in log order, while different URIs proceed concurrently over
+// the chosen number of clients. the log has no timestamps: closed loop
+// replays as fast as the server answers, open loop spaces the requests
+// evenly at the chosen rate and measures latency from the scheduled time.
+// URIs that already existed when the log started are created first, so
+// the replayed statuses can be checked against the logged ones.
+
+typedef struct config {
+    const char *host;
+    int port;
+    int clients; // concurrent connections
+    double rate; // requests per second, 0 for closed loop
+    int loops; // times the log is replayed
+    size_t size; // bytes per PUT body, the log does not record them
+    bool keep_alive; // reuse connections between requests
+    const char *out; // result file
+    const char *baseline; // earlier result to compare against
+    double threshold; // allowed change in percent before a regression is flagged
+} config_t;
+
+static config_t cfg = {
+    .host = "127.0.0.1",
+    .port = 8080,
+    .clients = 8,
+    .loops = 1,
+    .size = 4096,
+    .threshold = 10,
+};
+
+// one logged request
+typedef struct entry {
+    char *uri;
+    bool get;
+    int status; // status the server logged
+    unsigned long request_id;
+} entry_t;
+
+typedef struct client {
+    pthread_t tid;
+    int fd; // kept-alive connection or -1
+    size_t *items; // indexes of this client's entries, in log order
+    size_t count, cap;
+    samples_t latency;
+    uint64_t errors; // requests that got no answer
+    uint64_t diverged; // answers whose status differs from the log, first loop only
+} client_t;
+
+static entry_t *entries;
+static size_t entry_count;
+static char *put_body;
+static uint64_t start_ns;
+static struct sockaddr_in server_addr;
+
+static uint64_t hash_uri(const char *uri) {
+    uint64_t h = 14695981039346656037ULL;
+    for (; *uri; uri++) {
+        h = (h ^ (unsigned char) *uri) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// splits a log line into an entry. the URI may contain commas, so the
+// status and request id are taken from the end
+static bool parse_line(char *line, entry_t *e) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *first = strchr(line, ',');
+    char *last = strrchr(line, ',');
+    if (!first || last == first) {
+        return false;
+    }
+    *last = '\0';
+    char *second_last = strrchr(line, ',');
+    if (second_last == first) {
+        return false;
+    }
+    *first = '\0';
+    *second_last = '\0';
+    if (strcmp(line, "GET") != 0 && strcmp(line, "PUT") != 0) {
+        return false;
+    }
+    char *end;
+    e->get = line[0] == 'G';
+    e->status = strtol(second_last + 1, &end, 10);
+    if (end == second_last + 1 || *end != '\0') {
+        return false;
+    }
+    e->request_id = strtoul(last + 1, NULL, 10);
+    e->uri = strdup(first + 1);
+    return e->uri && e->uri[0];
+}
+
+static bool read_log(const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    size_t cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, f) > 0) {
+        if (entry_count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            entry_t *grown = realloc(entries, cap * sizeof(entry_t));
+            if (!grown) {
+                break;
+            }
+            entries = grown;
+        }
+        if (parse_line(line, &entries[entry_count])) {
+            entry_count++;
+        }
+    }
+    free(line);
+    if (f != stdin) {
+        fclose(f);
+    }
+    return entry_count > 0;
+}
+
+static bool client_add(client_t *c, size_t item) {
+    if (c->count == c->cap) {
+        size_t cap = c->cap ? c->cap * 2 : 256;
+        size_t *grown = realloc(c->items, cap * sizeof(size_t));
+        if (!grown) {
+            return false;
+        }
+        c->items = grown;
+        c->cap = cap;
+    }
+    c->items[c->count++] = item;
+    return true;
+}
+
+// a URI existed before the log started if its first request found it there
+static bool existed_before(const entry_t *first) {
+    if (first->get) {
+        return first->status == 200 || first->status == 206 || first->status == 304;
+    }
+    return first->status == 200;
+}
+
+// gives every URI to a client and creates the URIs that already existed
+static bool distribute(client_t *clients) {
+    // open addressing over the URIs, each slot keeps the first entry of a URI
+    size_t slots = 1;
+    while (slots < entry_count * 2) {
+        slots <<= 1;
+    }
+    size_t *first = malloc(slots * sizeof(size_t));
+    if (!first) {
+        return false;
+    }
+    memset(first, 0xff, slots * sizeof(size_t));
+
+    int fd = -1;
+    bool ok = true;
+    for (size_t i = 0; i < entry_count && ok; i++) {
+        uint64_t h = hash_uri(entries[i].uri);
+        size_t slot = h & (slots - 1);
+        while (first[slot] != SIZE_MAX && strcmp(entries[first[slot]].uri, entries[i].uri) != 0) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (first[slot] == SIZE_MAX) {
+            first[slot] = i;
+            if (existed_before(&entries[i])) {
+                int status = http_request(
+                    &server_addr, &fd, true, false, entries[i].uri, 0, put_body, cfg.size);
+                if (status != 200 && status != 201) {
+                    fprintf(stderr, "replay: creating /%s failed\n", entries[i].uri);
+                    ok = false;
+                }
+            }
+        }
+        ok = ok && client_add(&clients[h % cfg.clients], i);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(first);
+    return ok;
+}
+
+static void *client_thread(void *arg) {
+    client_t *c = arg;
+    uint64_t interval = cfg.rate > 0 ? (uint64_t) (1e9 / cfg.rate) : 0;
+
+    for (int loop = 0; loop < cfg.loops; loop++) {
+        for (size_t k = 0; k < c->count; k++) {
+            size_t i = c->items[k];
+            const entry_t *e = &entries[i];
+            uint64_t issued;
+            if (interval) {
+                // the request's place in the whole log sets its time
+                issued = start_ns + ((uint64_t) loop * entry_count + i) * interval;
+                sleep_until(issued);
+            } else {
+                issued = now_ns();
+            }
+
+            int status = http_request(&server_addr, &c->fd, cfg.keep_alive, e->get, e->uri,
+                e->request_id, put_body, cfg.size);
+            if (status < 0) {
+                c->errors++;
+                continue;
+            }
+            samples_add(&c->latency, now_ns() - issued);
+            if (loop == 0 && status != e->status) {
+                c->diverged++;
+            }
+        }
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-h host] [-p port] [-c clients] [-r rate] [-n loops] [-s put_bytes]\n"
+        "          [-K] [-o result_file] [-b baseline_file] [-T threshold_percent] <log>\n",
+        prog);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:r:n:s:Ko:b:T:")) != -1) {
+        if (opt == 'h') {
+            cfg.host = optarg;
+        } else if (opt == 'p') {
+            cfg.port = atoi(optarg);
+        } else if (opt == 'c') {
+            cfg.clients = atoi(optarg);
+        } else if (opt == 'r') {
+            cfg.rate = atof(optarg);
+        } else if (opt == 'n') {
+            cfg.loops = atoi(optarg);
+        } else if (opt == 's') {
+            cfg.size = strtoull(optarg, NULL, 10);
+        } else if (opt == 'K') {
+            cfg.keep_alive = true;
+        } else if (opt == 'o') {
+            cfg.out = optarg;
+        } else if (opt == 'b') {
+            cfg.baseline = optarg;
+        } else if (opt == 'T') {
+            cfg.threshold = atof(optarg);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || cfg.clients < 1 || cfg.loops < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(cfg.port);
+    if (inet_pton(AF_INET, cfg.host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "replay: bad address %s\n", cfg.host);
+        return EXIT_FAILURE;
+    }
+    if (!read_log(argv[optind])) {
+        fprintf(stderr, "replay: no GET or PUT lines in %s\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    put_body = malloc(cfg.size ? cfg.size : 1);
+    client_t *clients = calloc(cfg.clients, sizeof(client_t));
+    if (!put_body || !clients) {
+        return EXIT_FAILURE;
+    }
+    memset(put_body, 'x', cfg.size);
+    for (int i = 0; i < cfg.clients; i++) {
+        clients[i].fd = -1;
+    }
+    if (!distribute(clients)) {
+        return EXIT_FAILURE;
+    }
+
+    start_ns = now_ns();
+    for (int i = 0; i < cfg.clients; i++) {
+        pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+    }
+
+    samples_t all = { 0 };
+    uint64_t errors = 0, diverged = 0;
+    for (int i = 0; i < cfg.clients; i++) {
+        pthread_join(clients[i].tid, NULL);
+        errors += clients[i].errors;
+        diverged += clients[i].diverged;
+        samples_merge(&all, &clients[i].latency);
+        free(clients[i].latency.v);
+        free(clients[i].items);
+    }
+    double elapsed = (now_ns() - start_ns) / 1e9;
+    samples_sort(&all);
+
+    char result[512];
+    snprintf(result, sizeof(result),
+        "mode=%s\nclients=%d\nrate=%.0f\nloops=%d\nlogged=%zu\nrequests=%zu\nerrors=%lu\n"
+        "diverged=%lu\nthroughput_rps=%.1f\np50_us=%.1f\np90_us=%.1f\np99_us=%.1f\n"
+        "p999_us=%.1f\nmax_us=%.1f\n",
+        cfg.rate > 0 ? "open" : "closed", cfg.clients, cfg.rate, cfg.loops, entry_count, all.n,
+        (unsigned long) errors, (unsigned long) diverged, all.n / elapsed,
+        percentile_us(&all, 0.5), percentile_us(&all, 0.9), percentile_us(&all, 0.99),
+        percentile_us(&all, 0.999), percentile_us(&all, 1.0));
+    fputs(result, stdout);
+    if (cfg.out) {
+        FILE *f = fopen(cfg.out, "w");
+        if (!f || fputs(result, f) < 0 || fclose(f) != 0) {
+            fprintf(stderr, "replay: cannot write %s\n", cfg.out);
+        }
+    }
+
+    int status = EXIT_SUCCESS;
+    if (cfg.baseline) {
+        bool worse = regressed(cfg.baseline, "throughput_rps", all.n / elapsed, true, cfg.threshold);
+        worse |= regressed(cfg.baseline, "p50_us", percentile_us(&all, 0.5), false, cfg.threshold);
+        worse |= regressed(cfg.baseline, "p99_us", percentile_us(&all, 0.99), false, cfg.threshold);
+        status = worse ? 2 : EXIT_SUCCESS;
+    }
+    free(all.v);
+    for (size_t i = 0; i < entry_count; i++) {
+        free(entries[i].uri);
+    }
+    free(entries);
+    free(clients);
+    free(put_body);
+    return status;
+}
@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include "blob_store.h"
+#include "sha256.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+// bytes read at a time while hashing, the body was just written and is in the page cache
+#define HASH_BUF 65536
+// extended attribute holding a blob's name, so it can be found from any of its links
+#define NAME_XATTR "user.httpserver.sha256"
+
+// structure for the store
+typedef struct blob_store {
+    char *dir;
+    size_t dir_len;
+    // serializes linking to and removing blobs, so a blob cannot be removed
+    // between a PUT finding it and linking to it
+    pthread_mutex_t lock;
+} blob_store_t;
+
+blob_store_t *blob_store_new(const char *dir) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        return NULL;
+    }
+    blob_store_t *s = calloc(1, sizeof(blob_store_t));
+    if (!s) {
+        return NULL;
+    }
+    s->dir = strdup(dir);
+    if (!s->dir) {
+        free(s);
+        return NULL;
+    }
+    s->dir_len = strlen(dir);
+    pthread_mutex_init(&s->lock, NULL);
+    return s;
+}
+
+void blob_store_delete(blob_store_t **s) {
+    if (!s || !*s) {
+        return;
+    }
+    pthread_mutex_destroy(&(*s)->lock);
+    free((*s)->dir);
+    free(*s);
+    *s = NULL;
+}
+
+bool blob_store_contains(blob_store_t *s, const char *uri) {
+    return strncmp(uri, s->dir, s->dir_len) == 0 && (uri[s->dir_len] == '/' || !uri[s->dir_len]);
+}
+
+// hashes the whole file behind fd into a hex name
+static bool hash_file(int fd, char name[2 * SHA256_DIGEST + 1]) {
+    char *buf = malloc(HASH_BUF);
+    if (!buf) {
+        return false;
+    }
+    sha256_t h;
+    sha256_init(&h);
+    off_t off = 0;
+    ssize_t n;
+    while ((n = pread(fd, buf, HASH_BUF, off)) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            free(buf);
+            return false;
+        }
+        sha256_update(&h, buf, n);
+        off += n;
+    }
+    free(buf);
+
+    uint8_t digest[SHA256_DIGEST];
+    sha256_final(&h, digest);
+    for (int i = 0; i < SHA256_DIGEST; i++) {
+        snprintf(name + 2 * i, 3, "%02x", digest[i]);
+    }
+    return true;
+}
+
+// finds the name of the blob behind fd from its attribute. this runs under
+// the URI's locks, so a file without one is never hashed again: it was not
+// filed in the store
+static bool blob_name(int fd, char name[2 * SHA256_DIGEST + 1]) {
+    if (fgetxattr(fd, NAME_XATTR, name, 2 * SHA256_DIGEST) == 2 * SHA256_DIGEST) {
+        name[2 * SHA256_DIGEST] = '\0';
+        return true;
+    }
+    return false;
+}
+
+bool blob_store_add(blob_store_t *s, const char *path, int *fd) {
+    char name[2 * SHA256_DIGEST + 1];
+    if (!hash_file(*fd, name)) {
+        return false;
+    }
+    char blob[PATH_MAX], dup[PATH_MAX];
+    if (snprintf(blob, sizeof(blob), "%s/%s", s->dir, name) >= (int) sizeof(blob)
+        || snprintf(dup, sizeof(dup), "%s.dup", path) >= (int) sizeof(dup)) {
+        return false;
+    }
+    // the blob could not be found again to remove it, so without extended
+    // attributes the body is stored as it is
+    if (fsetxattr(*fd, NAME_XATTR, name, 2 * SHA256_DIGEST, 0) != 0) {
+        return false;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    // a new body becomes the blob
+    if (link(path, blob) == 0) {
+        pthread_mutex_unlock(&s->lock);
+        return true;
+    }
+    if (errno != EEXIST) {
+        pthread_mutex_unlock(&s->lock);
+        return false;
+    }
+
+    // a known one is swapped for a link to the blob under the same name. the
+    // temp names from mkstemp all have the same length, so path.dup is free
+    int blob_fd = -1;
+    if (link(blob, dup) == 0) {
+        if (rename(dup, path) == 0) {
+            blob_fd = open(path, O_RDONLY | O_CLOEXEC);
+        } else {
+            unlink(dup);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (blob_fd < 0) {
+        return false;
+    }
+
+    // the blob keeps its modification time, which every URI linking to it
+    // shares, so cached stats and ETags of those URIs stay valid
+    close(*fd);
+    *fd = blob_fd;
+    return true;
+}
+
+void blob_store_hold(blob_store_t *s, const char *uri, blob_ref_t *ref) {
+    (void) s;
+    ref->fd = open(uri, O_RDONLY | O_CLOEXEC);
+}
+
+// removes the blob behind fd if it is linked only from the store
+static void drop_orphan(blob_store_t *s, int fd) {
+    struct stat st;
+    char name[2 * SHA256_DIGEST + 1];
+    char blob[PATH_MAX];
+    if (fstat(fd, &st) == 0 && st.st_nlink == 1 && blob_name(fd, name)
+        && snprintf(blob, sizeof(blob), "%s/%s", s->dir, name) < (int) sizeof(blob)) {
+        pthread_mutex_lock(&s->lock);
+        struct stat blob_st;
+        if (stat(blob, &blob_st) == 0 && blob_st.st_ino == st.st_ino
+            && blob_st.st_dev == st.st_dev && blob_st.st_nlink == 1) {
+            unlink(blob);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+void blob_store_forget(blob_store_t *s, int fd) {
+    drop_orphan(s, fd);
+}
+
+void blob_store_release(blob_store_t *s, blob_ref_t *ref) {
+    if (ref->fd < 0) {
+        return;
+    }
+    // a blob whose last URI is gone is linked only from the store
+    drop_orphan(s, ref->fd);
+    close(ref->fd);
+    ref->fd = -1;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+
+// content-addressed storage for PUT bodies. every distinct body is kept once
+// in the store directory under the hex SHA-256 of its contents, and each URI
+// holding that body is a hard link to it. a PUT whose body the store already
+// has drops its own copy before it is written back and publishes another link
+// to the stored blob instead, so identical uploads take no further space and,
+// as the dropped copy is never synced, no further data writes. the files stay
+// ordinary files, so GET sends them exactly as before. a blob is removed once
+// the last URI linking to it has been replaced.
+typedef struct blob_store blob_store_t;
+
+// opens the store in the directory dir, creating it if needed. URIs must be
+// on the same file system as dir to be deduplicated
+blob_store_t *blob_store_new(const char *dir);
+
+// frees the store, the blobs stay on disk
+void blob_store_delete(blob_store_t **s);
+
+// whether uri lies inside the store directory, which clients may not write
+bool blob_store_contains(blob_store_t *s, const char *uri);
+
+// files the received body at path in the store. path must not be published
+// yet. if the store already holds the same contents, path is replaced by a
+// link to that blob and *fd is reopened on it. returns false if the body
+// could not be hashed, named in an extended attribute or linked, path and *fd
+// are then left as they were
+bool blob_store_add(blob_store_t *s, const char *path, int *fd);
+
+// undoes blob_store_add for a body that was not published. called once its
+// path has been removed, with fd still open on it. the blob goes again unless
+// a URI links to it
+void blob_store_forget(blob_store_t *s, int fd);
+
+// the file a PUT is about to replace, taken under the URI's writer lock
+typedef struct blob_ref {
+    int fd; // -1 if uri did not exist
+} blob_ref_t;
+
+// remembers the file uri currently refers to
+void blob_store_hold(blob_store_t *s, const char *uri, blob_ref_t *ref);
+
+// called once uri has been replaced, or the replacement failed. removes the
+// held file's blob if no URI links to it any more
+void blob_store_release(blob_store_t *s, blob_ref_t *ref);
@@ -0,0 +1,200 @@
+// tests blob_store.c in a fresh temporary directory the way the server uses
+// it: bodies are filed before they are renamed over their URI, duplicates
+// become links to the stored blob, and a blob goes once the last URI linking
+// to it is replaced or its only PUT fails. "blob_storetest -v" prints the
+// store after each step
+
+#define _GNU_SOURCE
+#include "blob_store.h"
+#include "sha256.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#define STORE ".httpserver_blobs"
+
+static bool verbose;
+
+// the store path of the blob holding text
+static void blob_path(const char *text, char path[PATH_MAX]) {
+    sha256_t h;
+    uint8_t digest[SHA256_DIGEST];
+    sha256_init(&h);
+    sha256_update(&h, text, strlen(text));
+    sha256_final(&h, digest);
+    int len = snprintf(path, PATH_MAX, "%s/", STORE);
+    for (int i = 0; i < SHA256_DIGEST; i++) {
+        len += snprintf(path + len, PATH_MAX - len, "%02x", digest[i]);
+    }
+}
+
+// blobs in the store
+static int blob_count(void) {
+    DIR *d = opendir(STORE);
+    assert(d);
+    int count = 0;
+    for (struct dirent *e; (e = readdir(d));) {
+        if (e->d_name[0] != '.') {
+            count++;
+            if (verbose) {
+                printf("%s ", e->d_name);
+            }
+        }
+    }
+    closedir(d);
+    if (verbose) {
+        printf("(%d)\n", count);
+    }
+    return count;
+}
+
+// receives a body into a temp file as a PUT does, returns its descriptor
+static int receive(const char *temp, const char *text) {
+    int fd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(write(fd, text, strlen(text)) == (ssize_t) strlen(text));
+    return fd;
+}
+
+// PUTs text to uri through the store and returns the inode uri now has
+static ino_t put(blob_store_t *s, const char *uri, const char *text) {
+    int fd = receive(".httpserver_put", text);
+    blob_ref_t old;
+    blob_store_hold(s, uri, &old);
+    assert(blob_store_add(s, ".httpserver_put", &fd));
+    assert(rename(".httpserver_put", uri) == 0);
+    blob_store_release(s, &old);
+
+    // the descriptor handed back is the published file's, whatever it was swapped for
+    struct stat fd_st, uri_st;
+    assert(fstat(fd, &fd_st) == 0 && stat(uri, &uri_st) == 0);
+    assert(fd_st.st_ino == uri_st.st_ino);
+    char buf[64];
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    assert(n == (ssize_t) strlen(text) && memcmp(buf, text, n) == 0);
+    close(fd);
+    return uri_st.st_ino;
+}
+
+static ino_t ino_of(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_ino : 0;
+}
+
+// identical bodies share one blob, which goes with its last URI
+static void test_dedup(blob_store_t *s) {
+    char same[PATH_MAX], other[PATH_MAX];
+    blob_path("same", same);
+    blob_path("other", other);
+
+    ino_t a = put(s, "a", "same");
+    assert(a == ino_of(same) && blob_count() == 1);
+    ino_t b = put(s, "b", "same");
+    assert(b == a && blob_count() == 1);
+    struct stat st;
+    assert(stat(same, &st) == 0 && st.st_nlink == 3);
+
+    // replacing one of the URIs keeps the blob for the other
+    assert(put(s, "a", "other") == ino_of(other));
+    assert(ino_of(same) == b && blob_count() == 2);
+    // replacing the last one removes it
+    assert(put(s, "b", "other") == ino_of(other));
+    assert(ino_of(same) == 0 && blob_count() == 1);
+    assert(stat(other, &st) == 0 && st.st_nlink == 3);
+
+    // as does replacing the URIs with a body that is not filed
+    assert(unlink("a") == 0 && unlink("b") == 0);
+    blob_ref_t old = { .fd = open(other, O_RDONLY) };
+    blob_store_release(s, &old);
+    assert(old.fd == -1 && ino_of(other) == 0 && blob_count() == 0);
+    if (verbose) {
+        printf("dedup: shared blobs removed with their last URI\n");
+    }
+}
+
+// a body filed for a PUT that then failed is dropped again, unless another
+// URI links to it
+static void test_forget(blob_store_t *s) {
+    char lost[PATH_MAX];
+    blob_path("lost", lost);
+
+    int fd = receive(".httpserver_put", "lost");
+    assert(blob_store_add(s, ".httpserver_put", &fd));
+    assert(ino_of(lost) != 0 && blob_count() == 1);
+    assert(unlink(".httpserver_put") == 0);
+    blob_store_forget(s, fd);
+    close(fd);
+    assert(ino_of(lost) == 0 && blob_count() == 0);
+
+    put(s, "kept", "lost");
+    fd = receive(".httpserver_put", "lost");
+    assert(blob_store_add(s, ".httpserver_put", &fd));
+    assert(unlink(".httpserver_put") == 0);
+    blob_store_forget(s, fd);
+    close(fd);
+    assert(ino_of(lost) == ino_of("kept") && blob_count() == 1);
+    if (verbose) {
+        printf("forget: failed bodies dropped unless linked elsewhere\n");
+    }
+}
+
+// files that are not blobs are left alone when replaced
+static void test_not_blobs(blob_store_t *s) {
+    char kept[PATH_MAX];
+    blob_path("kept", kept);
+    int fd = receive("plain", "plain");
+    close(fd);
+    put(s, "plain", "kept");
+    assert(ino_of("plain") == ino_of(kept) && blob_count() == 2);
+
+    blob_ref_t none;
+    blob_store_hold(s, "nothing", &none);
+    assert(none.fd == -1);
+    blob_store_release(s, &none);
+
+    assert(blob_store_contains(s, STORE) && blob_store_contains(s, STORE "/x"));
+    assert(!blob_store_contains(s, STORE "x") && !blob_store_contains(s, "kept"));
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) st, (void) flag, (void) ftw;
+    return remove(path);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    // the store lives next to the URIs, here in a directory of our own
+    char dir[] = "/tmp/blob_storetest_XXXXXX";
+    assert(mkdtemp(dir));
+    assert(chdir(dir) == 0);
+
+    blob_store_t *s = blob_store_new(STORE);
+    assert(s);
+    int probe = receive("probe", "probe");
+    if (fsetxattr(probe, "user.probe", "1", 1, 0) == 0) {
+        test_dedup(s);
+        test_forget(s);
+        test_not_blobs(s);
+    } else {
+        // without extended attributes nothing is filed
+        assert(!blob_store_add(s, "probe", &probe) && blob_count() == 0);
+        printf("blob_storetest: no user extended attributes in %s, store not tested\n", dir);
+    }
+    close(probe);
+    blob_store_delete(&s);
+    assert(!s);
+
+    assert(chdir("/") == 0 && nftw(dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS) == 0);
+    printf("blob_storetest: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+#include "chunked.h"
+#include "io_backend.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// maximum size of a request head, the same limit the event loop peeks with
+#define HEAD_MAX 2048
+// maximum length of a chunk size line or a trailer line
+#define CHUNK_LINE_MAX 1024
+// a chunk size beyond 15 hex digits would overflow a 64 bit length
+#define SIZE_DIGITS_MAX 15
+
+// peeks at fd until the buffered bytes contain end or fill cap. recv with
+// MSG_PEEK returns as soon as anything is buffered, so while the bytes are
+// incomplete MSG_WAITALL is used to sleep until at least one more arrives.
+// returns the number of bytes peeked, 0 when the peer closed first, -1 on error
+static ssize_t peek_until(int fd, char *buf, size_t cap, const char *end, size_t end_len) {
+    ssize_t n;
+    do {
+        n = recv(fd, buf, cap, MSG_PEEK);
+    } while (n < 0 && errno == EINTR);
+    while (n > 0 && (size_t) n < cap && !memmem(buf, n, end, end_len)) {
+        ssize_t more = recv(fd, buf, n + 1, MSG_PEEK | MSG_WAITALL);
+        if (more < 0 && errno == EINTR) {
+            continue;
+        }
+        if (more <= n) {
+            return more < 0 ? -1 : 0;
+        }
+        do {
+            n = recv(fd, buf, cap, MSG_PEEK);
+        } while (n < 0 && errno == EINTR);
+    }
+    return n;
+}
+
+// consumes exactly len bytes that are known to be buffered
+static bool consume(int fd, char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = recv(fd, buf + done, len - done, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// checks that the last transfer coding in a Transfer-Encoding value is chunked
+static bool last_coding_chunked(const char *value, size_t len) {
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        len--;
+    }
+    size_t start = len;
+    while (start > 0 && value[start - 1] != ',') {
+        start--;
+    }
+    while (start < len && (value[start] == ' ' || value[start] == '\t')) {
+        start++;
+    }
+    return len - start == 7 && strncasecmp(value + start, "chunked", 7) == 0;
+}
+
+// copies a request target into req->uri without its leading '/'. only the
+// targets conn_parse accepts are, a '/' and up to 63 letters, digits, '.'
+// or '-', so a chunked PUT cannot name a path outside the served directory,
+// a subdirectory or the server's own .httpserver_ files
+static void copy_uri(chunked_request_t *req, const char *target, size_t len) {
+    req->bad_uri = len < 2 || target[0] != '/' || len > CHUNKED_URI_MAX;
+    if (req->bad_uri) {
+        return;
+    }
+    for (size_t i = 1; i < len; i++) {
+        char ch = target[i];
+        bool plain = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+                     || (ch >= '0' && ch <= '9') || ch == '.' || ch == '-';
+        if (!plain) {
+            req->bad_uri = true;
+            return;
+        }
+    }
+    memcpy(req->uri, target + 1, len - 1);
+    req->uri[len - 1] = '\0';
+    req->bad_uri = strcmp(req->uri, ".") == 0 || strcmp(req->uri, "..") == 0;
+}
+
+// copies a header value, dropping the optional whitespace around it
+static void copy_value(char *dest, size_t size, const char *value, size_t len) {
+    while (len > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        len--;
+    }
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+        len--;
+    }
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(dest, value, len);
+    dest[len] = '\0';
+}
+
+int chunked_peek_request(int fd, chunked_request_t *req) {
+    char head[HEAD_MAX + 1];
+    ssize_t n = peek_until(fd, head, HEAD_MAX, "\r\n\r\n", 4);
+    if (n <= 0) {
+        return -1;
+    }
+    char *end = memmem(head, n, "\r\n\r\n", 4);
+    if (!end || n < 4 || memcmp(head, "PUT ", 4) != 0) {
+        return 0;
+    }
+    size_t head_len = end - head + 4;
+    head[head_len] = '\0';
+
+    // request line, anything but a well formed HTTP/1.1 one is left to conn_parse
+    char *line_end = strstr(head, "\r\n");
+    char *target = head + 4;
+    char *space = memchr(target, ' ', line_end - target);
+    if (!space || line_end - space != 9 || memcmp(space, " HTTP/1.1", 9) != 0) {
+        return 0;
+    }
+
+    memset(req, 0, sizeof(*req));
+    bool chunked = false;
+    for (char *line = line_end + 2; *line != '\r'; line = line_end + 2) {
+        line_end = strstr(line, "\r\n");
+        char *colon = memchr(line, ':', line_end - line);
+        if (!colon) {
+            return 0;
+        }
+        size_t name_len = colon - line;
+        char *value = colon + 1;
+        size_t value_len = line_end - value;
+        if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            chunked = last_coding_chunked(value, value_len);
+        } else if (name_len == 10 && strncasecmp(line, "Request-Id", 10) == 0) {
+            copy_value(req->request_id, sizeof(req->request_id), value, value_len);
+        } else if (name_len == 13 && strncasecmp(line, "Content-Range", 13) == 0) {
+            copy_value(req->content_range, sizeof(req->content_range), value, value_len);
+        } else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+            char connection[16];
+            copy_value(connection, sizeof(connection), value, value_len);
+            req->close = strcasecmp(connection, "close") == 0;
+        } else if (name_len == 6 && strncasecmp(line, "Expect", 6) == 0) {
+            char expect[16];
+            copy_value(expect, sizeof(expect), value, value_len);
+            req->expect_continue = strcasecmp(expect, "100-continue") == 0;
+        }
+    }
+    if (!chunked) {
+        return 0;
+    }
+
+    copy_uri(req, target, space - target);
+    return consume(fd, head, head_len) ? 1 : -1;
+}
+
+// reads one CRLF terminated line into line and strips the line ending.
+// returns its length, or -1 when the line is too long or the peer closed
+static ssize_t read_line(int fd, char *line, size_t cap) {
+    ssize_t n = peek_until(fd, line, cap - 1, "\n", 1);
+    if (n <= 0) {
+        return -1;
+    }
+    char *nl = memchr(line, '\n', n);
+    if (!nl) {
+        return -1;
+    }
+    size_t len = nl - line + 1;
+    if (!consume(fd, line, len)) {
+        return -1;
+    }
+    len--;
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    line[len] = '\0';
+    return len;
+}
+
+// parses a chunk size line, hex digits optionally followed by extensions
+static bool parse_chunk_size(const char *line, uint64_t *size) {
+    *size = 0;
+    int digits = 0;
+    for (; *line; line++, digits++) {
+        char ch = *line;
+        int value;
+        if (ch >= '0' && ch <= '9') {
+            value = ch - '0';
+        } else if (ch >= 'a' && ch <= 'f') {
+            value = ch - 'a' + 10;
+        } else if (ch >= 'A' && ch <= 'F') {
+            value = ch - 'A' + 10;
+        } else {
+            break;
+        }
+        if (digits == SIZE_DIGITS_MAX) {
+            return false;
+        }
+        *size = *size << 4 | value;
+    }
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return digits > 0 && (*line == '\0' || *line == ';');
+}
+
+int64_t chunked_recv(int fd, int out_fd, int64_t max) {
+    char line[CHUNK_LINE_MAX];
+    char buf[CHUNKED_BUF];
+    int64_t total = 0;
+
+    while (1) {
+        uint64_t size;
+        if (read_line(fd, line, sizeof(line)) < 0 || !parse_chunk_size(line, &size)) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (size > (uint64_t) (max - total)) {
+            return -1;
+        }
+
+        // the chunk data goes to the file as it arrives, at most buf at a time
+        while (size > 0) {
+            size_t want = size < sizeof(buf) ? size : sizeof(buf);
+            ssize_t n = recv(fd, buf, want, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || !io_writev_full(out_fd, &(struct iovec) { buf, n }, 1)) {
+                return -1;
+            }
+            size -= n;
+            total += n;
+        }
+        if (read_line(fd, line, sizeof(line)) != 0) {
+            return -1;
+        }
+    }
+
+    // trailer fields are not used, they are read up to the blank line ending the body
+    ssize_t len;
+    while ((len = read_line(fd, line, sizeof(line))) > 0) {
+    }
+    return len == 0 ? total : -1;
+}
+
+void chunked_writer_init(chunked_writer_t *w, int fd, const char *head) {
+    w->fd = fd;
+    w->head = head;
+    w->started = false;
+    w->failed = false;
+    w->sent = 0;
+    w->len = 0;
+}
+
+// sends the buffered data as one chunk, preceded by the head when it has not
+// gone out yet and followed by the last chunk when last is set, in one writev
+static bool flush(chunked_writer_t *w, bool last) {
+    static const char encoding[] = "Transfer-Encoding: chunked\r\n\r\n";
+    static const char last_chunk[] = "0\r\n\r\n";
+    if (w->failed) {
+        return false;
+    }
+
+    struct iovec iov[6];
+    int count = 0;
+    char size_line[24];
+    if (!w->started) {
+        iov[count++] = (struct iovec) { (char *) w->head, strlen(w->head) };
+        iov[count++] = (struct iovec) { (char *) encoding, sizeof(encoding) - 1 };
+    }
+    if (w->len > 0) {
+        int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", w->len);
+        iov[count++] = (struct iovec) { size_line, n };
+        iov[count++] = (struct iovec) { w->buf, w->len };
+        iov[count++] = (struct iovec) { (char *) "\r\n", 2 };
+    }
+    if (last) {
+        iov[count++] = (struct iovec) { (char *) last_chunk, sizeof(last_chunk) - 1 };
+    }
+    if (count == 0) {
+        return true;
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+    w->started = true;
+    w->len = 0;
+    if (!io_writev_full(w->fd, iov, count)) {
+        w->failed = true;
+        return false;
+    }
+    w->sent += total;
+    return true;
+}
+
+bool chunked_write(chunked_writer_t *w, const char *data, size_t len) {
+    while (len > 0) {
+        if (w->len == sizeof(w->buf) && !flush(w, false)) {
+            return false;
+        }
+        size_t n = sizeof(w->buf) - w->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->buf + w->len, data, n);
+        w->len += n;
+        data += n;
+        len -= n;
+    }
+    return !w->failed;
+}
+
+bool chunked_end(chunked_writer_t *w) {
+    return flush(w, true);
+}
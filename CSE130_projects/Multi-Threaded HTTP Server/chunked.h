@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// the chunked transfer coding (RFC 9112 section 7.1) for request bodies and
+// generated responses. the helper library only reads bodies framed by
+// Content-Length, so a PUT whose body is chunked is recognized from the
+// peeked request head and its body is decoded straight off the socket into
+// a file, one chunk at a time, in constant memory.
+
+// limits of the fields kept from a chunked request head. a target is at
+// most 64 characters, the leading '/' included, as for conn_parse
+#define CHUNKED_URI_MAX 64
+#define CHUNKED_ID_MAX 128
+#define CHUNKED_RANGE_MAX 64
+// size of the buffer used to decode request bodies and to frame responses
+#define CHUNKED_BUF 16384
+
+// what is kept from the head of a PUT with a chunked body
+typedef struct chunked_request {
+    char uri[CHUNKED_URI_MAX]; // target without the leading '/'
+    char request_id[CHUNKED_ID_MAX]; // Request-Id header, empty when absent
+    char content_range[CHUNKED_RANGE_MAX]; // Content-Range header, empty when absent
+    bool close; // the client sent Connection: close
+    bool expect_continue; // the client waits for 100 Continue before the body
+    bool bad_uri; // the target is not a plain path inside the served directory
+} chunked_request_t;
+
+// waits until the request head on fd is complete, without consuming it.
+// returns 1 when it is a PUT with a chunked body, in which case the head is
+// consumed and req is filled in. returns 0 for any other request, left on
+// the socket for conn_parse, and -1 when the peer closed or the read failed
+int chunked_peek_request(int fd, chunked_request_t *req);
+
+// decodes a chunked body from fd and writes it to out_fd. nothing past the
+// end of the body is read, so a pipelined request stays on the socket.
+// returns the number of body bytes written, or -1 on malformed framing, a
+// closed connection, a failed write or a body longer than max bytes, of
+// which nothing past max is written
+int64_t chunked_recv(int fd, int out_fd, int64_t max);
+
+// frames a response body as chunks of up to CHUNKED_BUF bytes. the head is
+// written together with the first chunk, so a response that fails before
+// producing anything can still be answered with an error instead
+typedef struct chunked_writer {
+    int fd;
+    const char *head; // status line and header lines, each ending in \r\n
+    bool started; // the head has been sent
+    bool failed; // a write failed, everything after it is dropped
+    uint64_t sent; // bytes written to fd, head and framing included
+    size_t len; // bytes waiting in buf
+    char buf[CHUNKED_BUF];
+} chunked_writer_t;
+
+// prepares a writer for a response on fd with the given head. the
+// Transfer-Encoding header is added by the writer
+void chunked_writer_init(chunked_writer_t *w, int fd, const char *head);
+
+// adds data to the body, sending a chunk whenever the buffer fills up
+bool chunked_write(chunked_writer_t *w, const char *data, size_t len);
+
+// sends what is buffered and the last chunk that ends the body
+bool chunked_end(chunked_writer_t *w);
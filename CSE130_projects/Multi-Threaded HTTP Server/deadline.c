@@ -0,0 +1,175 @@
+#include "deadline.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// wheels, so arming a deadline rarely contends with another worker
+#define SHARDS 16
+
+// one wheel and the lock serializing it
+typedef struct deadline_shard {
+    pthread_mutex_t lock;
+    timer_wheel_t *wheel;
+} deadline_shard_t;
+
+// structure for the deadlines
+typedef struct deadlines {
+    deadline_shard_t shards[SHARDS];
+    unsigned tick_ms;
+    pthread_t thread;
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stop_cond;
+    bool stop;
+    bool running; // the timer thread was started
+} deadlines_t;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// reads how many bytes a TCP socket has received so far. returns false for
+// other sockets, or kernels that do not report it
+static bool bytes_received(int fd, uint64_t *received) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0
+        || len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received)) {
+        return false;
+    }
+    *received = info.tcpi_bytes_received;
+    return true;
+}
+
+// a deadline passed, called with its shard locked. a body that is still
+// arriving gets another timeout_ms, anything else is cut off
+static void expire(wheel_timer_t *timer, void *arg) {
+    deadline_t *dl = (deadline_t *) timer;
+    timer_wheel_t *wheel = arg;
+
+    if (dl->kind == DEADLINE_BODY) {
+        uint64_t received = 0;
+        bytes_received(dl->fd, &received);
+        if (received != dl->received) {
+            dl->received = received;
+            timer_wheel_add(wheel, &dl->timer, now_ms() + dl->timeout_ms);
+            return;
+        }
+    }
+
+    shutdown(dl->fd, SHUT_RDWR);
+    metrics_timeout(dl->kind == DEADLINE_BODY ? METRIC_BODY_TIMEOUT : METRIC_HEADER_TIMEOUT);
+}
+
+// advances every wheel once per tick until deadlines_delete
+static void *timer_thread(void *arg) {
+    deadlines_t *d = arg;
+    pthread_mutex_lock(&d->stop_lock);
+    while (!d->stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long) d->tick_ms * 1000000;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&d->stop_cond, &d->stop_lock, &ts);
+        pthread_mutex_unlock(&d->stop_lock);
+
+        uint64_t now = now_ms();
+        for (int i = 0; i < SHARDS; i++) {
+            deadline_shard_t *s = &d->shards[i];
+            pthread_mutex_lock(&s->lock);
+            timer_wheel_advance(s->wheel, now, expire, s->wheel);
+            pthread_mutex_unlock(&s->lock);
+        }
+
+        pthread_mutex_lock(&d->stop_lock);
+    }
+    pthread_mutex_unlock(&d->stop_lock);
+    return NULL;
+}
+
+deadlines_t *deadlines_new(unsigned tick_ms) {
+    deadlines_t *d = calloc(1, sizeof(deadlines_t));
+    if (!d) {
+        return NULL;
+    }
+    d->tick_ms = tick_ms ? tick_ms : 1;
+    pthread_mutex_init(&d->stop_lock, NULL);
+    pthread_cond_init(&d->stop_cond, NULL);
+
+    uint64_t now = now_ms();
+    bool ok = true;
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_init(&d->shards[i].lock, NULL);
+        d->shards[i].wheel = timer_wheel_new(now, d->tick_ms);
+        ok = ok && d->shards[i].wheel;
+    }
+
+    if (ok && pthread_create(&d->thread, NULL, timer_thread, d) == 0) {
+        d->running = true;
+        return d;
+    }
+    deadlines_delete(&d);
+    return NULL;
+}
+
+void deadlines_delete(deadlines_t **d) {
+    if (!d || !*d) {
+        return;
+    }
+
+    pthread_mutex_lock(&(*d)->stop_lock);
+    (*d)->stop = true;
+    pthread_cond_signal(&(*d)->stop_cond);
+    pthread_mutex_unlock(&(*d)->stop_lock);
+    if ((*d)->running) {
+        pthread_join((*d)->thread, NULL);
+    }
+
+    for (int i = 0; i < SHARDS; i++) {
+        timer_wheel_delete(&(*d)->shards[i].wheel);
+        pthread_mutex_destroy(&(*d)->shards[i].lock);
+    }
+    pthread_mutex_destroy(&(*d)->stop_lock);
+    pthread_cond_destroy(&(*d)->stop_cond);
+    free(*d);
+    *d = NULL;
+}
+
+void deadlines_arm(deadlines_t *d, deadline_t *dl, int fd, deadline_kind_t kind, int timeout_ms) {
+    dl->timer.slot = NULL;
+    dl->fd = fd;
+    dl->kind = kind;
+    dl->timeout_ms = timeout_ms > 0 ? timeout_ms : 1;
+    dl->received = 0;
+    dl->shard = NULL;
+    // without the byte count a body deadline would cut off uploads that are
+    // still arriving, so it is left to whoever feeds the socket
+    if (kind == DEADLINE_BODY && !bytes_received(fd, &dl->received)) {
+        return;
+    }
+    dl->shard = &d->shards[fd % SHARDS];
+
+    pthread_mutex_lock(&dl->shard->lock);
+    timer_wheel_add(dl->shard->wheel, &dl->timer, now_ms() + dl->timeout_ms);
+    pthread_mutex_unlock(&dl->shard->lock);
+}
+
+void deadlines_cancel(deadlines_t *d, deadline_t *dl) {
+    (void) d;
+    if (!dl->shard) {
+        return;
+    }
+    pthread_mutex_lock(&dl->shard->lock);
+    timer_wheel_cancel(dl->shard->wheel, &dl->timer);
+    pthread_mutex_unlock(&dl->shard->lock);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "timer_wheel.h"
+
+#include <stdint.h>
+
+// what a worker is blocked reading when its deadline passes
+typedef enum { DEADLINE_HEADER, DEADLINE_BODY } deadline_kind_t;
+
+// a deadline on a worker's blocking reads from one connection, usually on the
+// worker's stack. header deadlines bound the whole request head. body
+// deadlines fire only after timeout_ms without a byte arriving, so slow but
+// steady uploads are never cut off. arrivals are counted by TCP_INFO, so
+// body deadlines are only armed on TCP sockets. the socketpairs of h2c
+// streams get theirs from the h2c connection instead
+typedef struct deadline {
+    wheel_timer_t timer;
+    int fd;
+    deadline_kind_t kind;
+    int timeout_ms;
+    uint64_t received; // bytes the socket had received at the last check
+    struct deadline_shard *shard; // NULL when the deadline was not armed
+} deadline_t;
+
+// timer thread enforcing worker deadlines. an expired connection's socket is
+// shut down, which makes the blocked read fail so the worker drops it. the
+// descriptor is never closed here, the worker still owns it
+typedef struct deadlines deadlines_t;
+
+// creates the deadline wheels and starts their timer thread, ticking every tick_ms
+deadlines_t *deadlines_new(unsigned tick_ms);
+
+// stops the timer thread and frees the deadlines
+void deadlines_delete(deadlines_t **d);
+
+// starts a deadline of timeout_ms on fd. a body deadline on a socket that
+// is not TCP is not armed
+void deadlines_arm(deadlines_t *d, deadline_t *dl, int fd, deadline_kind_t kind, int timeout_ms);
+
+// stops a deadline. once this returns the socket will not be shut down by it
+void deadlines_cancel(deadlines_t *d, deadline_t *dl);
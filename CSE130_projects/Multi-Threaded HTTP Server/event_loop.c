@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include "event_loop.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+// maximum size of a request head (request line + headers)
+#define HEAD_MAX 2048
+// number of events handled per epoll_wait call
+#define MAX_EVENTS 64
+// resolution of the parked connections' deadlines, and how often the poller checks them
+#define TIMER_TICK_MS 50
+
+// states of a connection known to the event loop
+typedef enum {
+    CLIENT_READING, // parked, waiting for the rest of the next request head
+    CLIENT_DISPATCHED // request head complete, owned by a worker
+} client_state_t;
+
+// which deadline a parked connection is under
+typedef enum {
+    CLIENT_HEADER, // the request head must be complete by then
+    CLIENT_IDLE // kept alive, the next request must start by then
+} client_deadline_t;
+
+// per connection state, this is all an idle connection costs
+typedef struct client {
+    wheel_timer_t timer; // deadline while parked, first so expiry finds the client
+    int fd;
+    client_state_t state;
+    client_deadline_t deadline;
+    int served; // requests answered on this connection so far
+    struct client *expired; // next connection closed by the same expiry pass
+} client_t;
+
+// structure for the event loop
+typedef struct event_loop {
+    int epfd; // epoll instance watching all parked connections
+    int wakefd; // eventfd used to stop the poller thread
+    event_dispatch_t dispatch; // receives connections with a complete request head
+    pthread_t poller; // thread running the epoll loop
+    int max_requests; // requests allowed per connection
+    int idle_timeout_ms; // how long a kept-alive connection may stay silent
+    int header_timeout_ms; // how long a request head may take to arrive
+    client_t **clients; // client state indexed by fd
+    int max_clients; // size of clients, the descriptor limit
+    // deadlines of the parked connections. workers park connections while
+    // the poller expires them, so the wheel is shared under timer_lock
+    timer_wheel_t *timers;
+    pthread_mutex_t timer_lock;
+} event_loop_t;
+
+// returns the current monotonic time in milliseconds
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// checks whether a complete request head is buffered on the socket without
+// consuming it, so conn_parse can read the request as if it had just arrived.
+// returns 1 when ready, 0 when more data is needed, -1 when the peer is gone
+static int request_head_ready(int fd) {
+    char buf[HEAD_MAX];
+    ssize_t n = recv(fd, buf, sizeof(buf), MSG_PEEK);
+    if (n == 0) {
+        return -1;
+    }
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    // a head that fills the whole buffer is handed over so conn_parse can reject it
+    if (n == HEAD_MAX || memmem(buf, n, "\r\n\r\n", 4)) {
+        return 1;
+    }
+    return 0;
+}
+
+// sets or clears O_NONBLOCK on a file descriptor
+static void set_nonblocking(int fd, bool on) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) {
+        fcntl(fd, F_SETFL, on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+    }
+}
+
+// puts a parked connection under a header or idle deadline, replacing its
+// current one. the caller holds timer_lock
+static void client_arm_locked(event_loop_t *el, client_t *c, client_deadline_t deadline) {
+    int timeout_ms = deadline == CLIENT_HEADER ? el->header_timeout_ms : el->idle_timeout_ms;
+    c->deadline = deadline;
+    timer_wheel_add(el->timers, &c->timer, now_ms() + timeout_ms);
+}
+
+static void client_arm(event_loop_t *el, client_t *c, client_deadline_t deadline) {
+    pthread_mutex_lock(&el->timer_lock);
+    client_arm_locked(el, c, deadline);
+    pthread_mutex_unlock(&el->timer_lock);
+}
+
+static void client_disarm(event_loop_t *el, client_t *c) {
+    pthread_mutex_lock(&el->timer_lock);
+    timer_wheel_cancel(el->timers, &c->timer);
+    pthread_mutex_unlock(&el->timer_lock);
+}
+
+// forgets a connection and closes its socket
+static void client_close(event_loop_t *el, client_t *c) {
+    el->clients[c->fd] = NULL;
+    close(c->fd);
+    free(c);
+}
+
+// parks a connection in epoll until its next request head arrives, under the
+// given deadline. edge triggered, so a partial head does not wake the poller
+// until more bytes come. a pipelined request that is already buffered is
+// reported right away. workers park connections too, so the deadline is only
+// armed once the connection is in epoll and both happen under timer_lock: the
+// poller can neither expire it in between nor dispatch or close it without
+// first waiting to disarm it. once parked, c belongs to the poller
+static bool client_park(event_loop_t *el, client_t *c, client_deadline_t deadline) {
+    c->state = CLIENT_READING;
+    set_nonblocking(c->fd, true);
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+    pthread_mutex_lock(&el->timer_lock);
+    bool parked = epoll_ctl(el->epfd, EPOLL_CTL_ADD, c->fd, &ev) == 0;
+    if (parked) {
+        client_arm_locked(el, c, deadline);
+    }
+    pthread_mutex_unlock(&el->timer_lock);
+
+    if (!parked) {
+        set_nonblocking(c->fd, false);
+    }
+    return parked;
+}
+
+// takes a parked connection out of epoll and cancels its deadline
+static void client_unpark(event_loop_t *el, client_t *c) {
+    epoll_ctl(el->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    client_disarm(el, c);
+}
+
+// moves a connection from the event loop to the worker pool. workers use the
+// blocking helper functions, so the socket goes back to blocking mode
+static void client_dispatch(event_loop_t *el, client_t *c) {
+    client_unpark(el, c);
+    c->state = CLIENT_DISPATCHED;
+    set_nonblocking(c->fd, false);
+    el->dispatch(c->fd);
+}
+
+// handles one readiness event for a parked connection
+static void client_event(event_loop_t *el, client_t *c, uint32_t events) {
+    int ready = request_head_ready(c->fd);
+    if (ready > 0) {
+        client_dispatch(el, c);
+    } else if (ready < 0 || (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        // the peer closed or errored before completing the request head
+        client_unpark(el, c);
+        client_close(el, c);
+    } else if (c->deadline == CLIENT_IDLE) {
+        // the next request has started, from now on its head has to arrive in time
+        client_arm(el, c, CLIENT_HEADER);
+    }
+    // otherwise the head is still partial, edge triggering wakes us on more data
+}
+
+// collects a parked connection whose deadline passed, called under timer_lock
+static void collect_expired(wheel_timer_t *timer, void *arg) {
+    client_t *c = (client_t *) timer;
+    client_t **expired = arg;
+    c->expired = *expired;
+    *expired = c;
+}
+
+// closes parked connections whose header or idle deadline has passed
+static void expire_clients(event_loop_t *el) {
+    client_t *expired = NULL;
+    pthread_mutex_lock(&el->timer_lock);
+    timer_wheel_advance(el->timers, now_ms(), collect_expired, &expired);
+    pthread_mutex_unlock(&el->timer_lock);
+
+    while (expired) {
+        client_t *c = expired;
+        expired = c->expired;
+        metrics_timeout(c->deadline == CLIENT_HEADER ? METRIC_HEADER_TIMEOUT : METRIC_IDLE_TIMEOUT);
+        epoll_ctl(el->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        client_close(el, c);
+    }
+}
+
+// poller thread, waits for readiness on every parked connection
+static void *poll_thread(void *arg) {
+    event_loop_t *el = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(el->epfd, events, MAX_EVENTS, TIMER_TICK_MS);
+        if (n < 0 && errno != EINTR) {
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                return NULL; // woken by event_loop_delete
+            }
+            client_event(el, events[i].data.ptr, events[i].events);
+        }
+        expire_clients(el);
+    }
+    return NULL;
+}
+
+// creates a new event loop and starts its poller thread
+event_loop_t *event_loop_new(
+    event_dispatch_t dispatch, int max_requests, int idle_timeout_ms, int header_timeout_ms) {
+    if (!dispatch) {
+        return NULL;
+    }
+
+    event_loop_t *el = calloc(1, sizeof(event_loop_t));
+    if (!el) {
+        return NULL;
+    }
+
+    el->dispatch = dispatch;
+    el->max_requests = max_requests > 0 ? max_requests : 1;
+    el->idle_timeout_ms = idle_timeout_ms;
+    el->header_timeout_ms = header_timeout_ms;
+    pthread_mutex_init(&el->timer_lock, NULL);
+    el->timers = timer_wheel_new(now_ms(), TIMER_TICK_MS);
+
+    // one slot per possible descriptor so workers can find a client by fd
+    struct rlimit rl;
+    el->max_clients = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        el->max_clients = (int) rl.rlim_cur;
+    }
+    el->clients = calloc(el->max_clients, sizeof(client_t *));
+
+    el->epfd = epoll_create1(EPOLL_CLOEXEC);
+    el->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!el->clients || !el->timers || el->epfd < 0 || el->wakefd < 0) {
+        goto fail;
+    }
+
+    // the wake descriptor is the only registration with a NULL pointer
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, el->wakefd, &ev) < 0) {
+        goto fail;
+    }
+
+    if (pthread_create(&el->poller, NULL, poll_thread, el) != 0) {
+        goto fail;
+    }
+    return el;
+
+fail:
+    if (el->epfd >= 0) {
+        close(el->epfd);
+    }
+    if (el->wakefd >= 0) {
+        close(el->wakefd);
+    }
+    pthread_mutex_destroy(&el->timer_lock);
+    timer_wheel_delete(&el->timers);
+    free(el->clients);
+    free(el);
+    return NULL;
+}
+
+// stops the poller thread and frees the event loop, closing every connection
+// that is still parked
+void event_loop_delete(event_loop_t **el) {
+    if (!el || !*el) {
+        return;
+    }
+
+    uint64_t one = 1;
+    if (write((*el)->wakefd, &one, sizeof(one)) == sizeof(one)) {
+        pthread_join((*el)->poller, NULL);
+    }
+
+    for (int fd = 0; fd < (*el)->max_clients; fd++) {
+        client_t *c = (*el)->clients[fd];
+        if (c && c->state == CLIENT_READING) {
+            client_close(*el, c);
+        }
+    }
+
+    close((*el)->epfd);
+    close((*el)->wakefd);
+    pthread_mutex_destroy(&(*el)->timer_lock);
+    timer_wheel_delete(&(*el)->timers);
+    free((*el)->clients);
+    free(*el);
+    *el = NULL;
+}
+
+// registers a newly accepted connection
+bool event_loop_add(event_loop_t *el, int connfd) {
+    if (!el || connfd < 0 || connfd >= el->max_clients) {
+        return false;
+    }
+
+    client_t *c = calloc(1, sizeof(client_t));
+    if (!c) {
+        return false;
+    }
+    c->fd = connfd;
+    el->clients[connfd] = c;
+
+    if (!client_park(el, c, CLIENT_HEADER)) {
+        el->clients[connfd] = NULL;
+        free(c);
+        return false;
+    }
+    return true;
+}
+
+// called by a worker after answering one request on a dispatched connection
+void event_loop_done(event_loop_t *el, int connfd, bool keep_alive) {
+    if (!el || connfd < 0 || connfd >= el->max_clients || !el->clients[connfd]) {
+        close(connfd);
+        return;
+    }
+
+    client_t *c = el->clients[connfd];
+    c->served++;
+    if (!keep_alive || c->served >= el->max_requests || !client_park(el, c, CLIENT_IDLE)) {
+        client_close(el, c);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+
+// an event loop parks connections in epoll until a complete request head has
+// arrived, then hands the connection to the worker pool through the dispatch
+// function. idle, slow and kept-alive clients cost only an epoll registration.
+typedef struct event_loop event_loop_t;
+
+// called on the poller thread with a connection whose request head is complete
+typedef void (*event_dispatch_t)(int connfd);
+
+// creates a new event loop and starts its poller thread. connections whose
+// request head is complete are passed to dispatch.
+// a connection is closed after max_requests requests, when a kept-alive
+// connection sends nothing for idle_timeout_ms, or when a request head takes
+// longer than header_timeout_ms from its first byte (from the accept for the
+// first request).
+event_loop_t *event_loop_new(
+    event_dispatch_t dispatch, int max_requests, int idle_timeout_ms, int header_timeout_ms);
+
+// stops the poller thread and frees all memory used by the event loop
+void event_loop_delete(event_loop_t **el);
+
+// registers an accepted connection with the event loop
+bool event_loop_add(event_loop_t *el, int connfd);
+
+// returns a dispatched connection after one request has been answered. it is
+// parked again for the next request when keep_alive is set and the request
+// limit is not reached, otherwise it is closed.
+void event_loop_done(event_loop_t *el, int connfd, bool keep_alive);
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include "fd_cache.h"
+#include "uri_hash.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+// number of independently locked shards, a power of two
+#define SHARDS 16
+// buckets per shard, a power of two
+#define BUCKETS 256
+// directory events that can change what a cached URI refers to
+#define WATCH_MASK                                                                                 \
+    (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE \
+        | IN_DELETE_SELF | IN_MOVE_SELF)
+// names of the server's own temp files, their events are ignored
+#define TEMP_PREFIX ".httpserver_"
+
+// one cached descriptor
+typedef struct fd_entry {
+    char *uri;
+    uint64_t hash; // uri_hash(uri)
+    file_version_t *version; // the cache's reference
+    struct fd_entry *next; // next entry in the same bucket
+    struct fd_entry *lru_prev, *lru_next; // recency order within a shard
+} fd_entry_t;
+
+// one shard of the cache, its mutex covers everything in it
+typedef struct shard {
+    pthread_mutex_t mutex;
+    fd_entry_t *buckets[BUCKETS];
+    fd_entry_t *lru_head, *lru_tail; // most recently used first
+    size_t count;
+    // bumped by every invalidation, a file opened before one is not cached
+    uint64_t generation;
+} shard_t;
+
+// a watched directory
+typedef struct watch {
+    int wd;
+    char *dir;
+} watch_t;
+
+// structure for the descriptor cache
+typedef struct fd_cache {
+    size_t shard_capacity; // entries each shard may hold
+    shard_t shards[SHARDS];
+    int inotify_fd;
+    int wakefd; // eventfd used to stop the watcher thread
+    pthread_t watcher;
+    pthread_mutex_t watch_lock; // covers the watch list
+    watch_t *watches;
+    size_t watch_count, watch_cap;
+} fd_cache_t;
+
+static shard_t *shard_for(fd_cache_t *c, uint64_t hash) {
+    return &c->shards[hash & (SHARDS - 1)];
+}
+
+static fd_entry_t **bucket_for(shard_t *s, uint64_t hash) {
+    return &s->buckets[(hash >> 4) & (BUCKETS - 1)];
+}
+
+// LRU helpers, callers hold the shard mutex
+static void lru_unlink(shard_t *s, fd_entry_t *e) {
+    if (e->lru_prev) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        s->lru_head = e->lru_next;
+    }
+    if (e->lru_next) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        s->lru_tail = e->lru_prev;
+    }
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_push_front(shard_t *s, fd_entry_t *e) {
+    e->lru_prev = NULL;
+    e->lru_next = s->lru_head;
+    if (s->lru_head) {
+        s->lru_head->lru_prev = e;
+    } else {
+        s->lru_tail = e;
+    }
+    s->lru_head = e;
+}
+
+// takes an entry out of its shard and drops the cache's reference
+static void shard_remove(shard_t *s, fd_entry_t *e) {
+    fd_entry_t **link = bucket_for(s, e->hash);
+    while (*link != e) {
+        link = &(*link)->next;
+    }
+    *link = e->next;
+    lru_unlink(s, e);
+    s->count--;
+    file_version_release(&e->version);
+    free(e->uri);
+    free(e);
+}
+
+static fd_entry_t *shard_find(shard_t *s, const char *uri, uint64_t hash) {
+    for (fd_entry_t *e = *bucket_for(s, hash); e; e = e->next) {
+        if (e->hash == hash && strcmp(e->uri, uri) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// drops every entry, used when inotify can no longer tell what changed
+static void fd_cache_clear(fd_cache_t *c) {
+    for (int i = 0; i < SHARDS; i++) {
+        shard_t *s = &c->shards[i];
+        pthread_mutex_lock(&s->mutex);
+        while (s->lru_head) {
+            shard_remove(s, s->lru_head);
+        }
+        s->generation++;
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+// writes the directory of uri into dir, "." for a file at the top level
+static void dir_of(const char *uri, char *dir, size_t size) {
+    const char *slash = strrchr(uri, '/');
+    if (slash) {
+        snprintf(dir, size, "%.*s", (int) (slash - uri), uri);
+    } else {
+        snprintf(dir, size, ".");
+    }
+}
+
+// makes sure the directory of uri is watched, returns false if it cannot be
+static bool watch_dir(fd_cache_t *c, const char *uri) {
+    char dir[PATH_MAX];
+    dir_of(uri, dir, sizeof(dir));
+
+    bool watched = false;
+    pthread_mutex_lock(&c->watch_lock);
+    for (size_t i = 0; i < c->watch_count && !watched; i++) {
+        watched = strcmp(c->watches[i].dir, dir) == 0;
+    }
+    if (!watched && c->watch_count == c->watch_cap) {
+        size_t cap = c->watch_cap ? c->watch_cap * 2 : 16;
+        watch_t *watches = realloc(c->watches, cap * sizeof(watch_t));
+        if (watches) {
+            c->watches = watches;
+            c->watch_cap = cap;
+        }
+    }
+    if (!watched && c->watch_count < c->watch_cap) {
+        char *copy = strdup(dir);
+        int wd = copy ? inotify_add_watch(c->inotify_fd, dir, WATCH_MASK) : -1;
+        if (wd >= 0) {
+            c->watches[c->watch_count++] = (watch_t) { wd, copy };
+            watched = true;
+        } else {
+            free(copy);
+        }
+    }
+    pthread_mutex_unlock(&c->watch_lock);
+    return watched;
+}
+
+// handles one inotify event
+static void handle_event(fd_cache_t *c, const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // events were lost, anything may have changed
+        fd_cache_clear(c);
+        return;
+    }
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // the paths under this watch no longer lead to the files that were cached
+        inotify_rm_watch(c->inotify_fd, ev->wd);
+        fd_cache_clear(c);
+        return;
+    }
+
+    char uri[PATH_MAX];
+    bool found = false;
+    pthread_mutex_lock(&c->watch_lock);
+    for (size_t i = 0; i < c->watch_count; i++) {
+        if (c->watches[i].wd != ev->wd) {
+            continue;
+        }
+        if (ev->mask & IN_IGNORED) {
+            // the watch is gone, it is added again for the next cached file
+            free(c->watches[i].dir);
+            c->watches[i] = c->watches[--c->watch_count];
+        } else if (ev->len > 0 && strncmp(ev->name, TEMP_PREFIX, strlen(TEMP_PREFIX)) != 0) {
+            const char *dir = c->watches[i].dir;
+            if (strcmp(dir, ".") == 0) {
+                snprintf(uri, sizeof(uri), "%s", ev->name);
+            } else {
+                snprintf(uri, sizeof(uri), "%s/%s", dir, ev->name);
+            }
+            found = true;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&c->watch_lock);
+
+    if (found) {
+        fd_cache_invalidate(c, uri, uri_hash(uri));
+    }
+}
+
+// watcher thread, invalidates entries for files changed behind the server's back
+static void *watch_thread(void *arg) {
+    fd_cache_t *c = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = { { .fd = c->inotify_fd, .events = POLLIN },
+        { .fd = c->wakefd, .events = POLLIN } };
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            break; // woken by fd_cache_delete
+        }
+        ssize_t n = read(c->inotify_fd, buf, sizeof(buf));
+        for (char *p = buf; n > 0 && p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+            handle_event(c, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+fd_cache_t *fd_cache_new(size_t capacity) {
+    fd_cache_t *c = calloc(1, sizeof(fd_cache_t));
+    if (!c) {
+        return NULL;
+    }
+
+    c->shard_capacity = capacity / SHARDS > 0 ? capacity / SHARDS : 1;
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_init(&c->shards[i].mutex, NULL);
+    }
+    pthread_mutex_init(&c->watch_lock, NULL);
+
+    c->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    c->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (c->inotify_fd < 0 || c->wakefd < 0
+        || pthread_create(&c->watcher, NULL, watch_thread, c) != 0) {
+        if (c->inotify_fd >= 0) {
+            close(c->inotify_fd);
+        }
+        if (c->wakefd >= 0) {
+            close(c->wakefd);
+        }
+        for (int i = 0; i < SHARDS; i++) {
+            pthread_mutex_destroy(&c->shards[i].mutex);
+        }
+        pthread_mutex_destroy(&c->watch_lock);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void fd_cache_delete(fd_cache_t **c) {
+    if (!c || !*c) {
+        return;
+    }
+
+    uint64_t one = 1;
+    if (write((*c)->wakefd, &one, sizeof(one)) == sizeof(one)) {
+        pthread_join((*c)->watcher, NULL);
+    }
+
+    fd_cache_clear(*c);
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_destroy(&(*c)->shards[i].mutex);
+    }
+    for (size_t i = 0; i < (*c)->watch_count; i++) {
+        free((*c)->watches[i].dir);
+    }
+    free((*c)->watches);
+    pthread_mutex_destroy(&(*c)->watch_lock);
+    close((*c)->inotify_fd);
+    close((*c)->wakefd);
+    free(*c);
+    *c = NULL;
+}
+
+// looks up uri, a hit moves the entry to the front of its shard's LRU list. a
+// miss opens the file and caches it, evicting the least recently used entry
+// of a full shard. the directory is watched before the file is opened, so any
+// later change to it is reported and drops the entry
+file_version_t *fd_cache_open(fd_cache_t *c, const char *uri, uint64_t hash) {
+    shard_t *s = shard_for(c, hash);
+    pthread_mutex_lock(&s->mutex);
+    fd_entry_t *e = shard_find(s, uri, hash);
+    if (e) {
+        file_version_ref(e->version);
+        if (s->lru_head != e) {
+            lru_unlink(s, e);
+            lru_push_front(s, e);
+        }
+        file_version_t *v = e->version;
+        pthread_mutex_unlock(&s->mutex);
+        return v;
+    }
+    pthread_mutex_unlock(&s->mutex);
+
+    bool cacheable = watch_dir(c, uri);
+    pthread_mutex_lock(&s->mutex);
+    uint64_t generation = s->generation;
+    pthread_mutex_unlock(&s->mutex);
+
+    file_version_t *v = file_version_open(uri);
+    if (!v || !cacheable) {
+        return v;
+    }
+
+    e = calloc(1, sizeof(fd_entry_t));
+    if (!e || !(e->uri = strdup(uri))) {
+        free(e);
+        return v;
+    }
+    e->hash = hash;
+    e->version = v;
+
+    pthread_mutex_lock(&s->mutex);
+    // skipped when the file may have changed since it was opened, or when a
+    // concurrent reader cached it first
+    if (s->generation != generation || shard_find(s, uri, hash)) {
+        pthread_mutex_unlock(&s->mutex);
+        free(e->uri);
+        free(e);
+        return v;
+    }
+    while (s->lru_tail && s->count >= c->shard_capacity) {
+        shard_remove(s, s->lru_tail);
+    }
+    file_version_ref(v); // the cache's reference
+    fd_entry_t **bucket = bucket_for(s, hash);
+    e->next = *bucket;
+    *bucket = e;
+    lru_push_front(s, e);
+    s->count++;
+    pthread_mutex_unlock(&s->mutex);
+    return v;
+}
+
+// removes the entry for uri so the next reader opens the file again
+void fd_cache_invalidate(fd_cache_t *c, const char *uri, uint64_t hash) {
+    shard_t *s = shard_for(c, hash);
+    pthread_mutex_lock(&s->mutex);
+    fd_entry_t *e = shard_find(s, uri, hash);
+    if (e) {
+        shard_remove(s, e);
+    }
+    s->generation++;
+    pthread_mutex_unlock(&s->mutex);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "file_version.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// bounded LRU cache of open descriptors and their stat results keyed by URI,
+// so a GET for a hot file skips the path walk, open and fstat. entries are
+// file versions: a reader holds a reference while sending and reads with
+// explicit offsets, so a descriptor shared by many readers is never
+// repositioned and an entry evicted mid-send stays open until released.
+// the server invalidates a URI under its writer lock when it replaces the
+// file. changes made by other processes are caught through inotify watches
+// on the directories of cached URIs.
+typedef struct fd_cache fd_cache_t;
+
+// creates a cache of at most capacity open files and starts its inotify
+// thread. returns NULL if inotify is not available
+fd_cache_t *fd_cache_new(size_t capacity);
+
+// stops the inotify thread and frees the cache, versions still referenced by
+// readers are closed on release
+void fd_cache_delete(fd_cache_t **c);
+
+// returns the version of uri with a reference held, from the cache or freshly
+// opened and cached. returns NULL with errno set if the file cannot be opened
+file_version_t *fd_cache_open(fd_cache_t *c, const char *uri, uint64_t hash);
+
+// drops the cached descriptor of uri, if there is one
+void fd_cache_invalidate(fd_cache_t *c, const char *uri, uint64_t hash);
@@ -0,0 +1,171 @@
+// tests fd_cache.c in a fresh temporary directory: hits share one open file,
+// an invalidated or externally replaced file is opened again while readers
+// keep the old one, and the cache never holds more descriptors than allowed.
+// "fd_cachetest -v" prints each step
+
+#define _GNU_SOURCE
+#include "fd_cache.h"
+#include "uri_hash.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CAPACITY 16
+
+static bool verbose;
+
+// replaces path with a new file holding text, as a PUT or another process would
+static ino_t replace(const char *path, const char *text) {
+    char temp[64];
+    snprintf(temp, sizeof(temp), "%s.new", path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(write(fd, text, strlen(text)) == (ssize_t) strlen(text));
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+    close(fd);
+    assert(rename(temp, path) == 0);
+    return st.st_ino;
+}
+
+// checks that a version holds text
+static void check_contents(const file_version_t *v, const char *text) {
+    char buf[64];
+    ssize_t n = pread(v->fd, buf, sizeof(buf), 0);
+    assert(n == (ssize_t) strlen(text) && memcmp(buf, text, n) == 0);
+    assert(v->st.st_size == n);
+}
+
+// number of descriptors the process has open
+static int open_fds(void) {
+    DIR *d = opendir("/proc/self/fd");
+    assert(d);
+    int count = 0;
+    while (readdir(d)) {
+        count++;
+    }
+    closedir(d);
+    return count;
+}
+
+// hits share the cached version, invalidation makes the next open see the new file
+static void test_invalidate(fd_cache_t *c) {
+    ino_t first = replace("f", "first");
+    file_version_t *a = fd_cache_open(c, "f", uri_hash("f"));
+    file_version_t *b = fd_cache_open(c, "f", uri_hash("f"));
+    assert(a && a == b && a->st.st_ino == first);
+    file_version_release(&b);
+
+    ino_t second = replace("f", "second");
+    // the server drops the entry under the writer lock before the rename
+    // shows up through inotify
+    fd_cache_invalidate(c, "f", uri_hash("f"));
+    b = fd_cache_open(c, "f", uri_hash("f"));
+    assert(b && b != a && b->st.st_ino == second);
+    check_contents(b, "second");
+    // the reader of the old file still reads what it opened
+    check_contents(a, "first");
+    file_version_release(&a);
+    file_version_release(&b);
+
+    errno = 0;
+    assert(!fd_cache_open(c, "missing", uri_hash("missing")) && errno == ENOENT);
+    if (verbose) {
+        printf("invalidate: hits shared, the next open after invalidation is fresh\n");
+    }
+}
+
+// waits for the inotify thread to drop the entry of path, which now holds ino
+static bool sees(fd_cache_t *c, const char *path, ino_t ino) {
+    for (int i = 0; i < 200; i++) {
+        file_version_t *v = fd_cache_open(c, path, uri_hash(path));
+        assert(v);
+        bool fresh = v->st.st_ino == ino;
+        file_version_release(&v);
+        if (fresh) {
+            return true;
+        }
+        usleep(10 * 1000);
+    }
+    return false;
+}
+
+// files changed by other processes are noticed through inotify, also in
+// subdirectories
+static void test_inotify(fd_cache_t *c) {
+    replace("g", "cached");
+    assert(mkdir("d", 0755) == 0);
+    replace("d/h", "cached");
+    file_version_t *v = fd_cache_open(c, "g", uri_hash("g"));
+    file_version_t *w = fd_cache_open(c, "d/h", uri_hash("d/h"));
+    assert(v && w);
+    file_version_release(&v);
+    file_version_release(&w);
+
+    assert(sees(c, "g", replace("g", "changed")));
+    assert(sees(c, "d/h", replace("d/h", "changed")));
+    v = fd_cache_open(c, "d/h", uri_hash("d/h"));
+    check_contents(v, "changed");
+    file_version_release(&v);
+    if (verbose) {
+        printf("inotify: outside changes drop their entries\n");
+    }
+}
+
+// however many files are read, at most CAPACITY stay open in the cache
+static void test_capacity(void) {
+    int before = open_fds();
+    fd_cache_t *c = fd_cache_new(CAPACITY);
+    assert(c);
+    int base = open_fds();
+
+    char name[16];
+    for (int i = 0; i < 4 * CAPACITY; i++) {
+        snprintf(name, sizeof(name), "n%d", i);
+        replace(name, name);
+        file_version_t *v = fd_cache_open(c, name, uri_hash(name));
+        assert(v);
+        check_contents(v, name);
+        file_version_release(&v);
+    }
+    assert(open_fds() - base <= CAPACITY);
+    if (verbose) {
+        printf("capacity: %d descriptors open for %d files\n", open_fds() - base, 4 * CAPACITY);
+    }
+    fd_cache_delete(&c);
+    assert(!c && open_fds() == before);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void) st, (void) flag, (void) ftw;
+    return remove(path);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    // URIs are relative to the server's directory, here one of our own
+    char dir[] = "/tmp/fd_cachetest_XXXXXX";
+    assert(mkdtemp(dir));
+    assert(chdir(dir) == 0);
+
+    fd_cache_t *c = fd_cache_new(CAPACITY);
+    assert(c);
+    test_invalidate(c);
+    test_inotify(c);
+    fd_cache_delete(&c);
+    test_capacity();
+
+    // leave nothing behind
+    assert(chdir("/") == 0 && nftw(dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS) == 0);
+    printf("fd_cachetest: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include "file_version.h"
+#include "io_backend.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+file_version_t *file_version_new(int fd, const struct stat *st) {
+    file_version_t *v = malloc(sizeof(file_version_t));
+    if (!v) {
+        return NULL;
+    }
+    v->fd = fd;
+    v->st = *st;
+    atomic_init(&v->refcount, 1);
+    return v;
+}
+
+file_version_t *file_version_open(const char *path) {
+    int fd;
+    struct stat st;
+    if (io_open_stat(path, &fd, &st) != 0) {
+        return NULL;
+    }
+
+    file_version_t *v = file_version_new(fd, &st);
+    if (!v) {
+        close(fd);
+        errno = ENOMEM;
+    }
+    return v;
+}
+
+void file_version_ref(file_version_t *v) {
+    atomic_fetch_add_explicit(&v->refcount, 1, memory_order_relaxed);
+}
+
+void file_version_release(file_version_t **v) {
+    if (!v || !*v) {
+        return;
+    }
+    if (atomic_fetch_sub_explicit(&(*v)->refcount, 1, memory_order_acq_rel) == 1) {
+        close((*v)->fd);
+        free(*v);
+    }
+    *v = NULL;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+// an immutable version of a file: an open descriptor of the inode that held
+// the URI's contents when it was published, and that inode's metadata. a PUT
+// renames a new inode over the URI, so a version never changes under the
+// readers still sending it, even after it has been replaced
+typedef struct file_version {
+    int fd;
+    struct stat st;
+    _Atomic int refcount; // the publishing entry's reference plus one per reader
+} file_version_t;
+
+// wraps an open descriptor as a version, taking ownership of fd. returns the
+// version with one reference, or NULL on failure (fd is left open then)
+file_version_t *file_version_new(int fd, const struct stat *st);
+
+// opens the current contents of path as a version. returns NULL with errno
+// set if the file cannot be opened
+file_version_t *file_version_open(const char *path);
+
+// takes another reference
+void file_version_ref(file_version_t *v);
+
+// drops a reference, closing the descriptor with the last one
+void file_version_release(file_version_t **v);
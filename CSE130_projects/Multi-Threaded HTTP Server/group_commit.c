@@ -0,0 +1,176 @@
+#include "group_commit.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// one request waiting for its sync, lives on the requesting thread's stack
+typedef struct commit {
+    int fd; // file to sync, -1 for a directory
+    const char *dir; // directory to sync when fd is -1
+    bool ok; // result of the sync
+    bool done; // set by the flusher once the batch is synced
+    struct commit *next;
+} commit_t;
+
+// structure for the group commit
+typedef struct group_commit {
+    int window_ms;
+    int max_batch;
+    pthread_mutex_t lock; // covers everything below
+    pthread_cond_t work; // signals the flusher that requests are pending
+    pthread_cond_t done; // signals the requests that a batch was synced
+    commit_t *head, *tail; // pending requests, oldest first
+    int pending;
+    bool stop;
+    pthread_t flusher;
+} group_commit_t;
+
+// syncs a directory, reusing the result of an earlier request in the batch for the same one
+static bool sync_dir(commit_t *batch, commit_t *c) {
+    for (commit_t *prev = batch; prev != c; prev = prev->next) {
+        if (prev->fd < 0 && strcmp(prev->dir, c->dir) == 0) {
+            return prev->ok;
+        }
+    }
+    int fd = open(c->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// syncs one batch. files go first, fdatasync covers their data and size
+static void sync_batch(commit_t *batch) {
+    for (commit_t *c = batch; c; c = c->next) {
+        if (c->fd >= 0) {
+            c->ok = fdatasync(c->fd) == 0;
+        }
+    }
+    for (commit_t *c = batch; c; c = c->next) {
+        if (c->fd < 0) {
+            c->ok = sync_dir(batch, c);
+        }
+    }
+}
+
+// flusher thread, takes the pending requests as one batch once the window is over
+static void *flush_thread(void *arg) {
+    group_commit_t *gc = arg;
+    pthread_mutex_lock(&gc->lock);
+    while (1) {
+        while (!gc->head && !gc->stop) {
+            pthread_cond_wait(&gc->work, &gc->lock);
+        }
+        if (!gc->head) {
+            break;
+        }
+
+        // the window runs from the first request of the batch
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += gc->window_ms / 1000;
+        until.tv_nsec += (long) (gc->window_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        while (gc->window_ms > 0 && gc->pending < gc->max_batch && !gc->stop) {
+            if (pthread_cond_timedwait(&gc->work, &gc->lock, &until) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        commit_t *batch = gc->head;
+        gc->head = gc->tail = NULL;
+        gc->pending = 0;
+        pthread_mutex_unlock(&gc->lock);
+
+        sync_batch(batch);
+
+        pthread_mutex_lock(&gc->lock);
+        while (batch) {
+            // the waiter may return and reuse its stack as soon as done is set
+            commit_t *next = batch->next;
+            batch->done = true;
+            batch = next;
+        }
+        pthread_cond_broadcast(&gc->done);
+    }
+    pthread_mutex_unlock(&gc->lock);
+    return NULL;
+}
+
+group_commit_t *group_commit_new(int window_ms, int max_batch) {
+    group_commit_t *gc = calloc(1, sizeof(group_commit_t));
+    if (!gc) {
+        return NULL;
+    }
+    gc->window_ms = window_ms > 0 ? window_ms : 0;
+    gc->max_batch = max_batch > 0 ? max_batch : 1;
+    pthread_mutex_init(&gc->lock, NULL);
+    pthread_cond_init(&gc->work, NULL);
+    pthread_cond_init(&gc->done, NULL);
+    if (pthread_create(&gc->flusher, NULL, flush_thread, gc) != 0) {
+        pthread_mutex_destroy(&gc->lock);
+        pthread_cond_destroy(&gc->work);
+        pthread_cond_destroy(&gc->done);
+        free(gc);
+        return NULL;
+    }
+    return gc;
+}
+
+void group_commit_delete(group_commit_t **gc) {
+    if (!gc || !*gc) {
+        return;
+    }
+    pthread_mutex_lock(&(*gc)->lock);
+    (*gc)->stop = true;
+    pthread_cond_signal(&(*gc)->work);
+    pthread_mutex_unlock(&(*gc)->lock);
+    pthread_join((*gc)->flusher, NULL);
+
+    pthread_mutex_destroy(&(*gc)->lock);
+    pthread_cond_destroy(&(*gc)->work);
+    pthread_cond_destroy(&(*gc)->done);
+    free(*gc);
+    *gc = NULL;
+}
+
+// adds a request to the current batch and sleeps until it has been synced
+static bool commit(group_commit_t *gc, commit_t *c) {
+    pthread_mutex_lock(&gc->lock);
+    if (gc->tail) {
+        gc->tail->next = c;
+    } else {
+        gc->head = c;
+    }
+    gc->tail = c;
+    gc->pending++;
+    // the flusher waits for the first request, and for a full batch during the window
+    if (gc->pending == 1 || gc->pending >= gc->max_batch) {
+        pthread_cond_signal(&gc->work);
+    }
+    while (!c->done) {
+        pthread_cond_wait(&gc->done, &gc->lock);
+    }
+    pthread_mutex_unlock(&gc->lock);
+    return c->ok;
+}
+
+bool group_commit_file(group_commit_t *gc, int fd) {
+    commit_t c = { .fd = fd };
+    return commit(gc, &c);
+}
+
+bool group_commit_dir(group_commit_t *gc, const char *path) {
+    commit_t c = { .fd = -1, .dir = path };
+    return commit(gc, &c);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+
+// group commit for durable PUTs. a request that needs a file or directory on
+// disk joins the current batch and sleeps. one flusher thread waits for the
+// batch window to pass or the batch to fill up, syncs every file in it and
+// every distinct directory once, then wakes all the requests of the batch.
+// requests arriving while a batch is being synced form the next one, so the
+// number of fsyncs grows with the number of batches, not of requests.
+typedef struct group_commit group_commit_t;
+
+// creates a group commit and starts its flusher thread. a batch is synced
+// window_ms after its first request arrived, or as soon as it holds
+// max_batch requests
+group_commit_t *group_commit_new(int window_ms, int max_batch);
+
+// syncs what is still pending, stops the flusher thread and frees the group commit
+void group_commit_delete(group_commit_t **gc);
+
+// blocks until the contents of fd are on disk. returns false if the sync failed
+bool group_commit_file(group_commit_t *gc, int fd);
+
+// blocks until the entries of the directory at path are on disk. returns
+// false if it could not be opened or synced
+bool group_commit_dir(group_commit_t *gc, const char *path);
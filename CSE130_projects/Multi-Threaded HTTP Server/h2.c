@@ -0,0 +1,1536 @@
+#define _GNU_SOURCE
+#include "h2.h"
+#include "hpack.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN 24
+#define FRAME_HEADER 9
+// largest frame either side may send until told otherwise, we never raise ours
+#define DEFAULT_FRAME_SIZE 16384
+// initial flow control window of a stream and of the connection
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+// SETTINGS_MAX_CONCURRENT_STREAMS, streams past it are refused
+#define MAX_STREAMS 100
+// receive window of each stream, what a client may send ahead of the worker
+#define STREAM_WINDOW (256 * 1024)
+// the connection window leaves every stream its full window
+#define CONNECTION_WINDOW ((int64_t) MAX_STREAMS * STREAM_WINDOW)
+// largest header block accepted, HEADERS and CONTINUATION frames together
+#define HEADER_BLOCK_MAX 65536
+// bytes of the client's frames buffered at a time
+#define IN_BUF (FRAME_HEADER + DEFAULT_FRAME_SIZE + 4096)
+// response bytes read from a worker at a time, the response head has to fit
+#define RESPONSE_BUF 65536
+// DATA frames are only produced while less than this waits for the client
+#define OUT_HIGH 65536
+// a client that stops reading while sending frames that need an answer is dropped
+#define OUT_MAX (4 * 1024 * 1024)
+// how often streams the server could not take are offered again
+#define DISPATCH_RETRY_MS 10
+// how long the last frames may take to leave when the connection is closed
+#define FLUSH_TIMEOUT_MS 1000
+
+// frame types
+enum {
+    FRAME_DATA = 0x0,
+    FRAME_HEADERS = 0x1,
+    FRAME_PRIORITY = 0x2,
+    FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4,
+    FRAME_PUSH_PROMISE = 0x5,
+    FRAME_PING = 0x6,
+    FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8,
+    FRAME_CONTINUATION = 0x9,
+};
+
+// frame flags
+enum {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20,
+};
+
+// settings
+enum {
+    SETTINGS_ENABLE_PUSH = 0x2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    SETTINGS_MAX_FRAME_SIZE = 0x5,
+};
+
+// error codes
+enum {
+    NO_ERROR = 0x0,
+    PROTOCOL_ERROR = 0x1,
+    INTERNAL_ERROR = 0x2,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+    CANCEL = 0x8,
+    COMPRESSION_ERROR = 0x9,
+    ENHANCE_YOUR_CALM = 0xb,
+};
+
+// how the body of a worker's response is delimited
+typedef enum {
+    RESPONSE_HEAD, // the head is still being read
+    RESPONSE_LENGTH, // Content-Length bytes follow
+    RESPONSE_CHUNKED, // chunked transfer coding, taken off before framing
+    RESPONSE_UNTIL_CLOSE, // everything until the worker closes
+} response_state_t;
+
+// position in the chunked transfer coding of a response
+typedef enum { CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER } chunk_state_t;
+
+// a stream, from its request HEADERS until its response is sent
+typedef struct stream {
+    uint32_t id;
+    int fd; // our end of the socketpair, the worker has the other
+    int worker_fd; // the worker's end until the server takes it
+    // request bytes on their way to the worker
+    char *req;
+    size_t req_len, req_off, req_cap;
+    bool req_failed; // the worker stopped reading, the rest is dropped
+    bool chunked_body; // the body has no Content-Length and is passed on chunked
+    bool end_stream; // the client has sent everything
+    uint64_t last_input_ms; // when the client last sent DATA or got window for it
+    int64_t content_length; // -1 when not given
+    int64_t body_received;
+    int64_t recv_window; // what the client may still send
+    size_t credit; // received DATA bytes not yet given back to the client's windows
+    // response bytes read from the worker, not yet framed
+    char resp[RESPONSE_BUF];
+    size_t resp_len, resp_off;
+    bool worker_closed;
+    bool response_sent; // the client is still sending, what it sends is dropped
+    response_state_t state;
+    chunk_state_t chunk;
+    int64_t remaining; // body bytes left with Content-Length, or in the current chunk
+    int64_t send_window; // what we may still send on this stream
+    struct stream *next;
+} stream_t;
+
+// structure for one h2c connection, only touched by its thread
+typedef struct h2_conn {
+    int fd;
+    h2_dispatch_t dispatch;
+    int idle_timeout_ms;
+    int body_timeout_ms;
+    hpack_t *decoder;
+    bool preface_pending; // upgraded, the client's preface has not arrived yet
+    bool settings_seen; // the client's first frame, SETTINGS, has arrived
+    uint8_t in[IN_BUF];
+    size_t in_len;
+    uint8_t *out;
+    size_t out_len, out_off, out_cap;
+    // header block being collected from HEADERS and CONTINUATION frames
+    uint8_t *block;
+    size_t block_len;
+    uint32_t block_stream;
+    bool block_end_stream;
+    bool collecting;
+    stream_t *streams;
+    int stream_count;
+    int undispatched; // streams the server could not take yet
+    uint32_t last_stream; // highest stream the client opened
+    int64_t send_window; // connection window for our DATA
+    int64_t recv_window; // connection window for the client's DATA
+    int64_t peer_initial_window; // SETTINGS_INITIAL_WINDOW_SIZE of the client
+    uint32_t peer_max_frame; // SETTINGS_MAX_FRAME_SIZE of the client
+    bool goaway_received; // no new streams, close once the open ones are done
+    bool closing; // GOAWAY sent, flush and close
+} h2_conn_t;
+
+// a request being rebuilt from a decoded header block
+typedef struct request {
+    char *method, *path, *authority;
+    char *headers; // regular fields as HTTP/1.1 header lines
+    size_t len, cap;
+    bool has_host;
+    bool regular_seen; // pseudo-headers have to come first
+    bool malformed;
+    int64_t content_length;
+} request_t;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+int h2_peek_preface(int fd) {
+    char buf[PREFACE_LEN];
+    ssize_t n;
+    do {
+        n = recv(fd, buf, PREFACE_LEN, MSG_PEEK);
+    } while (n < 0 && errno == EINTR);
+    // an HTTP/1.1 request differs in its first byte, only a partial preface is waited on
+    while (n > 0 && n < PREFACE_LEN && memcmp(buf, PREFACE, n) == 0) {
+        ssize_t more = recv(fd, buf, n + 1, MSG_PEEK | MSG_WAITALL);
+        if (more < 0 && errno == EINTR) {
+            continue;
+        }
+        if (more <= n) {
+            return -1;
+        }
+        do {
+            n = recv(fd, buf, PREFACE_LEN, MSG_PEEK);
+        } while (n < 0 && errno == EINTR);
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    if (n < PREFACE_LEN || memcmp(buf, PREFACE, PREFACE_LEN) != 0) {
+        return 0;
+    }
+    do {
+        n = recv(fd, buf, PREFACE_LEN, MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    return n == PREFACE_LEN ? 1 : -1;
+}
+
+// makes room for len more bytes in the output buffer
+static bool out_reserve(h2_conn_t *c, size_t len) {
+    if (c->out_off > 0 && c->out_off == c->out_len) {
+        c->out_off = c->out_len = 0;
+    }
+    if (c->out_len + len <= c->out_cap) {
+        return true;
+    }
+    if (c->out_len - c->out_off + len > OUT_MAX) {
+        return false;
+    }
+    if (c->out_off > 0) {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    if (c->out_len + len <= c->out_cap) {
+        return true;
+    }
+    size_t cap = c->out_cap ? c->out_cap : OUT_HIGH;
+    while (cap < c->out_len + len) {
+        cap *= 2;
+    }
+    uint8_t *grown = realloc(c->out, cap);
+    if (!grown) {
+        return false;
+    }
+    c->out = grown;
+    c->out_cap = cap;
+    return true;
+}
+
+// queues a frame for the client. a client that lets too much pile up is closed
+static bool send_frame(
+    h2_conn_t *c, int type, int flags, uint32_t stream, const void *payload, size_t len) {
+    if (!out_reserve(c, FRAME_HEADER + len)) {
+        c->closing = true;
+        return false;
+    }
+    uint8_t *p = c->out + c->out_len;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, stream);
+    if (len > 0) {
+        memcpy(p + FRAME_HEADER, payload, len);
+    }
+    c->out_len += FRAME_HEADER + len;
+    return true;
+}
+
+static void send_window_update(h2_conn_t *c, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    send_frame(c, FRAME_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+// ends the connection with an error, after the frames already queued
+static bool connection_error(h2_conn_t *c, uint32_t code) {
+    uint8_t payload[8];
+    put32(payload, c->last_stream);
+    put32(payload + 4, code);
+    send_frame(c, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->closing = true;
+    return false;
+}
+
+static stream_t *stream_find(h2_conn_t *c, uint32_t id) {
+    for (stream_t *s = c->streams; s; s = s->next) {
+        if (s->id == id) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+// forgets a stream. the worker sees its socket close, and the connection
+// window the stream's unconsumed DATA took is given back
+static void stream_close(h2_conn_t *c, stream_t *s) {
+    for (stream_t **link = &c->streams; *link; link = &(*link)->next) {
+        if (*link == s) {
+            *link = s->next;
+            break;
+        }
+    }
+    if (s->credit > 0) {
+        c->recv_window += s->credit;
+        send_window_update(c, 0, s->credit);
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    if (s->worker_fd >= 0) {
+        close(s->worker_fd);
+        c->undispatched--;
+    }
+    free(s->req);
+    free(s);
+    c->stream_count--;
+}
+
+static void send_rst(h2_conn_t *c, uint32_t stream, uint32_t code) {
+    uint8_t payload[4];
+    put32(payload, code);
+    send_frame(c, FRAME_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+// ends a stream with RST_STREAM
+static void stream_reset(h2_conn_t *c, stream_t *s, uint32_t code) {
+    send_rst(c, s->id, code);
+    stream_close(c, s);
+}
+
+// queues bytes for the worker
+static bool request_append(stream_t *s, const char *data, size_t len) {
+    if (s->req_failed) {
+        return true;
+    }
+    if (s->req_len + len > s->req_cap) {
+        size_t cap = s->req_cap ? s->req_cap : 4096;
+        while (cap < s->req_len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(s->req, cap);
+        if (!grown) {
+            return false;
+        }
+        s->req = grown;
+        s->req_cap = cap;
+    }
+    memcpy(s->req + s->req_len, data, len);
+    s->req_len += len;
+    return true;
+}
+
+// applies the SETTINGS payload of the client, returns an error code
+static uint32_t apply_settings(h2_conn_t *c, const uint8_t *p, size_t len) {
+    if (len % 6 != 0) {
+        return FRAME_SIZE_ERROR;
+    }
+    for (size_t i = 0; i < len; i += 6) {
+        uint16_t id = p[i] << 8 | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        if (id == SETTINGS_ENABLE_PUSH && value > 1) {
+            return PROTOCOL_ERROR;
+        } else if (id == SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > MAX_WINDOW) {
+                return FLOW_CONTROL_ERROR;
+            }
+            // the change applies to the windows of open streams too
+            int64_t delta = (int64_t) value - c->peer_initial_window;
+            for (stream_t *s = c->streams; s; s = s->next) {
+                s->send_window += delta;
+                if (s->send_window > MAX_WINDOW) {
+                    return FLOW_CONTROL_ERROR;
+                }
+            }
+            c->peer_initial_window = value;
+        } else if (id == SETTINGS_MAX_FRAME_SIZE) {
+            if (value < DEFAULT_FRAME_SIZE || value > 0xffffff) {
+                return PROTOCOL_ERROR;
+            }
+            c->peer_max_frame = value;
+        }
+        // the header table size does not matter to an encoder that does not
+        // index, and we never push
+    }
+    return NO_ERROR;
+}
+
+// appends a formatted string to the request's header lines
+static void request_printf(request_t *r, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void request_printf(request_t *r, const char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(r->headers + r->len, r->cap - r->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            r->malformed = true;
+            return;
+        }
+        if (r->len + n < r->cap) {
+            r->len += n;
+            return;
+        }
+        size_t cap = r->cap ? r->cap * 2 : 1024;
+        while (cap <= r->len + n) {
+            cap *= 2;
+        }
+        char *grown = realloc(r->headers, cap);
+        if (!grown) {
+            r->malformed = true;
+            return;
+        }
+        r->headers = grown;
+        r->cap = cap;
+    }
+}
+
+// checks a field name: lowercase token characters only
+static bool valid_name(const char *name, size_t len) {
+    if (len == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = name[i];
+        if (ch <= ' ' || ch >= 0x7f || (ch >= 'A' && ch <= 'Z') || strchr("\"(),/:;<=>?@[\\]{}", ch)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// keeps a pseudo-header, each may only appear once
+static bool set_pseudo(char **field, const char *value) {
+    if (*field) {
+        return false;
+    }
+    *field = strdup(value);
+    return *field != NULL;
+}
+
+// collects one decoded field of a request's header block. anything that
+// makes it malformed is remembered and the stream is reset afterwards, the
+// block is always decoded to the end to keep the decoder in step
+static bool request_field(
+    void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    request_t *r = arg;
+    if (r->malformed) {
+        return true;
+    }
+    // the value becomes part of an HTTP/1.1 head
+    if (memchr(value, '\0', value_len) || memchr(value, '\r', value_len)
+        || memchr(value, '\n', value_len) || memchr(name, '\0', name_len)) {
+        r->malformed = true;
+        return true;
+    }
+
+    if (name[0] == ':') {
+        bool ok = !r->regular_seen;
+        if (ok && strcmp(name, ":method") == 0) {
+            ok = set_pseudo(&r->method, value);
+        } else if (ok && strcmp(name, ":path") == 0) {
+            ok = set_pseudo(&r->path, value);
+        } else if (ok && strcmp(name, ":authority") == 0) {
+            ok = set_pseudo(&r->authority, value);
+        } else if (ok && strcmp(name, ":scheme") != 0) {
+            ok = false;
+        }
+        r->malformed = !ok;
+        return true;
+    }
+
+    r->regular_seen = true;
+    // connection-specific fields do not exist in HTTP/2
+    if (!valid_name(name, name_len) || strcmp(name, "connection") == 0
+        || strcmp(name, "keep-alive") == 0 || strcmp(name, "proxy-connection") == 0
+        || strcmp(name, "transfer-encoding") == 0 || strcmp(name, "upgrade") == 0
+        || (strcmp(name, "te") == 0 && strcmp(value, "trailers") != 0)) {
+        r->malformed = true;
+        return true;
+    }
+    if (strcmp(name, "te") == 0) {
+        return true;
+    }
+    if (strcmp(name, "content-length") == 0) {
+        char *end;
+        errno = 0;
+        long long length = strtoll(value, &end, 10);
+        if (value_len == 0 || *end || errno || length < 0
+            || (r->content_length >= 0 && r->content_length != length)) {
+            r->malformed = true;
+            return true;
+        }
+        r->content_length = length;
+    }
+    if (strcmp(name, "host") == 0) {
+        r->has_host = true;
+    }
+
+    // HTTP/1.1 spelling, e.g. request-id becomes Request-Id
+    size_t start = r->len;
+    request_printf(r, "%s: %s\r\n", name, value);
+    bool word_start = true;
+    for (size_t i = start; i < start + name_len && i < r->len; i++) {
+        if (word_start && r->headers[i] >= 'a' && r->headers[i] <= 'z') {
+            r->headers[i] -= 'a' - 'A';
+        }
+        word_start = r->headers[i] == '-';
+    }
+    return true;
+}
+
+static void request_free(request_t *r) {
+    free(r->method);
+    free(r->path);
+    free(r->authority);
+    free(r->headers);
+}
+
+// opens a stream for a request and hands its socketpair to a worker
+static stream_t *stream_open(h2_conn_t *c, uint32_t id) {
+    stream_t *s = calloc(1, sizeof(stream_t));
+    if (!s) {
+        return NULL;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        free(s);
+        return NULL;
+    }
+    s->id = id;
+    s->fd = sv[0];
+    s->worker_fd = sv[1];
+    s->content_length = -1;
+    s->last_input_ms = now_ms();
+    s->recv_window = STREAM_WINDOW;
+    s->send_window = c->peer_initial_window;
+    s->next = c->streams;
+    c->streams = s;
+    c->stream_count++;
+    c->undispatched++;
+    return s;
+}
+
+// offers the streams not yet taken to the server. their requests are
+// written to the socketpair meanwhile
+static void dispatch_streams(h2_conn_t *c) {
+    for (stream_t *s = c->streams; s && c->undispatched > 0; s = s->next) {
+        if (s->worker_fd >= 0 && c->dispatch(s->worker_fd)) {
+            s->worker_fd = -1;
+            c->undispatched--;
+        }
+    }
+}
+
+// gives the DATA the worker has taken, or that was dropped, back to the
+// client's windows. a stream whose client has sent everything needs no update
+static void give_back(h2_conn_t *c, stream_t *s) {
+    c->recv_window += s->credit;
+    send_window_update(c, 0, s->credit);
+    if (!s->end_stream) {
+        s->recv_window += s->credit;
+        send_window_update(c, s->id, s->credit);
+        s->last_input_ms = now_ms();
+    }
+    s->credit = 0;
+}
+
+// the response is complete. a client still sending gets to finish, and what
+// it sends is dropped with its window given back, rather than resetting the
+// stream, which some clients take as a failure of the whole response
+static void stream_done(h2_conn_t *c, stream_t *s) {
+    if (s->end_stream) {
+        stream_close(c, s);
+        return;
+    }
+    s->response_sent = true;
+    close(s->fd);
+    s->fd = -1;
+    s->worker_closed = true;
+    s->req_failed = true;
+    s->req_len = s->req_off = 0;
+    if (s->credit > 0) {
+        give_back(c, s);
+    }
+}
+
+// handles the end of the client's side of a stream
+static void stream_end_remote(h2_conn_t *c, stream_t *s) {
+    s->end_stream = true;
+    if (s->response_sent) {
+        stream_close(c, s);
+    } else if (s->content_length >= 0 && s->body_received != s->content_length) {
+        stream_reset(c, s, PROTOCOL_ERROR);
+    } else if (s->chunked_body && !request_append(s, "0\r\n\r\n", 5)) {
+        stream_reset(c, s, INTERNAL_ERROR);
+    }
+}
+
+// turns a complete request header block into the HTTP/1.1 request of a new stream
+static void start_request(h2_conn_t *c, uint32_t id, const request_t *r, bool end_stream) {
+    // a client may open streams while our SETTINGS are on their way
+    if (c->stream_count >= MAX_STREAMS || c->goaway_received) {
+        send_rst(c, id, REFUSED_STREAM);
+        return;
+    }
+    bool malformed = r->malformed || !r->method || !r->path || r->path[0] != '/'
+                     || strpbrk(r->path, " \t") || strpbrk(r->method, " \t")
+                     || (end_stream && r->content_length > 0);
+    if (malformed) {
+        send_rst(c, id, PROTOCOL_ERROR);
+        return;
+    }
+
+    stream_t *s = stream_open(c, id);
+    if (!s) {
+        send_rst(c, id, REFUSED_STREAM);
+        return;
+    }
+    s->content_length = r->content_length;
+    // without a length the body is passed on as it comes, chunked. a request
+    // without a body gets an explicit empty one unless it is a GET or HEAD
+    s->chunked_body = !end_stream && r->content_length < 0;
+    bool empty = end_stream && r->content_length < 0 && strcmp(r->method, "GET") != 0
+                 && strcmp(r->method, "HEAD") != 0;
+
+    bool ok = request_append(s, r->method, strlen(r->method)) && request_append(s, " ", 1)
+              && request_append(s, r->path, strlen(r->path))
+              && request_append(s, " HTTP/1.1\r\n", 11);
+    if (ok && r->authority && !r->has_host) {
+        ok = request_append(s, "Host: ", 6)
+             && request_append(s, r->authority, strlen(r->authority))
+             && request_append(s, "\r\n", 2);
+    }
+    if (ok && r->len > 0) {
+        ok = request_append(s, r->headers, r->len);
+    }
+    if (ok && s->chunked_body) {
+        ok = request_append(s, "Transfer-Encoding: chunked\r\n", 28);
+    } else if (ok && empty) {
+        ok = request_append(s, "Content-Length: 0\r\n", 19);
+    }
+    // one request per socketpair, the worker closes it after the response
+    ok = ok && request_append(s, "Connection: close\r\n\r\n", 21);
+    if (!ok) {
+        stream_reset(c, s, INTERNAL_ERROR);
+        return;
+    }
+    if (end_stream) {
+        stream_end_remote(c, s);
+    }
+}
+
+// ignores the fields of a header block that is only decoded to keep HPACK in step
+static bool discard_field(void *arg, const char *name, size_t name_len, const char *value,
+    size_t value_len) {
+    (void) arg;
+    (void) name;
+    (void) name_len;
+    (void) value;
+    (void) value_len;
+    return true;
+}
+
+// handles a complete header block
+static bool headers_done(h2_conn_t *c) {
+    c->collecting = false;
+    uint32_t id = c->block_stream;
+    stream_t *s = stream_find(c, id);
+    if (s || id <= c->last_stream) {
+        // trailers, which have to end the stream and are dropped, or HEADERS on a closed stream
+        if (!hpack_decode(c->decoder, c->block, c->block_len, discard_field, NULL)) {
+            return connection_error(c, COMPRESSION_ERROR);
+        }
+        if (!s) {
+            return connection_error(c, STREAM_CLOSED);
+        }
+        if (s->end_stream || !c->block_end_stream) {
+            stream_reset(c, s, PROTOCOL_ERROR);
+        } else {
+            stream_end_remote(c, s);
+        }
+        return true;
+    }
+
+    c->last_stream = id;
+    request_t r = { .content_length = -1 };
+    bool decoded = hpack_decode(c->decoder, c->block, c->block_len, request_field, &r);
+    if (decoded) {
+        start_request(c, id, &r, c->block_end_stream);
+    }
+    request_free(&r);
+    return decoded || connection_error(c, COMPRESSION_ERROR);
+}
+
+// adds a fragment to the header block being collected
+static bool headers_append(h2_conn_t *c, const uint8_t *p, size_t len, int flags) {
+    if (c->block_len + len > HEADER_BLOCK_MAX) {
+        return connection_error(c, ENHANCE_YOUR_CALM);
+    }
+    memcpy(c->block + c->block_len, p, len);
+    c->block_len += len;
+    return !(flags & FLAG_END_HEADERS) || headers_done(c);
+}
+
+// strips the padding of a DATA or HEADERS payload
+static bool unpad(int flags, const uint8_t **p, size_t *len) {
+    if (!(flags & FLAG_PADDED)) {
+        return true;
+    }
+    if (*len < 1 || (*p)[0] >= *len) {
+        return false;
+    }
+    size_t pad = (*p)[0];
+    (*p)++;
+    *len -= 1 + pad;
+    return true;
+}
+
+static bool on_headers(h2_conn_t *c, uint32_t id, int flags, const uint8_t *p, size_t len) {
+    if (id == 0 || id % 2 == 0 || !unpad(flags, &p, &len)) {
+        return connection_error(c, PROTOCOL_ERROR);
+    }
+    // priorities are ignored, streams are served by whichever worker is free
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        p += 5;
+        len -= 5;
+    }
+    c->collecting = true;
+    c->block_stream = id;
+    c->block_end_stream = flags & FLAG_END_STREAM;
+    c->block_len = 0;
+    return headers_append(c, p, len, flags);
+}
+
+static bool on_data(h2_conn_t *c, uint32_t id, int flags, const uint8_t *p, size_t len) {
+    if (id == 0) {
+        return connection_error(c, PROTOCOL_ERROR);
+    }
+    size_t frame_len = len;
+    c->recv_window -= frame_len;
+    if (c->recv_window < 0) {
+        return connection_error(c, FLOW_CONTROL_ERROR);
+    }
+    if (!unpad(flags, &p, &len)) {
+        return connection_error(c, PROTOCOL_ERROR);
+    }
+    stream_t *s = stream_find(c, id);
+    if (!s) {
+        if (id > c->last_stream) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        // a stream closed while its DATA was on the way, it still counts for the connection
+        c->recv_window += frame_len;
+        send_window_update(c, 0, frame_len);
+        return true;
+    }
+    s->credit += frame_len;
+    s->recv_window -= frame_len;
+    s->last_input_ms = now_ms();
+    if (s->end_stream) {
+        stream_reset(c, s, STREAM_CLOSED);
+        return true;
+    }
+    if (s->recv_window < 0) {
+        stream_reset(c, s, FLOW_CONTROL_ERROR);
+        return true;
+    }
+    if (s->response_sent) {
+        if (flags & FLAG_END_STREAM) {
+            stream_close(c, s);
+        } else {
+            give_back(c, s);
+        }
+        return true;
+    }
+    s->body_received += len;
+    if (s->content_length >= 0 && s->body_received > s->content_length) {
+        stream_reset(c, s, PROTOCOL_ERROR);
+        return true;
+    }
+
+    bool ok = true;
+    if (len > 0 && s->chunked_body) {
+        char size[24];
+        int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+        ok = request_append(s, size, n) && request_append(s, (const char *) p, len)
+             && request_append(s, "\r\n", 2);
+    } else if (len > 0) {
+        ok = request_append(s, (const char *) p, len);
+    }
+    if (!ok) {
+        stream_reset(c, s, INTERNAL_ERROR);
+    } else if (flags & FLAG_END_STREAM) {
+        stream_end_remote(c, s);
+    }
+    return true;
+}
+
+static bool on_window_update(h2_conn_t *c, uint32_t id, const uint8_t *p, size_t len) {
+    if (len != 4) {
+        return connection_error(c, FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = get32(p) & MAX_WINDOW;
+    if (id == 0) {
+        c->send_window += increment;
+        if (increment == 0) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        return c->send_window <= MAX_WINDOW || connection_error(c, FLOW_CONTROL_ERROR);
+    }
+    stream_t *s = stream_find(c, id);
+    if (s && increment == 0) {
+        stream_reset(c, s, PROTOCOL_ERROR);
+    } else if (s) {
+        s->send_window += increment;
+        if (s->send_window > MAX_WINDOW) {
+            stream_reset(c, s, FLOW_CONTROL_ERROR);
+        }
+    }
+    return true;
+}
+
+// handles one frame, returns false once the connection is to be closed
+static bool on_frame(h2_conn_t *c, int type, int flags, uint32_t id, const uint8_t *p, size_t len) {
+    // a header block may not be interleaved with anything
+    if (c->collecting && (type != FRAME_CONTINUATION || id != c->block_stream)) {
+        return connection_error(c, PROTOCOL_ERROR);
+    }
+    if (!c->settings_seen && type != FRAME_SETTINGS) {
+        return connection_error(c, PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+    case FRAME_DATA: return on_data(c, id, flags, p, len);
+    case FRAME_HEADERS: return on_headers(c, id, flags, p, len);
+    case FRAME_CONTINUATION:
+        if (!c->collecting) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        return headers_append(c, p, len, flags);
+    case FRAME_PRIORITY:
+        if (id == 0) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        return len == 5 || connection_error(c, FRAME_SIZE_ERROR);
+    case FRAME_RST_STREAM: {
+        if (id == 0 || id > c->last_stream) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        if (len != 4) {
+            return connection_error(c, FRAME_SIZE_ERROR);
+        }
+        stream_t *s = stream_find(c, id);
+        if (s) {
+            stream_close(c, s);
+        }
+        return true;
+    }
+    case FRAME_SETTINGS: {
+        if (id != 0) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        if (flags & FLAG_ACK) {
+            return len == 0 || connection_error(c, FRAME_SIZE_ERROR);
+        }
+        c->settings_seen = true;
+        uint32_t code = apply_settings(c, p, len);
+        if (code != NO_ERROR) {
+            return connection_error(c, code);
+        }
+        return send_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    }
+    case FRAME_PING:
+        if (id != 0) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        if (len != 8) {
+            return connection_error(c, FRAME_SIZE_ERROR);
+        }
+        return (flags & FLAG_ACK) || send_frame(c, FRAME_PING, FLAG_ACK, 0, p, len);
+    case FRAME_GOAWAY:
+        if (id != 0) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        c->goaway_received = true;
+        return true;
+    case FRAME_WINDOW_UPDATE: return on_window_update(c, id, p, len);
+    case FRAME_PUSH_PROMISE: return connection_error(c, PROTOCOL_ERROR);
+    default: return true; // unknown frame types are ignored
+    }
+}
+
+// handles the complete frames in the input buffer
+static bool process_input(h2_conn_t *c) {
+    size_t off = 0;
+    if (c->preface_pending) {
+        if (c->in_len < PREFACE_LEN) {
+            return memcmp(c->in, PREFACE, c->in_len) == 0 || connection_error(c, PROTOCOL_ERROR);
+        }
+        if (memcmp(c->in, PREFACE, PREFACE_LEN) != 0) {
+            return connection_error(c, PROTOCOL_ERROR);
+        }
+        c->preface_pending = false;
+        off = PREFACE_LEN;
+    }
+
+    bool ok = true;
+    while (ok && !c->closing && c->in_len - off >= FRAME_HEADER) {
+        const uint8_t *h = c->in + off;
+        size_t len = (size_t) h[0] << 16 | h[1] << 8 | h[2];
+        if (len > DEFAULT_FRAME_SIZE) {
+            ok = connection_error(c, FRAME_SIZE_ERROR);
+            break;
+        }
+        if (c->in_len - off < FRAME_HEADER + len) {
+            break;
+        }
+        ok = on_frame(c, h[3], h[4], get32(h + 5) & MAX_WINDOW, h + FRAME_HEADER, len);
+        off += FRAME_HEADER + len;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    return ok;
+}
+
+// finds the end of a line in the response buffer, from off
+static char *line_end(stream_t *s, size_t off) {
+    return memmem(s->resp + off, s->resp_len - off, "\r\n", 2);
+}
+
+// sends the worker's response head as HEADERS, returns false if the stream was reset
+static bool send_response_head(h2_conn_t *c, stream_t *s, bool *informational) {
+    char *end = memmem(s->resp + s->resp_off, s->resp_len - s->resp_off, "\r\n\r\n", 4);
+    if (!end) {
+        if (s->worker_closed || (s->resp_off == 0 && s->resp_len == RESPONSE_BUF)) {
+            stream_reset(c, s, INTERNAL_ERROR);
+            return false;
+        }
+        return true;
+    }
+    *end = '\0';
+    char *line = s->resp + s->resp_off;
+    size_t consumed = end + 4 - line;
+
+    int status;
+    if (sscanf(line, "HTTP/1.%*d %3d", &status) != 1 || status < 100 || status > 999) {
+        stream_reset(c, s, INTERNAL_ERROR);
+        return false;
+    }
+    *informational = status < 200;
+
+    uint8_t block[RESPONSE_BUF];
+    char value[4];
+    snprintf(value, sizeof(value), "%d", status);
+    size_t n = hpack_encode(block, sizeof(block), ":status", value);
+
+    int64_t length = -1;
+    bool chunked = false;
+    for (char *next = strstr(line, "\r\n"); next && n > 0;) {
+        char *field = next + 2;
+        next = strstr(field, "\r\n");
+        if (next) {
+            *next = '\0';
+        }
+        char *colon = strchr(field, ':');
+        if (!colon || colon == field) {
+            continue;
+        }
+        *colon = '\0';
+        char *v = colon + 1;
+        while (*v == ' ' || *v == '\t') {
+            v++;
+        }
+        for (char *q = field; *q; q++) {
+            if (*q >= 'A' && *q <= 'Z') {
+                *q += 'a' - 'A';
+            }
+        }
+        if (strcmp(field, "transfer-encoding") == 0) {
+            chunked = strcasestr(v, "chunked") != NULL;
+            continue;
+        }
+        if (strcmp(field, "connection") == 0 || strcmp(field, "keep-alive") == 0
+            || strcmp(field, "proxy-connection") == 0 || strcmp(field, "upgrade") == 0) {
+            continue;
+        }
+        if (strcmp(field, "content-length") == 0) {
+            length = strtoll(v, NULL, 10);
+        }
+        size_t m = hpack_encode(block + n, sizeof(block) - n, field, v);
+        n = m ? n + m : 0;
+    }
+    if (n == 0) {
+        stream_reset(c, s, INTERNAL_ERROR);
+        return false;
+    }
+    s->resp_off += consumed;
+
+    // 1xx responses, e.g. 100 Continue, are passed on and another head follows
+    bool body = !*informational && status != 204 && status != 304 && length != 0;
+    if (!*informational) {
+        if (chunked) {
+            s->state = RESPONSE_CHUNKED;
+            s->chunk = CHUNK_SIZE;
+        } else if (length > 0) {
+            s->state = RESPONSE_LENGTH;
+            s->remaining = length;
+        } else {
+            s->state = RESPONSE_UNTIL_CLOSE;
+        }
+    }
+
+    // a block larger than a frame goes on in CONTINUATION frames
+    int end_stream = body || *informational ? 0 : FLAG_END_STREAM;
+    size_t off = 0;
+    int type = FRAME_HEADERS;
+    do {
+        size_t len = n - off < c->peer_max_frame ? n - off : c->peer_max_frame;
+        int flags = (type == FRAME_HEADERS ? end_stream : 0) | (off + len == n ? FLAG_END_HEADERS : 0);
+        send_frame(c, type, flags, s->id, block + off, len);
+        off += len;
+        type = FRAME_CONTINUATION;
+    } while (off < n);
+    if (!body && !*informational) {
+        stream_done(c, s);
+        return false;
+    }
+    return true;
+}
+
+// finds the next span of body bytes in the response buffer, taking off the
+// chunked framing. returns false on malformed framing. *done is set once the
+// body is complete
+static bool next_body_span(stream_t *s, size_t *len, bool *done) {
+    *len = 0;
+    *done = false;
+    size_t avail = s->resp_len - s->resp_off;
+    switch (s->state) {
+    case RESPONSE_LENGTH:
+        *len = avail < (uint64_t) s->remaining ? avail : (size_t) s->remaining;
+        *done = (int64_t) *len == s->remaining;
+        return true;
+    case RESPONSE_UNTIL_CLOSE:
+        *len = avail;
+        *done = s->worker_closed;
+        return true;
+    default: break;
+    }
+
+    for (;;) {
+        if (s->chunk == CHUNK_DATA) {
+            *len = avail < (uint64_t) s->remaining ? avail : (size_t) s->remaining;
+            return true;
+        }
+        char *end = line_end(s, s->resp_off);
+        if (!end) {
+            return s->resp_len - s->resp_off < RESPONSE_BUF / 2;
+        }
+        char *line = s->resp + s->resp_off;
+        size_t line_len = end - line;
+        s->resp_off += line_len + 2;
+        avail = s->resp_len - s->resp_off;
+        if (s->chunk == CHUNK_DATA_END) {
+            if (line_len != 0) {
+                return false;
+            }
+            s->chunk = CHUNK_SIZE;
+        } else if (s->chunk == CHUNK_SIZE) {
+            char *hex_end;
+            s->remaining = strtoll(line, &hex_end, 16);
+            if (hex_end == line || s->remaining < 0) {
+                return false;
+            }
+            s->chunk = s->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+        } else if (line_len == 0) {
+            // the empty line after the trailers ends the body
+            *done = true;
+            return true;
+        }
+    }
+}
+
+// frames what the worker has sent so far, within the flow control windows.
+// returns false once the stream is closed
+static bool pump_response(h2_conn_t *c, stream_t *s) {
+    while (s->state == RESPONSE_HEAD) {
+        bool informational = false;
+        size_t before = s->resp_off;
+        if (!send_response_head(c, s, &informational)) {
+            return false;
+        }
+        if (s->resp_off == before) {
+            return true; // the head is not complete yet
+        }
+    }
+
+    while (c->out_len - c->out_off < OUT_HIGH) {
+        size_t len;
+        bool done;
+        if (!next_body_span(s, &len, &done)) {
+            stream_reset(c, s, INTERNAL_ERROR);
+            return false;
+        }
+        int64_t window = s->send_window < c->send_window ? s->send_window : c->send_window;
+        if (window < 0) {
+            window = 0;
+        }
+        size_t n = len < (uint64_t) window ? len : (size_t) window;
+        if (n > c->peer_max_frame) {
+            n = c->peer_max_frame;
+        }
+        bool last = done && n == len;
+        if (n == 0 && !last) {
+            break;
+        }
+        if (!send_frame(c, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id, s->resp + s->resp_off, n)) {
+            return false;
+        }
+        s->resp_off += n;
+        s->send_window -= n;
+        c->send_window -= n;
+        if (s->state != RESPONSE_UNTIL_CLOSE) {
+            s->remaining -= n;
+            if (s->state == RESPONSE_CHUNKED && s->remaining == 0 && n > 0) {
+                s->chunk = CHUNK_DATA_END;
+            }
+        }
+        if (last) {
+            stream_done(c, s);
+            return false;
+        }
+    }
+
+    // the worker left before finishing its response
+    if (s->worker_closed && s->resp_off == s->resp_len && s->state != RESPONSE_UNTIL_CLOSE) {
+        stream_reset(c, s, INTERNAL_ERROR);
+        return false;
+    }
+    return true;
+}
+
+// passes buffered request bytes to the worker and reopens the client's
+// windows once the worker has taken them
+static bool pump_request(h2_conn_t *c, stream_t *s) {
+    while (s->req_off < s->req_len && !s->req_failed) {
+        ssize_t n = send(s->fd, s->req + s->req_off, s->req_len - s->req_off,
+            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n < 0) {
+            // the worker answered without reading everything, its response still counts
+            s->req_failed = true;
+            break;
+        }
+        s->req_off += n;
+    }
+    s->req_off = s->req_len = 0;
+
+    // updates are batched
+    if (s->credit >= DEFAULT_FRAME_SIZE || (s->credit > 0 && s->end_stream)) {
+        give_back(c, s);
+    }
+    return true;
+}
+
+// reads what the worker has written and frames it
+static bool read_response(h2_conn_t *c, stream_t *s) {
+    if (s->resp_off > 0) {
+        memmove(s->resp, s->resp + s->resp_off, s->resp_len - s->resp_off);
+        s->resp_len -= s->resp_off;
+        s->resp_off = 0;
+    }
+    while (s->resp_len < RESPONSE_BUF && !s->worker_closed) {
+        ssize_t n = recv(s->fd, s->resp + s->resp_len, RESPONSE_BUF - s->resp_len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            s->worker_closed = true;
+            break;
+        }
+        s->resp_len += n;
+    }
+    return pump_response(c, s);
+}
+
+// whether the worker's response should be read: there is room for it and it can be sent on
+static bool wants_response(const h2_conn_t *c, const stream_t *s) {
+    // an upgraded client may buffer little of what follows the 101 until it
+    // has sent its preface, so stream 1 waits for the client's SETTINGS
+    if (!c->settings_seen || s->worker_closed
+        || (s->resp_len == RESPONSE_BUF && s->resp_off == 0)) {
+        return false;
+    }
+    return s->state == RESPONSE_HEAD
+           || (s->send_window > 0 && c->send_window > 0 && c->out_len - c->out_off < OUT_HIGH);
+}
+
+// sends queued frames to the client without blocking
+static bool flush_out(h2_conn_t *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n < 0) {
+            return false;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return true;
+}
+
+// serves the connection until either side ends it
+// the body deadline of the workers (-B) cannot see a socketpair's progress,
+// so it is kept here: a stream whose worker has taken everything and waits
+// for more of the body is reset once the client sent nothing and was given
+// no window for body_timeout_ms. the worker's read then fails. returns the
+// milliseconds until the next such deadline, -1 if there is none
+static int expire_bodies(h2_conn_t *c) {
+    uint64_t now = now_ms();
+    int next = -1;
+    for (stream_t *s = c->streams, *t; s; s = t) {
+        t = s->next;
+        if (s->end_stream || s->response_sent || s->worker_fd >= 0 || s->req_off < s->req_len) {
+            continue;
+        }
+        uint64_t deadline = s->last_input_ms + c->body_timeout_ms;
+        if (deadline <= now) {
+            stream_reset(c, s, CANCEL);
+            metrics_timeout(METRIC_BODY_TIMEOUT);
+        } else if (next < 0 || deadline - now < (uint64_t) next) {
+            next = deadline - now;
+        }
+    }
+    return next;
+}
+
+static void serve(h2_conn_t *c) {
+    struct pollfd *pfds = malloc((MAX_STREAMS + 1) * sizeof(struct pollfd));
+    stream_t **polled = malloc((MAX_STREAMS + 1) * sizeof(stream_t *));
+    if (!pfds || !polled) {
+        free(pfds);
+        free(polled);
+        return;
+    }
+
+    while (!c->closing) {
+        if (c->goaway_received && c->stream_count == 0 && c->out_off == c->out_len) {
+            break;
+        }
+        bool input = c->in_len < IN_BUF && !c->goaway_received;
+        pfds[0] = (struct pollfd) { .fd = c->fd,
+            .events = (input ? POLLIN : 0) | (c->out_off < c->out_len ? POLLOUT : 0) };
+        int count = 1;
+        for (stream_t *s = c->streams; s; s = s->next) {
+            short events = (s->req_off < s->req_len && !s->req_failed ? POLLOUT : 0)
+                           | (wants_response(c, s) ? POLLIN : 0);
+            // a hung up socket is reported even without events, it waits until it is wanted
+            pfds[count] = (struct pollfd) { .fd = events ? s->fd : -1, .events = events };
+            polled[count++] = s;
+        }
+
+        dispatch_streams(c);
+        int body = expire_bodies(c);
+        int timeout = c->undispatched > 0 ? DISPATCH_RETRY_MS
+                      : c->stream_count == 0 ? c->idle_timeout_ms
+                                             : body;
+        int ready = poll(pfds, count, timeout);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            break;
+        }
+        if (ready == 0 && c->stream_count == 0) {
+            connection_error(c, NO_ERROR);
+            break;
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(c->fd, c->in + c->in_len, IN_BUF - c->in_len, MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                break; // the client is gone, its streams go with it
+            }
+            if (n > 0) {
+                c->in_len += n;
+                if (!process_input(c)) {
+                    break;
+                }
+            }
+        }
+
+        // streams closed while handling input are no longer in the list
+        for (int i = 1; i < count; i++) {
+            stream_t *s = polled[i];
+            bool alive = false;
+            for (stream_t *t = c->streams; t; t = t->next) {
+                alive |= t == s;
+            }
+            if (!alive || !pfds[i].revents) {
+                continue;
+            }
+            if (pfds[i].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                pump_request(c, s);
+            }
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_response(c, s);
+            }
+        }
+
+        // window updates from the client may let stalled responses go on
+        for (stream_t *s = c->streams, *next; s; s = next) {
+            next = s->next;
+            if (s->state != RESPONSE_HEAD && !s->response_sent && s->resp_off < s->resp_len) {
+                pump_response(c, s);
+            }
+        }
+
+        if (!flush_out(c)) {
+            break;
+        }
+    }
+
+    // what is queued, e.g. a GOAWAY, gets a moment to leave
+    while (c->out_off < c->out_len) {
+        struct pollfd pfd = { .fd = c->fd, .events = POLLOUT };
+        if (poll(&pfd, 1, FLUSH_TIMEOUT_MS) <= 0 || !flush_out(c)) {
+            break;
+        }
+    }
+    free(pfds);
+    free(polled);
+}
+
+// connections holding one of the H2_MAX_CONNECTIONS places
+static atomic_int connections;
+
+static void *h2_thread(void *arg) {
+    h2_conn_t *c = arg;
+    serve(c);
+    while (c->streams) {
+        stream_close(c, c->streams);
+    }
+    close(c->fd);
+    hpack_delete(&c->decoder);
+    free(c->block);
+    free(c->out);
+    free(c);
+    atomic_fetch_sub(&connections, 1);
+    return NULL;
+}
+
+// decodes base64url without padding, as in the HTTP2-Settings header
+static bool base64url_decode(const char *s, uint8_t *out, size_t cap, size_t *len) {
+    uint32_t acc = 0;
+    int bits = 0;
+    *len = 0;
+    for (; *s && *s != '='; s++) {
+        int v;
+        if (*s >= 'A' && *s <= 'Z') {
+            v = *s - 'A';
+        } else if (*s >= 'a' && *s <= 'z') {
+            v = *s - 'a' + 26;
+        } else if (*s >= '0' && *s <= '9') {
+            v = *s - '0' + 52;
+        } else if (*s == '-') {
+            v = 62;
+        } else if (*s == '_') {
+            v = 63;
+        } else {
+            return false;
+        }
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (*len == cap) {
+                return false;
+            }
+            out[(*len)++] = acc >> bits;
+        }
+    }
+    return true;
+}
+
+// writes all of buf to a blocking socket
+static bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// turns away a connection that began with the preface: our SETTINGS, as
+// every server's first frame, then GOAWAY before any stream. what the client
+// already sent is read first, closing on it would reset the connection and
+// could drop the GOAWAY
+static void refuse(int fd) {
+    static const uint8_t frames[] = {
+        0, 0, 0, FRAME_SETTINGS, 0, 0, 0, 0, 0, //
+        0, 0, 8, FRAME_GOAWAY, 0, 0, 0, 0, 0, //
+        0, 0, 0, 0, 0, 0, 0, REFUSED_STREAM, //
+    };
+    write_all(fd, (const char *) frames, sizeof(frames));
+    shutdown(fd, SHUT_WR);
+    char buf[IN_BUF];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+    close(fd);
+}
+
+bool h2_start(int fd, h2_dispatch_t dispatch, int idle_timeout_ms, int body_timeout_ms,
+    const h2_upgrade_t *upgrade) {
+    // a thread per connection, so their number is bounded. the place is
+    // given back when h2_thread ends, also on the failures below
+    if (atomic_fetch_add(&connections, 1) >= H2_MAX_CONNECTIONS) {
+        atomic_fetch_sub(&connections, 1);
+        if (upgrade) {
+            close(fd);
+            return false; // the GET is answered over HTTP/1.1 instead
+        }
+        refuse(fd);
+        return true;
+    }
+    h2_conn_t *c = calloc(1, sizeof(h2_conn_t));
+    if (!c) {
+        atomic_fetch_sub(&connections, 1);
+        close(fd);
+        return false;
+    }
+    c->fd = fd;
+    // frames are written as soon as they are ready, and the client's window
+    // updates wait on them, so Nagle's algorithm would only add delayed ACKs
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    c->dispatch = dispatch;
+    c->idle_timeout_ms = idle_timeout_ms;
+    c->body_timeout_ms = body_timeout_ms > 0 ? body_timeout_ms : 1;
+    c->send_window = DEFAULT_WINDOW;
+    c->recv_window = CONNECTION_WINDOW;
+    c->peer_initial_window = DEFAULT_WINDOW;
+    c->peer_max_frame = DEFAULT_FRAME_SIZE;
+    c->decoder = hpack_new(HPACK_TABLE_SIZE);
+    c->block = malloc(HEADER_BLOCK_MAX);
+    if (!c->decoder || !c->block) {
+        h2_thread(c);
+        return false;
+    }
+
+    if (upgrade) {
+        // settings that cannot be decoded or applied mean no upgrade
+        uint8_t settings[256];
+        size_t len;
+        if (!base64url_decode(upgrade->settings, settings, sizeof(settings), &len)
+            || apply_settings(c, settings, len) != NO_ERROR) {
+            h2_thread(c);
+            return false;
+        }
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                        "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        if (!write_all(fd, switching, sizeof(switching) - 1)) {
+            h2_thread(c);
+            return true; // the client is gone, nothing is left to answer
+        }
+        c->preface_pending = true;
+    }
+
+    // our SETTINGS come first, then the connection window is opened wide
+    uint8_t settings[12];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put32(settings + 8, STREAM_WINDOW);
+    send_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    send_window_update(c, 0, CONNECTION_WINDOW - DEFAULT_WINDOW);
+
+    if (upgrade) {
+        // the upgraded request is stream 1, half closed as its body was empty
+        stream_t *s = stream_open(c, 1);
+        c->last_stream = 1;
+        if (!s || !request_append(s, upgrade->head, strlen(upgrade->head))) {
+            h2_thread(c);
+            return true;
+        }
+        s->end_stream = true;
+    }
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&tid, &attr, h2_thread, c);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        h2_thread(c);
+        return !upgrade;
+    }
+    return true;
+}
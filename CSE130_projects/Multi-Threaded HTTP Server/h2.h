@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+
+// HTTP/2 over cleartext TCP (h2c, RFC 9113), entered with the connection
+// preface (prior knowledge) or by upgrading an HTTP/1.1 GET. each h2c
+// connection is served by a thread of its own that speaks the framing, HPACK
+// and flow control, and multiplexes its streams onto the worker pool: every
+// stream's request is rewritten as an HTTP/1.1 request on one end of a
+// socketpair and the other end is dispatched like a freshly accepted
+// connection, so workers answer it with the same handlers, locks and caches
+// as any other request, and a slow stream holds a worker without blocking
+// the rest. the response read back is framed as HEADERS and DATA frames
+// within the peer's flow control windows. request bodies are passed on as
+// they arrive and the stream's window is only reopened once the worker has
+// taken them, so a client cannot buffer more than a window per stream.
+
+// hands a socket with one HTTP/1.1 request on it to the server, which may
+// refuse it for now by returning false. the connection's thread must not
+// block here, as workers may be waiting to write their responses to it, so
+// the stream waits in the connection and is offered again a little later
+typedef bool (*h2_dispatch_t)(int fd);
+
+// the GET an HTTP/1.1 connection asked to upgrade with, answered as stream 1
+typedef struct h2_upgrade {
+    const char *settings; // the HTTP2-Settings header, a base64url SETTINGS payload
+    const char *head; // the request as an HTTP/1.1 head, passed on as is
+} h2_upgrade_t;
+
+// waits until the first bytes on fd show whether they are the HTTP/2
+// connection preface, without consuming anything of an HTTP/1.1 request.
+// returns 1 and consumes the preface if they are, 0 if they are not, and -1
+// if the peer closed first or the read failed
+int h2_peek_preface(int fd);
+
+// h2c connections served at once, each by a thread of its own
+#define H2_MAX_CONNECTIONS 64
+
+// serves an h2c connection on fd in a new thread, which owns fd from then on
+// and closes it on failure too. with upgrade set it first answers the GET
+// with 101 Switching Protocols, but only if its settings are valid and fewer
+// than H2_MAX_CONNECTIONS are served, and returns false without sending
+// anything otherwise. past the limit a connection that began with the
+// preface is sent GOAWAY with REFUSED_STREAM before any stream, so the
+// client may retry it. streams are dispatched
+// through dispatch and the connection is closed after idle_timeout_ms
+// without one. a stream whose worker waits for more of its request body is
+// reset after body_timeout_ms without DATA from the client
+bool h2_start(int fd, h2_dispatch_t dispatch, int idle_timeout_ms, int body_timeout_ms,
+    const h2_upgrade_t *upgrade);
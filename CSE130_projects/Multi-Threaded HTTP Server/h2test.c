@@ -0,0 +1,477 @@
+// tests h2.c by speaking raw frames to a connection thread over a socketpair
+// and playing the worker for the streams it dispatches. covers the frame and
+// flow control edge cases: frame sizes, zero and overflowing window updates,
+// the initial window of the client, streams that break their framing, and
+// connections past the limit.
+// "h2test -v" prints the frames received
+
+#include "h2.h"
+#include "hpack.h"
+
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define FRAME_HEADER 9
+#define MAX_FRAME 16384
+// how long a frame that is expected may take, and how long one that is not is waited for
+#define TIMEOUT_MS 2000
+#define QUIET_MS 200
+
+enum {
+    DATA = 0x0,
+    HEADERS = 0x1,
+    RST_STREAM = 0x3,
+    SETTINGS = 0x4,
+    PING = 0x6,
+    GOAWAY = 0x7,
+    WINDOW_UPDATE = 0x8,
+};
+
+enum { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4 };
+
+enum {
+    PROTOCOL_ERROR = 0x1,
+    FLOW_CONTROL_ERROR = 0x3,
+    STREAM_CLOSED = 0x5,
+    FRAME_SIZE_ERROR = 0x6,
+    REFUSED_STREAM = 0x7,
+};
+
+static bool verbose;
+
+// worker ends of the streams the connection dispatched, taken by the test
+static pthread_mutex_t dispatched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dispatched_cond = PTHREAD_COND_INITIALIZER;
+static int dispatched_fd = -1;
+
+static bool dispatch(int fd) {
+    pthread_mutex_lock(&dispatched_lock);
+    bool taken = dispatched_fd < 0;
+    if (taken) {
+        dispatched_fd = fd;
+        pthread_cond_signal(&dispatched_cond);
+    }
+    pthread_mutex_unlock(&dispatched_lock);
+    return taken;
+}
+
+// waits for the next dispatched stream
+static int take_stream(void) {
+    pthread_mutex_lock(&dispatched_lock);
+    while (dispatched_fd < 0) {
+        pthread_cond_wait(&dispatched_cond, &dispatched_lock);
+    }
+    int fd = dispatched_fd;
+    dispatched_fd = -1;
+    pthread_mutex_unlock(&dispatched_lock);
+    return fd;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void send_all(int fd, const void *buf, size_t len) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    assert(n == (ssize_t) len);
+}
+
+static void send_frame(
+    int fd, int type, int flags, uint32_t stream, const void *payload, size_t len) {
+    uint8_t h[FRAME_HEADER] = { len >> 16, len >> 8, len, type, flags };
+    put32(h + 5, stream);
+    send_all(fd, h, sizeof(h));
+    if (len > 0) {
+        send_all(fd, payload, len);
+    }
+}
+
+static void send_window_update(int fd, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    put32(payload, increment);
+    send_frame(fd, WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+// reads exactly len bytes, returns false on timeout or end of stream
+static bool recv_all(int fd, void *buf, size_t len, int timeout_ms) {
+    for (size_t got = 0; got < len;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            return false;
+        }
+        ssize_t n = recv(fd, (char *) buf + got, len - got, 0);
+        if (n <= 0) {
+            return false;
+        }
+        got += n;
+    }
+    return true;
+}
+
+typedef struct frame {
+    int type, flags;
+    uint32_t stream;
+    uint8_t payload[MAX_FRAME];
+    size_t len;
+} frame_t;
+
+// receives the next frame, returns false if none arrives within timeout_ms
+static bool recv_frame(int fd, frame_t *f, int timeout_ms) {
+    uint8_t h[FRAME_HEADER];
+    if (!recv_all(fd, h, sizeof(h), timeout_ms)) {
+        return false;
+    }
+    f->len = (size_t) h[0] << 16 | h[1] << 8 | h[2];
+    f->type = h[3];
+    f->flags = h[4];
+    f->stream = get32(h + 5) & 0x7fffffff;
+    assert(f->len <= MAX_FRAME);
+    bool ok = recv_all(fd, f->payload, f->len, timeout_ms);
+    if (verbose && ok) {
+        printf("  frame type %d flags 0x%x stream %u length %zu\n", f->type, f->flags, f->stream,
+            f->len);
+    }
+    return ok;
+}
+
+// receives frames until one of the given type, which is returned
+static void expect_frame(int fd, int type, frame_t *f) {
+    do {
+        bool ok = recv_frame(fd, f, TIMEOUT_MS);
+        assert(ok);
+    } while (f->type != type);
+}
+
+// the connection has to end with GOAWAY carrying code, then close
+static void expect_goaway(int fd, uint32_t code) {
+    frame_t f;
+    expect_frame(fd, GOAWAY, &f);
+    assert(f.len == 8 && get32(f.payload + 4) == code);
+    assert(!recv_frame(fd, &f, TIMEOUT_MS));
+    close(fd);
+}
+
+// the stream has to be reset with code, frames on other streams are skipped
+static void expect_rst(int fd, uint32_t stream, uint32_t code) {
+    frame_t f;
+    do {
+        expect_frame(fd, RST_STREAM, &f);
+    } while (f.stream != stream);
+    assert(f.len == 4 && get32(f.payload) == code);
+}
+
+// nothing may arrive for a while
+static void expect_quiet(int fd) {
+    frame_t f;
+    assert(!recv_frame(fd, &f, QUIET_MS));
+}
+
+// starts a connection thread and returns the client's end, before any frame was sent
+static int connect_raw(void) {
+    int sv[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+    assert(rc == 0);
+    bool started = h2_start(sv[1], dispatch, TIMEOUT_MS * 5, TIMEOUT_MS * 5, NULL);
+    assert(started);
+    return sv[0];
+}
+
+// starts a connection and exchanges SETTINGS. initial_window is sent as
+// SETTINGS_INITIAL_WINDOW_SIZE unless it is 0
+static int connect_h2(uint32_t initial_window) {
+    int fd = connect_raw();
+    uint8_t settings[6] = { 0, 0x4 };
+    put32(settings + 2, initial_window);
+    send_frame(fd, SETTINGS, 0, 0, settings, initial_window ? sizeof(settings) : 0);
+
+    // the server's SETTINGS and connection window come first, then the ACK of ours
+    frame_t f;
+    bool ok = recv_frame(fd, &f, TIMEOUT_MS);
+    assert(ok && f.type == SETTINGS && !(f.flags & ACK) && f.len % 6 == 0);
+    ok = recv_frame(fd, &f, TIMEOUT_MS);
+    assert(ok && f.type == WINDOW_UPDATE && f.stream == 0);
+    expect_frame(fd, SETTINGS, &f);
+    assert(f.flags & ACK);
+    send_frame(fd, SETTINGS, ACK, 0, NULL, 0);
+    return fd;
+}
+
+// opens a stream with a request for path, whose body follows unless end_stream
+static void send_request(int fd, uint32_t stream, const char *method, const char *path,
+    const char *content_length, bool end_stream) {
+    uint8_t block[256];
+    size_t n = hpack_encode(block, sizeof(block), ":method", method);
+    n += hpack_encode(block + n, sizeof(block) - n, ":scheme", "http");
+    n += hpack_encode(block + n, sizeof(block) - n, ":path", path);
+    n += hpack_encode(block + n, sizeof(block) - n, ":authority", "h2test");
+    if (content_length) {
+        n += hpack_encode(block + n, sizeof(block) - n, "content-length", content_length);
+    }
+    send_frame(fd, HEADERS, END_HEADERS | (end_stream ? END_STREAM : 0), stream, block, n);
+}
+
+// reads the HTTP/1.1 request head a stream was turned into
+static void recv_request_head(int worker, char *head, size_t cap) {
+    size_t len = 0;
+    while (len < 4 || memcmp(head + len - 4, "\r\n\r\n", 4) != 0) {
+        assert(len + 1 < cap);
+        bool ok = recv_all(worker, head + len, 1, TIMEOUT_MS);
+        assert(ok);
+        len++;
+    }
+    head[len] = '\0';
+}
+
+// keeps the :status of a decoded response head
+static bool find_status(
+    void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    (void) name_len;
+    if (strcmp(name, ":status") == 0 && value_len == 3) {
+        memcpy(arg, value, 4);
+    }
+    return true;
+}
+
+// a PING is echoed, unknown frame types are ignored
+static void test_ping(void) {
+    int fd = connect_h2(0);
+    send_frame(fd, 0xfa, 0, 0, "ignored", 7);
+    send_frame(fd, PING, 0, 0, "h2test!!", 8);
+    frame_t f;
+    expect_frame(fd, PING, &f);
+    assert((f.flags & ACK) && f.len == 8 && memcmp(f.payload, "h2test!!", 8) == 0);
+    close(fd);
+}
+
+// the first frame has to be SETTINGS
+static void test_settings_first(void) {
+    int fd = connect_raw();
+    send_frame(fd, PING, 0, 0, "h2test!!", 8);
+    expect_goaway(fd, PROTOCOL_ERROR);
+}
+
+// a frame larger than SETTINGS_MAX_FRAME_SIZE is refused from its header alone
+static void test_frame_too_large(void) {
+    int fd = connect_h2(0);
+    uint8_t h[FRAME_HEADER] = { (MAX_FRAME + 1) >> 16, (MAX_FRAME + 1) >> 8, (MAX_FRAME + 1) & 0xff,
+        DATA, 0, 0, 0, 0, 1 };
+    send_all(fd, h, sizeof(h));
+    expect_goaway(fd, FRAME_SIZE_ERROR);
+}
+
+// frames of fixed size with another length
+static void test_frame_size_errors(void) {
+    int fd = connect_h2(0);
+    send_frame(fd, PING, 0, 0, "short", 5);
+    expect_goaway(fd, FRAME_SIZE_ERROR);
+
+    fd = connect_h2(0);
+    send_frame(fd, WINDOW_UPDATE, 0, 0, "abc", 3);
+    expect_goaway(fd, FRAME_SIZE_ERROR);
+}
+
+// window updates of 0, or past 2^31 - 1, on the connection
+static void test_connection_window(void) {
+    int fd = connect_h2(0);
+    send_window_update(fd, 0, 0);
+    expect_goaway(fd, PROTOCOL_ERROR);
+
+    fd = connect_h2(0);
+    send_window_update(fd, 0, 0x7fffffff);
+    expect_goaway(fd, FLOW_CONTROL_ERROR);
+
+    // SETTINGS_INITIAL_WINDOW_SIZE has the same limit
+    fd = connect_raw();
+    uint8_t settings[6] = { 0, 0x4 };
+    put32(settings + 2, 0x80000000u);
+    send_frame(fd, SETTINGS, 0, 0, settings, sizeof(settings));
+    expect_goaway(fd, FLOW_CONTROL_ERROR);
+}
+
+// DATA on stream 0 and HEADERS on an even stream are connection errors
+static void test_bad_streams(void) {
+    int fd = connect_h2(0);
+    send_frame(fd, DATA, 0, 0, "x", 1);
+    expect_goaway(fd, PROTOCOL_ERROR);
+
+    fd = connect_h2(0);
+    send_request(fd, 2, "GET", "/x", NULL, true);
+    expect_goaway(fd, PROTOCOL_ERROR);
+
+    // a header block may not be interrupted
+    fd = connect_h2(0);
+    uint8_t block[64];
+    size_t n = hpack_encode(block, sizeof(block), ":method", "GET");
+    send_frame(fd, HEADERS, END_STREAM, 1, block, n);
+    send_frame(fd, PING, 0, 0, "h2test!!", 8);
+    expect_goaway(fd, PROTOCOL_ERROR);
+}
+
+// a response is sent within the client's initial stream window, and the
+// rest waits for WINDOW_UPDATE
+static void test_send_window(void) {
+    int fd = connect_h2(10);
+    send_request(fd, 1, "GET", "/window", NULL, true);
+
+    int worker = take_stream();
+    char head[1024];
+    recv_request_head(worker, head, sizeof(head));
+    assert(strncmp(head, "GET /window HTTP/1.1\r\n", 22) == 0);
+    assert(strstr(head, "\r\nHost: h2test\r\n"));
+    static const char response[] = "HTTP/1.1 200 OK\r\nContent-Length: 25\r\n\r\n"
+                                   "0123456789abcdefghijklmno";
+    send_all(worker, response, sizeof(response) - 1);
+    close(worker);
+
+    frame_t f;
+    expect_frame(fd, HEADERS, &f);
+    assert(f.stream == 1 && (f.flags & END_HEADERS) && !(f.flags & END_STREAM));
+    hpack_t *h = hpack_new(HPACK_TABLE_SIZE);
+    assert(h);
+    char status[4] = "";
+    bool decoded = hpack_decode(h, f.payload, f.len, find_status, status);
+    assert(decoded && strcmp(status, "200") == 0);
+    hpack_delete(&h);
+
+    expect_frame(fd, DATA, &f);
+    assert(f.stream == 1 && f.len == 10 && !(f.flags & END_STREAM));
+    assert(memcmp(f.payload, "0123456789", 10) == 0);
+    expect_quiet(fd);
+
+    send_window_update(fd, 1, 10);
+    expect_frame(fd, DATA, &f);
+    assert(f.len == 10 && !(f.flags & END_STREAM) && memcmp(f.payload, "abcdefghij", 10) == 0);
+    expect_quiet(fd);
+
+    send_window_update(fd, 1, 100);
+    expect_frame(fd, DATA, &f);
+    assert(f.len == 5 && (f.flags & END_STREAM) && memcmp(f.payload, "klmno", 5) == 0);
+    close(fd);
+}
+
+// stream errors only reset their stream
+static void test_stream_errors(void) {
+    int fd = connect_h2(0);
+
+    // a zero window update on an open stream
+    send_request(fd, 1, "PUT", "/zero", "4", false);
+    int worker = take_stream();
+    send_window_update(fd, 1, 0);
+    expect_rst(fd, 1, PROTOCOL_ERROR);
+    close(worker);
+
+    // more DATA than content-length
+    send_request(fd, 3, "PUT", "/long", "4", false);
+    worker = take_stream();
+    send_frame(fd, DATA, 0, 3, "12345", 5);
+    expect_rst(fd, 3, PROTOCOL_ERROR);
+    close(worker);
+
+    // less DATA than content-length
+    send_request(fd, 5, "PUT", "/short", "4", false);
+    worker = take_stream();
+    send_frame(fd, DATA, END_STREAM, 5, "123", 3);
+    expect_rst(fd, 5, PROTOCOL_ERROR);
+    close(worker);
+
+    // DATA after the stream was ended
+    send_request(fd, 7, "PUT", "/ended", "2", false);
+    worker = take_stream();
+    send_frame(fd, DATA, END_STREAM, 7, "12", 2);
+    send_frame(fd, DATA, 0, 7, "3", 1);
+    expect_rst(fd, 7, STREAM_CLOSED);
+    close(worker);
+
+    // the connection is still usable
+    send_frame(fd, PING, 0, 0, "h2test!!", 8);
+    frame_t f;
+    expect_frame(fd, PING, &f);
+    assert(f.flags & ACK);
+    close(fd);
+}
+
+// reads the server's first frames on a new connection and returns whether
+// it is served, i.e. the connection window follows its SETTINGS
+static bool served(int fd) {
+    frame_t f;
+    bool ok = recv_frame(fd, &f, TIMEOUT_MS);
+    assert(ok && f.type == SETTINGS && !(f.flags & ACK));
+    ok = recv_frame(fd, &f, TIMEOUT_MS);
+    assert(ok && (f.type == WINDOW_UPDATE || f.type == GOAWAY));
+    if (f.type == WINDOW_UPDATE) {
+        return true;
+    }
+    // refused before any stream, so the client may retry
+    assert(f.len == 8 && get32(f.payload) == 0 && get32(f.payload + 4) == REFUSED_STREAM);
+    assert(!recv_frame(fd, &f, TIMEOUT_MS));
+    return false;
+}
+
+// past H2_MAX_CONNECTIONS connections are turned away and upgrades declined,
+// until a connection ends. run last, as the places come back asynchronously
+static void test_connection_limit(void) {
+    int fds[H2_MAX_CONNECTIONS];
+    for (int i = 0; i < H2_MAX_CONNECTIONS; i++) {
+        fds[i] = connect_h2(0);
+    }
+    int fd = connect_raw();
+    assert(!served(fd));
+    close(fd);
+
+    // an upgrade is declined without a byte sent, the GET is answered over HTTP/1.1
+    int sv[2];
+    int rc = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
+    assert(rc == 0);
+    h2_upgrade_t up = { "", "GET /limit HTTP/1.1\r\n\r\n" };
+    assert(!h2_start(sv[1], dispatch, TIMEOUT_MS, TIMEOUT_MS, &up));
+    char c;
+    assert(recv(sv[0], &c, 1, 0) == 0);
+    close(sv[0]);
+
+    // the place of a closed connection is given back once its thread ends
+    close(fds[0]);
+    int tries = 0;
+    for (fd = connect_raw(); !served(fd); fd = connect_raw()) {
+        close(fd);
+        assert(++tries < TIMEOUT_MS / 10);
+        usleep(10 * 1000);
+    }
+    if (verbose) {
+        printf("limit: %d connections served, a place came back after %d tries\n",
+            H2_MAX_CONNECTIONS, tries);
+    }
+    close(fd);
+    for (int i = 1; i < H2_MAX_CONNECTIONS; i++) {
+        close(fds[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    test_ping();
+    test_settings_first();
+    test_frame_too_large();
+    test_frame_size_errors();
+    test_connection_window();
+    test_bad_streams();
+    test_send_window();
+    test_stream_errors();
+    test_connection_limit();
+    printf("h2test: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,552 @@
+#include "hpack.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// bytes an entry counts against the dynamic table size besides its strings
+#define ENTRY_OVERHEAD 32
+// longest Huffman code, in bits
+#define HUFFMAN_MAX_BITS 30
+// symbol that may only appear as padding
+#define HUFFMAN_EOS 256
+
+typedef struct field {
+    const char *name, *value;
+} field_t;
+
+// the static table, indexes 1 to 61
+static const field_t static_table[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+#define STATIC_COUNT (sizeof(static_table) / sizeof(static_table[0]))
+
+// the Huffman code of RFC 7541 appendix B. it is canonical, so besides the
+// code and length of every symbol for encoding, decoding only needs the
+// number of codes of each length and the symbols ordered by code
+static const uint32_t huffman_code[257] = {
+    0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+    0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+    0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+    0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+    0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+    0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+    0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+    0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+    0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+    0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+    0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+    0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+    0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+    0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+    0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+    0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+    0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+    0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+    0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+    0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+    0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+    0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+    0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+    0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+    0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+    0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+    0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+    0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+    0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+    0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+    0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+    0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+    0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+    0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+    0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+    0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+    0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+    0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+    0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+    0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+    0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+    0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+    0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee, 0x3fffffff,
+};
+
+static const uint8_t huffman_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static const uint16_t huffman_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t huffman_symbol[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+// an entry of the dynamic table, name and value in one allocation
+typedef struct entry {
+    char *name, *value;
+    size_t name_len, value_len;
+} entry_t;
+
+// structure for a decoder
+typedef struct hpack {
+    // dynamic table as a ring, newest entry at head
+    entry_t *entries;
+    size_t cap, count, head;
+    size_t size; // bytes the entries count for
+    size_t max_size; // current limit, set by the peer's size updates
+    size_t limit; // the most the peer may set it to
+    // decoded literal strings, reused between fields
+    char *name_buf, *value_buf;
+    size_t name_cap, value_cap;
+} hpack_t;
+
+hpack_t *hpack_new(size_t max_size) {
+    hpack_t *h = calloc(1, sizeof(hpack_t));
+    if (!h) {
+        return NULL;
+    }
+    // every entry counts for at least its overhead, which bounds how many fit
+    h->cap = max_size / ENTRY_OVERHEAD + 1;
+    h->entries = calloc(h->cap, sizeof(entry_t));
+    if (!h->entries) {
+        free(h);
+        return NULL;
+    }
+    h->max_size = h->limit = max_size;
+    return h;
+}
+
+// removes the oldest entry
+static void evict(hpack_t *h) {
+    entry_t *e = &h->entries[(h->head + h->count - 1) % h->cap];
+    h->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+    free(e->name);
+    e->name = e->value = NULL;
+    h->count--;
+}
+
+void hpack_delete(hpack_t **h) {
+    if (!h || !*h) {
+        return;
+    }
+    while ((*h)->count > 0) {
+        evict(*h);
+    }
+    free((*h)->entries);
+    free((*h)->name_buf);
+    free((*h)->value_buf);
+    free(*h);
+    *h = NULL;
+}
+
+// adds a field as the newest entry, evicting old ones to make room. a field
+// larger than the whole table empties it and is not added
+static bool insert(hpack_t *h, const char *name, size_t name_len, const char *value,
+    size_t value_len, entry_t **added) {
+    *added = NULL;
+    size_t size = name_len + value_len + ENTRY_OVERHEAD;
+    // the name may be that of an entry about to be evicted, so it is copied first
+    char *copy = NULL;
+    if (size <= h->max_size) {
+        copy = malloc(name_len + value_len + 2);
+        if (!copy) {
+            return false;
+        }
+        memcpy(copy, name, name_len);
+        copy[name_len] = '\0';
+        memcpy(copy + name_len + 1, value, value_len);
+        copy[name_len + 1 + value_len] = '\0';
+    }
+    while (h->count > 0 && h->size + size > h->max_size) {
+        evict(h);
+    }
+    if (!copy) {
+        return true;
+    }
+    h->head = (h->head + h->cap - 1) % h->cap;
+    entry_t *e = &h->entries[h->head];
+    *e = (entry_t) { copy, copy + name_len + 1, name_len, value_len };
+    h->count++;
+    h->size += size;
+    *added = e;
+    return true;
+}
+
+// looks up index in the static table followed by the dynamic one
+static bool lookup(hpack_t *h, size_t index, const char **name, size_t *name_len,
+    const char **value, size_t *value_len) {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= STATIC_COUNT) {
+        *name = static_table[index - 1].name;
+        *value = static_table[index - 1].value;
+        *name_len = strlen(*name);
+        *value_len = strlen(*value);
+        return true;
+    }
+    index -= STATIC_COUNT + 1;
+    if (index >= h->count) {
+        return false;
+    }
+    entry_t *e = &h->entries[(h->head + index) % h->cap];
+    *name = e->name;
+    *value = e->value;
+    *name_len = e->name_len;
+    *value_len = e->value_len;
+    return true;
+}
+
+// decodes an integer with an n-bit prefix at *p
+static bool get_int(const uint8_t **p, const uint8_t *end, int n, size_t *value) {
+    if (*p >= end) {
+        return false;
+    }
+    size_t mask = (1u << n) - 1;
+    *value = **p & mask;
+    (*p)++;
+    if (*value < mask) {
+        return true;
+    }
+    // anything past 2^28 is more than any header block could need
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (*p >= end) {
+            return false;
+        }
+        uint8_t b = *(*p)++;
+        *value += (size_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// decodes Huffman coded bytes into out, which has room for the longest result
+static bool huffman_decode(const uint8_t *in, size_t len, char *out, size_t *out_len) {
+    uint32_t code = 0, first = 0;
+    int index = 0, bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = code << 1 | ((in[i] >> b) & 1);
+            bits++;
+            int count = huffman_count[bits];
+            if (code - first < (uint32_t) count) {
+                int symbol = huffman_symbol[index + code - first];
+                if (symbol == HUFFMAN_EOS) {
+                    return false;
+                }
+                out[n++] = (char) symbol;
+                code = first = 0;
+                index = bits = 0;
+            } else if (bits == HUFFMAN_MAX_BITS) {
+                return false;
+            } else {
+                index += count;
+                first = (first + count) << 1;
+            }
+        }
+    }
+    // the padding has to be a prefix of EOS, all ones and shorter than a byte
+    if (bits > 7 || code != (1u << bits) - 1) {
+        return false;
+    }
+    *out_len = n;
+    return true;
+}
+
+// decodes a string literal at *p into *buf, grown as needed
+static bool get_string(const uint8_t **p, const uint8_t *end, char **buf, size_t *cap,
+    size_t *len) {
+    if (*p >= end) {
+        return false;
+    }
+    bool huffman = **p & 0x80;
+    size_t raw;
+    if (!get_int(p, end, 7, &raw) || raw > (size_t) (end - *p)) {
+        return false;
+    }
+    // the shortest code is 5 bits, which bounds the decoded length
+    size_t need = (huffman ? raw * 8 / 5 : raw) + 1;
+    if (need > *cap) {
+        char *grown = realloc(*buf, need);
+        if (!grown) {
+            return false;
+        }
+        *buf = grown;
+        *cap = need;
+    }
+    if (huffman) {
+        if (!huffman_decode(*p, raw, *buf, len)) {
+            return false;
+        }
+    } else {
+        memcpy(*buf, *p, raw);
+        *len = raw;
+    }
+    (*buf)[*len] = '\0';
+    *p += raw;
+    return true;
+}
+
+bool hpack_decode(hpack_t *h, const uint8_t *block, size_t len, hpack_field_t field, void *arg) {
+    const uint8_t *p = block, *end = block + len;
+    bool seen_field = false;
+    while (p < end) {
+        uint8_t b = *p;
+        const char *name, *value;
+        size_t name_len, value_len, index;
+
+        if (b & 0x80) {
+            // indexed field
+            if (!get_int(&p, end, 7, &index)
+                || !lookup(h, index, &name, &name_len, &value, &value_len)) {
+                return false;
+            }
+        } else if ((b & 0xe0) == 0x20) {
+            // dynamic table size update, only allowed before the first field
+            size_t size;
+            if (seen_field || !get_int(&p, end, 5, &size) || size > h->limit) {
+                return false;
+            }
+            h->max_size = size;
+            while (h->count > 0 && h->size > h->max_size) {
+                evict(h);
+            }
+            continue;
+        } else {
+            // literal, with incremental indexing (01) or without (0000, never indexed 0001)
+            bool indexing = (b & 0xc0) == 0x40;
+            if (!get_int(&p, end, indexing ? 6 : 4, &index)) {
+                return false;
+            }
+            if (index) {
+                const char *unused;
+                size_t unused_len;
+                if (!lookup(h, index, &name, &name_len, &unused, &unused_len)) {
+                    return false;
+                }
+            } else {
+                if (!get_string(&p, end, &h->name_buf, &h->name_cap, &name_len)) {
+                    return false;
+                }
+                name = h->name_buf;
+            }
+            if (!get_string(&p, end, &h->value_buf, &h->value_cap, &value_len)) {
+                return false;
+            }
+            value = h->value_buf;
+            if (indexing) {
+                entry_t *added;
+                if (!insert(h, name, name_len, value, value_len, &added)) {
+                    return false;
+                }
+                if (added) {
+                    name = added->name;
+                    value = added->value;
+                }
+            }
+        }
+        seen_field = true;
+        if (!field(arg, name, name_len, value, value_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// appends an integer with an n-bit prefix, the prefix byte starting as first
+static size_t put_int(uint8_t *out, size_t cap, uint8_t first, int n, size_t value) {
+    size_t mask = (1u << n) - 1;
+    if (cap < 1) {
+        return 0;
+    }
+    if (value < mask) {
+        out[0] = first | value;
+        return 1;
+    }
+    out[0] = first | mask;
+    value -= mask;
+    size_t i = 1;
+    while (value >= 0x80) {
+        if (i >= cap) {
+            return 0;
+        }
+        out[i++] = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    if (i >= cap) {
+        return 0;
+    }
+    out[i++] = value;
+    return i;
+}
+
+// appends a string literal, Huffman coded if that is shorter
+static size_t put_string(uint8_t *out, size_t cap, const char *s) {
+    size_t len = strlen(s);
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        bits += huffman_len[(uint8_t) s[i]];
+    }
+    size_t coded = (bits + 7) / 8;
+    if (coded >= len) {
+        size_t n = put_int(out, cap, 0x00, 7, len);
+        if (!n || cap - n < len) {
+            return 0;
+        }
+        memcpy(out + n, s, len);
+        return n + len;
+    }
+
+    size_t n = put_int(out, cap, 0x80, 7, coded);
+    if (!n || cap - n < coded) {
+        return 0;
+    }
+    uint8_t *o = out + n;
+    uint64_t acc = 0;
+    int pending = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = s[i];
+        acc = acc << huffman_len[c] | huffman_code[c];
+        pending += huffman_len[c];
+        while (pending >= 8) {
+            pending -= 8;
+            *o++ = acc >> pending;
+        }
+    }
+    // padded with the most significant bits of EOS, which are all ones
+    if (pending > 0) {
+        *o++ = (acc << (8 - pending)) | (0xff >> pending);
+    }
+    return n + coded;
+}
+
+size_t hpack_encode(uint8_t *out, size_t cap, const char *name, const char *value) {
+    size_t name_index = 0;
+    for (size_t i = 0; i < STATIC_COUNT; i++) {
+        if (strcmp(static_table[i].name, name) != 0) {
+            continue;
+        }
+        if (strcmp(static_table[i].value, value) == 0) {
+            return put_int(out, cap, 0x80, 7, i + 1);
+        }
+        if (!name_index) {
+            name_index = i + 1;
+        }
+    }
+
+    // literal without indexing, with the static name if there is one
+    size_t n = put_int(out, cap, 0x00, 4, name_index);
+    if (!n) {
+        return 0;
+    }
+    if (!name_index) {
+        size_t m = put_string(out + n, cap - n, name);
+        if (!m) {
+            return 0;
+        }
+        n += m;
+    }
+    size_t m = put_string(out + n, cap - n, value);
+    return m ? n + m : 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// HPACK header compression (RFC 7541) for the h2c mode. the decoder keeps
+// the dynamic table the peer's encoder fills and understands every field
+// representation, Huffman coded or not. the encoder is stateless: it refers
+// to the static table where it can and Huffman codes a string when that
+// makes it shorter, but never adds to the peer's dynamic table, which is
+// always allowed and keeps nothing to synchronize between streams.
+
+// dynamic table size of the decoder, the SETTINGS_HEADER_TABLE_SIZE default
+#define HPACK_TABLE_SIZE 4096
+
+typedef struct hpack hpack_t;
+
+// creates a decoder whose dynamic table may grow to max_size bytes
+hpack_t *hpack_new(size_t max_size);
+
+// frees a decoder
+void hpack_delete(hpack_t **h);
+
+// receives one decoded header field. name and value are NUL terminated but
+// may contain NUL themselves, so their lengths are passed too. returning
+// false stops decoding
+typedef bool (*hpack_field_t)(
+    void *arg, const char *name, size_t name_len, const char *value, size_t value_len);
+
+// decodes a complete header block and passes its fields in order. returns
+// false on a compression error, after which the decoder is out of step with
+// the peer and the connection has to be closed
+bool hpack_decode(hpack_t *h, const uint8_t *block, size_t len, hpack_field_t field, void *arg);
+
+// appends one header field to out, whose free space is cap bytes. the name
+// has to be lowercase. returns the bytes written, 0 if they do not fit
+size_t hpack_encode(uint8_t *out, size_t cap, const char *name, const char *value);
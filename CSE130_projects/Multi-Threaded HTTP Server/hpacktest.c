@@ -0,0 +1,232 @@
+// tests hpack.c against the examples of RFC 7541 appendix C and round trips
+// through the encoder. "hpacktest -v" prints every decoded block
+
+#include "hpack.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+static bool verbose;
+
+// the fields of a decoded block as "name: value" lines
+typedef struct decoded {
+    char text[2048];
+    size_t len;
+} decoded_t;
+
+static bool collect(
+    void *arg, const char *name, size_t name_len, const char *value, size_t value_len) {
+    decoded_t *d = arg;
+    int n = snprintf(d->text + d->len, sizeof(d->text) - d->len, "%.*s: %.*s\n", (int) name_len,
+        name, (int) value_len, value);
+    assert(n > 0 && (size_t) n < sizeof(d->text) - d->len);
+    d->len += n;
+    return true;
+}
+
+// converts hex digits, spaces allowed between them, into bytes
+static size_t unhex(const char *hex, uint8_t *out, size_t cap) {
+    size_t len = 0;
+    for (const char *p = hex; *p;) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+        unsigned byte;
+        assert(len < cap && sscanf(p, "%2x", &byte) == 1);
+        out[len++] = byte;
+        p += 2;
+    }
+    return len;
+}
+
+// decodes one block with h, whose dynamic table carries over from the
+// previous blocks, and checks the fields it holds
+static void check_block(hpack_t *h, const char *hex, const char *expected) {
+    uint8_t block[512];
+    size_t len = unhex(hex, block, sizeof(block));
+    decoded_t d = { .len = 0 };
+    bool ok = hpack_decode(h, block, len, collect, &d);
+    if (verbose) {
+        printf("%s\n", d.text);
+    }
+    assert(ok);
+    assert(strcmp(d.text, expected) == 0);
+}
+
+// whether a block is rejected by a fresh decoder with the given table size
+static bool rejected(size_t table_size, const char *hex) {
+    uint8_t block[64];
+    size_t len = unhex(hex, block, sizeof(block));
+    hpack_t *h = hpack_new(table_size);
+    assert(h);
+    decoded_t d = { .len = 0 };
+    bool ok = hpack_decode(h, block, len, collect, &d);
+    hpack_delete(&h);
+    return !ok;
+}
+
+// checks the exact encoding of one field
+static void check_encode(const char *name, const char *value, const char *hex) {
+    uint8_t expected[64], out[64];
+    size_t len = unhex(hex, expected, sizeof(expected));
+    size_t n = hpack_encode(out, sizeof(out), name, value);
+    assert(n == len && memcmp(out, expected, len) == 0);
+}
+
+// C.2: one field of each representation, each in a fresh decoder
+static void test_representations(void) {
+    static const struct {
+        const char *hex, *expected;
+    } cases[] = {
+        { "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+            "custom-key: custom-header\n" },
+        { "040c 2f73 616d 706c 652f 7061 7468", ":path: /sample/path\n" },
+        { "1008 7061 7373 776f 7264 0673 6563 7265 74", "password: secret\n" },
+        { "82", ":method: GET\n" },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        hpack_t *h = hpack_new(HPACK_TABLE_SIZE);
+        assert(h);
+        check_block(h, cases[i].hex, cases[i].expected);
+        hpack_delete(&h);
+    }
+}
+
+// C.3 and C.4: three requests sharing a dynamic table, without and with Huffman coding
+static void test_requests(void) {
+    static const char *first
+        = ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n";
+    static const char *second = ":method: GET\n:scheme: http\n:path: /\n"
+                                ":authority: www.example.com\ncache-control: no-cache\n";
+    static const char *third = ":method: GET\n:scheme: https\n:path: /index.html\n"
+                               ":authority: www.example.com\ncustom-key: custom-value\n";
+
+    hpack_t *h = hpack_new(HPACK_TABLE_SIZE);
+    assert(h);
+    check_block(h, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", first);
+    check_block(h, "8286 84be 5808 6e6f 2d63 6163 6865", second);
+    check_block(h,
+        "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65", third);
+    hpack_delete(&h);
+
+    h = hpack_new(HPACK_TABLE_SIZE);
+    assert(h);
+    check_block(h, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", first);
+    check_block(h, "8286 84be 5886 a8eb 1064 9cbf", second);
+    check_block(h, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", third);
+    hpack_delete(&h);
+}
+
+// C.5 and C.6: three responses in a 256 byte table, so entries are evicted
+static void test_responses(void) {
+    static const char *first = ":status: 302\ncache-control: private\n"
+                               "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                               "location: https://www.example.com\n";
+    static const char *second = ":status: 307\ncache-control: private\n"
+                                "date: Mon, 21 Oct 2013 20:13:21 GMT\n"
+                                "location: https://www.example.com\n";
+    static const char *third
+        = ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\n"
+          "location: https://www.example.com\ncontent-encoding: gzip\n"
+          "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n";
+
+    hpack_t *h = hpack_new(256);
+    assert(h);
+    check_block(h,
+        "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 "
+        "303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 "
+        "6f6d",
+        first);
+    check_block(h, "4803 3330 37c1 c0bf", second);
+    check_block(h,
+        "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 "
+        "5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 "
+        "5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31",
+        third);
+    hpack_delete(&h);
+
+    h = hpack_new(256);
+    assert(h);
+    check_block(h,
+        "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b "
+        "ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+        first);
+    check_block(h, "4883 640e ffc1 c0bf", second);
+    check_block(h,
+        "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad "
+        "94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 "
+        "65c0 03ed 4ee5 b106 3d50 07",
+        third);
+    hpack_delete(&h);
+}
+
+// blocks a decoder has to refuse
+static void test_errors(void) {
+    assert(rejected(HPACK_TABLE_SIZE, "80")); // index 0
+    assert(rejected(HPACK_TABLE_SIZE, "be")); // first dynamic index, the table is empty
+    assert(rejected(HPACK_TABLE_SIZE, "400a 6375")); // string cut short
+    assert(rejected(HPACK_TABLE_SIZE, "0081 0001 61")); // Huffman padding that is not EOS
+    assert(rejected(256, "3fe1 1f")); // table size update past the maximum
+    assert(!rejected(HPACK_TABLE_SIZE, "3fe1 1f"));
+}
+
+// the encoder refers to the static table and Huffman codes what gets shorter,
+// the strings are those of C.4 and C.6
+static void test_encode(void) {
+    check_encode(":method", "GET", "82");
+    check_encode(":status", "200", "88");
+    check_encode(":authority", "www.example.com", "018c f1e3 c2e5 f23a 6ba0 ab90 f4ff");
+    check_encode(":status", "302", "0882 6402");
+    check_encode("custom-key", "custom-value", "0088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf");
+    check_encode("x", "{}", "0001 7802 7b7d"); // Huffman would be longer
+
+    uint8_t small[4];
+    assert(hpack_encode(small, sizeof(small), "custom-key", "custom-value") == 0);
+}
+
+// encoded fields decode to themselves, including lengths that take several
+// bytes of integer encoding
+static void test_round_trip(void) {
+    static char long_value[1338];
+    memset(long_value, 'a', sizeof(long_value) - 1);
+    const char *fields[][2] = {
+        { ":method", "PUT" },
+        { ":path", "/upload/file.bin" },
+        { "content-length", "1337" },
+        { "user-agent", "hpacktest/1.0" },
+        { "x-long", long_value },
+    };
+
+    uint8_t block[2048];
+    size_t len = 0;
+    decoded_t expected = { .len = 0 };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        size_t n = hpack_encode(block + len, sizeof(block) - len, fields[i][0], fields[i][1]);
+        assert(n > 0);
+        len += n;
+        collect(&expected, fields[i][0], strlen(fields[i][0]), fields[i][1], strlen(fields[i][1]));
+    }
+
+    hpack_t *h = hpack_new(HPACK_TABLE_SIZE);
+    assert(h);
+    decoded_t d = { .len = 0 };
+    assert(hpack_decode(h, block, len, collect, &d));
+    assert(strcmp(d.text, expected.text) == 0);
+    hpack_delete(&h);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    test_representations();
+    test_requests();
+    test_responses();
+    test_errors();
+    test_encode();
+    test_round_trip();
+    printf("hpacktest: all tests passed\n");
+    return 0;
+}
@@ -1,273 +1,1926 @@
+#define _GNU_SOURCE
 #include "listener_socket.h"
 #include "connection.h"
 #include "response.h"
 #include "request.h"
 #include "rwlock.h"
+#include "lock_table.h"
 #include "queue.h"
+#include "event_loop.h"
+#include "audit_log.h"
+#include "object_cache.h"
+#include "io_backend.h"
+#include "work_pool.h"
+#include "autoscaler.h"
+#include "metrics.h"
+#include "file_version.h"
+#include "deadline.h"
+#include "admission.h"
+#include "chunked.h"
+#include "group_commit.h"
+#include "fd_cache.h"
+#include "affinity.h"
+#include "blob_store.h"
+#include "staging.h"
+#include "h2.h"
+#include "scheduler.h"
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <limits.h>
 
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <sys/stat.h>
 
 //default number of worker threads
 #define DEFAULT_THREAD_COUNT 4
 //size of the request queue
 #define QUEUE_SIZE 128
+//default bounds and target queue wait for the autoscaler
+#define DEFAULT_MIN_THREADS 2
+#define DEFAULT_TARGET_WAIT_MS 10
+//largest file kept in the object cache
+#define CACHE_MAX_OBJECT (1 << 20)
+//default number of requests served per connection (1 disables keep-alive)
+#define DEFAULT_MAX_REQUESTS 1
+//default time a kept-alive connection may wait for its next request
+#define DEFAULT_IDLE_TIMEOUT_MS 5000
+//most byte ranges answered in one response, longer Range headers get the whole file
+#define MAX_RANGES 16
+//separates the parts of a multi-range response
+#define RANGE_BOUNDARY "httpserver_byteranges_7d1f3a"
+//default time a request head may take to arrive
+#define DEFAULT_HEADER_TIMEOUT_MS 5000
+//default time a request body may go without a byte arriving
+#define DEFAULT_BODY_TIMEOUT_MS 5000
+//default interval the queue wait may stay above target before shedding starts (-I)
+#define DEFAULT_SHED_INTERVAL_MS 100
+//default number of PUTs that end a group commit window early (-G)
+#define DEFAULT_COMMIT_BATCH 64
+//resolution of the workers' read deadlines
+#define DEADLINE_TICK_MS 10
+//reserved URI answered with the server metrics instead of a file
+#define METRICS_URI "metrics"
+//directory holding the deduplicated PUT bodies (-D)
+#define BLOB_STORE_DIR ".httpserver_blobs"
+//time an upload sent in parts may go without a part before it is dropped
+#define STAGING_TIMEOUT_MS 60000
+//largest total size of an upload sent in parts
+#define STAGING_MAX_TOTAL ((off_t) 4 << 30)
 
 // global variables
 queue_t *request_queue; // queue for storing client connections
+work_pool_t *work_pool = NULL; // per-worker deques, replaces request_queue with -A
+scheduler_t *scheduler = NULL; // fair queueing by class and URI, replaces request_queue with -R
+int *listen_fds = NULL; // one SO_REUSEPORT socket per acceptor thread (-A)
+autoscaler_t *autoscaler = NULL; // resizes the worker pool with the load (-M)
 pthread_t *worker_threads;
 int thread_count = DEFAULT_THREAD_COUNT; // number of worker threads
+lock_table_t *lock_table; // per-URI reader-writer locks
+event_loop_t *event_loop = NULL; // parks connections until a request arrives (-e)
+audit_log_t *audit_log = NULL; // batched background logging (-a)
+object_cache_t *object_cache = NULL; // in-memory copies of hot files (-c)
+int max_requests = DEFAULT_MAX_REQUESTS; // requests served per connection (-k)
+int idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS; // keep-alive idle timeout (-i)
+int header_timeout_ms = DEFAULT_HEADER_TIMEOUT_MS; // request head deadline (-H)
+int body_timeout_ms = DEFAULT_BODY_TIMEOUT_MS; // request body inactivity deadline (-B)
+deadlines_t *deadlines; // cuts off workers' reads that miss their deadline
+admission_t *admission = NULL; // sheds load once the queue wait stays high (-S)
+group_commit_t *group_commit = NULL; // batches the fsyncs of durable PUTs (-F)
+fd_cache_t *fd_cache = NULL; // open descriptors of recently read files (-o)
+affinity_t *affinity = NULL; // pins threads to CPUs and steers connections to them (-p)
+blob_store_t *blob_store = NULL; // keeps each distinct PUT body once (-D)
+staging_t *staging; // uploads sent in parts with Content-Range
+int queue_capacity = QUEUE_SIZE; // connections the queue or work pool holds
+bool versioning = false; // readers serve immutable versions instead of locking (-V)
+bool h2c = false; // HTTP/2 over cleartext TCP, by preface or upgrade (-2)
 
 //  function prototypes
-void handle_connection(int connfd);
-void handle_get(conn_t *conn);
-void handle_put(conn_t *conn);
+bool handle_connection(int connfd);
+void serve_connection(int connfd);
+bool handle_get(conn_t *conn, int connfd);
+bool handle_put(conn_t *conn, int connfd);
+bool handle_chunked_put(int connfd, const chunked_request_t *req);
 void handle_unsupported(conn_t *conn);
 void log_request(const char *operation, const char *uri, int status, const char *request_id);
 void *worker_thread(void *arg);
+void *signal_thread(void *arg);
+void *acceptor_thread(void *arg);
+void dispatch_connection(int connfd);
+void accept_connection(int connfd);
+bool accept_stream(int fd);
 
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void log_request(const char *operation, const char *uri, int status, const char *request_id) {
+    if (audit_log) {
+        // no lock or syscall here, the line is stamped and queued for the flusher
+        audit_log_write(audit_log, operation, uri, status, request_id);
+        return;
+    }
+
     pthread_mutex_lock(&log_mutex);
     fprintf(stderr, "%s,%s,%d,%s\n", operation, uri, status, request_id ? request_id : "0");
     fflush(stderr);
     pthread_mutex_unlock(&log_mutex);
 }
 
-// handle unsupported requests
-void handle_unsupported(conn_t *conn) {
-    const char *request_id = conn_get_header(conn, "Request-Id");
-    log_request("UNSUPPORTED", conn_get_uri(conn), 501, request_id);
-    conn_send_response(conn, &RESPONSE_NOT_IMPLEMENTED);
+// returns the current monotonic time in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-// rwlock helper functions
-typedef struct file_lock {
-    char *uri;
-    rwlock_t *lock;
-    struct file_lock *next;
-} file_lock_t;
+// waits for a termination signal, writes out the queued audit log lines and
+// then lets the signal terminate the process as it would have
+void *signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    if (sigwait(set, &sig) == 0) {
+        audit_log_flush(audit_log);
+        signal(sig, SIG_DFL);
+        pthread_sigmask(SIG_UNBLOCK, set, NULL);
+        raise(sig);
+    }
+    return NULL;
+}
 
-file_lock_t *file_lock_table = NULL;
-pthread_mutex_t file_lock_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+// checks whether a comma separated header value lists token
+static bool token_listed(const char *list, const char *token) {
+    size_t len = strlen(token);
+    for (const char *p = list; *p;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        const char *end = p;
+        while (*end && *end != ',' && *end != ' ' && *end != '\t') {
+            end++;
+        }
+        if ((size_t) (end - p) == len && strncasecmp(p, token, len) == 0) {
+            return true;
+        }
+        p = end;
+    }
+    return false;
+}
 
-rwlock_t *get_file_lock(const char *uri) {
-    pthread_mutex_lock(&file_lock_table_mutex);
+// switches the connection to h2c if the GET asked for it with Upgrade: h2c.
+// the GET itself is answered as stream 1, so its head is rebuilt from the
+// headers the GET handler looks at. returns whether the connection was
+// handed over, otherwise the GET is answered as usual
+static bool upgrade_h2c(conn_t *conn, int connfd) {
+    const char *upgrade = conn_get_header(conn, "Upgrade");
+    const char *settings = conn_get_header(conn, "HTTP2-Settings");
+    if (!upgrade || !settings || !token_listed(upgrade, "h2c")) {
+        return false;
+    }
 
-    file_lock_t *fl = file_lock_table;
-    while (fl) {
-        if (strcmp(fl->uri, uri) == 0) {
-            pthread_mutex_unlock(&file_lock_table_mutex);
-            return fl->lock;
+    static char *const forwarded[]
+        = { "Request-Id", "Range", "If-Range", "If-None-Match", "If-Modified-Since" };
+    char head[2048];
+    size_t len = snprintf(head, sizeof(head), "GET /%s HTTP/1.1\r\n", conn_get_uri(conn));
+    for (size_t i = 0; i < sizeof(forwarded) / sizeof(forwarded[0]) && len < sizeof(head); i++) {
+        const char *value = conn_get_header(conn, forwarded[i]);
+        if (value) {
+            len += snprintf(head + len, sizeof(head) - len, "%s: %s\r\n", forwarded[i], value);
         }
-        fl = fl->next;
+    }
+    if (len < sizeof(head)) {
+        len += snprintf(head + len, sizeof(head) - len, "Connection: close\r\n\r\n");
+    }
+    if (len >= sizeof(head)) {
+        return false;
     }
 
-    // allocate lock dynamically to prevent memory issues
-    file_lock_t *new_fl = calloc(1, sizeof(file_lock_t));
-    new_fl->uri = strdup(uri);
-    new_fl->lock = rwlock_new(READERS, 0); // uses dynamic allocation
-
-    new_fl->next = file_lock_table;
-    file_lock_table = new_fl;
+    // the h2c thread gets its own descriptor, the worker closes this one
+    int fd = dup(connfd);
+    if (fd < 0) {
+        return false;
+    }
+    h2_upgrade_t up = { settings, head };
+    return h2_start(fd, accept_stream, idle_timeout_ms, body_timeout_ms, &up);
+}
 
-    pthread_mutex_unlock(&file_lock_table_mutex);
-    return new_fl->lock;
+// handle unsupported requests
+void handle_unsupported(conn_t *conn) {
+    const char *request_id = conn_get_header(conn, "Request-Id");
+    log_request("UNSUPPORTED", conn_get_uri(conn), 501, request_id);
+    conn_send_response(conn, &RESPONSE_NOT_IMPLEMENTED);
 }
 
-//  handle http connections
-void handle_connection(int connfd) {
+//  handle one http request, returns whether the connection can be reused
+bool handle_connection(int connfd) {
+    uint64_t start = now_ns();
+    metric_method_t method = METRIC_OTHER;
+    bool keep_alive = false;
+
+    // in event mode the head is already buffered, otherwise a slow client
+    // could hold the worker while it arrives
+    deadline_t dl;
+    if (!event_loop) {
+        deadlines_arm(deadlines, &dl, connfd, DEADLINE_HEADER, header_timeout_ms);
+    }
+    // an h2c connection starting with the preface goes to a thread of its
+    // own, which passes each of its streams back as a connection
+    int preface = h2c ? h2_peek_preface(connfd) : 0;
+    if (preface != 0) {
+        if (!event_loop) {
+            deadlines_cancel(deadlines, &dl);
+        }
+        int fd = preface > 0 ? dup(connfd) : -1;
+        if (fd >= 0) {
+            h2_start(fd, accept_stream, idle_timeout_ms, body_timeout_ms, NULL);
+        }
+        return false;
+    }
+    // a PUT with a chunked body is handled here, the helper library only
+    // understands bodies framed by Content-Length. any other request is left
+    // on the socket for conn_parse
+    chunked_request_t chunked;
+    int peeked = chunked_peek_request(connfd, &chunked);
+    if (peeked != 0) {
+        if (!event_loop) {
+            deadlines_cancel(deadlines, &dl);
+        }
+        if (peeked < 0) {
+            return false; // closed or timed out before sending a request
+        }
+        keep_alive = handle_chunked_put(connfd, &chunked);
+        metrics_request(METRIC_PUT, now_ns() - start);
+        return keep_alive;
+    }
+
     conn_t *conn = conn_new(connfd);
     const Response_t *res = conn_parse(conn);
+    if (!event_loop) {
+        deadlines_cancel(deadlines, &dl);
+    }
     if (res) {
         conn_send_response(conn, res);
     } else {
         const Request_t *req = conn_get_request(conn);
-        if (req == &REQUEST_GET) {
-            handle_get(conn);
+        if (req == &REQUEST_GET && h2c && upgrade_h2c(conn, connfd)) {
+            // counted when it is served as stream 1
+            keep_alive = false;
+        } else if (req == &REQUEST_GET) {
+            method = METRIC_GET;
+            keep_alive = handle_get(conn, connfd);
         } else if (req == &REQUEST_PUT) {
-            handle_put(conn);
+            method = METRIC_PUT;
+            keep_alive = handle_put(conn, connfd);
         } else {
+            // the body of an unsupported request was never read
             handle_unsupported(conn);
         }
+
+        // honor the client asking to close after this request
+        const char *connection = conn_get_header(conn, "Connection");
+        if (connection && strcasecmp(connection, "close") == 0) {
+            keep_alive = false;
+        }
     }
     conn_delete(&conn);
+    metrics_request(method, now_ns() - start);
+    return keep_alive;
+}
+
+// waits for the next request on a kept-alive connection
+static bool wait_for_request(int connfd, int timeout_ms) {
+    struct pollfd pfd = { .fd = connfd, .events = POLLIN };
+    int n;
+    do {
+        n = poll(&pfd, 1, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0) {
+        metrics_timeout(METRIC_IDLE_TIMEOUT);
+    }
+    return n > 0 && (pfd.revents & POLLIN);
+}
+
+// whether the helper library leaves a pipelined request on the socket. every
+// request gets a fresh conn_t, since the h2c preface, chunked PUTs and the
+// scheduler are recognized by peeking the socket, so keep-alive relies on
+// conn_parse reading no further than the head and conn_recv_file no further
+// than Content-Length. checked once at startup with a PUT followed by a GET
+// on a socketpair, whose write side is shut so that no read can block
+static bool helper_keeps_pipelined(void) {
+    static const char put[] = "PUT /probe HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello";
+    static const char next[] = "GET /probe HTTP/1.1\r\n\r\n";
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+        return false;
+    }
+    bool kept = false;
+    int sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (sink >= 0 && write(sv[1], put, sizeof(put) - 1) == sizeof(put) - 1
+        && write(sv[1], next, sizeof(next) - 1) == sizeof(next) - 1
+        && shutdown(sv[1], SHUT_WR) == 0) {
+        conn_t *conn = conn_new(sv[0]);
+        if (conn && !conn_parse(conn) && !conn_recv_file(conn, sink)) {
+            char rest[sizeof(next)];
+            ssize_t n = recv(sv[0], rest, sizeof(rest), MSG_DONTWAIT);
+            kept = n == sizeof(next) - 1 && memcmp(rest, next, n) == 0;
+        }
+        conn_delete(&conn);
+    }
+    if (sink >= 0) {
+        close(sink);
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return kept;
+}
+
+// answers requests on one connection in order until the client closes it, it
+// goes idle or it reaches the per-connection request limit. pipelined requests
+// are already buffered, so the next one is parsed without waiting
+void serve_connection(int connfd) {
+    int served = 0;
+    while (handle_connection(connfd) && ++served < max_requests
+           && wait_for_request(connfd, idle_timeout_ms)) {
+    }
+}
+
+// sends len bytes starting at off, from memory when the file is cached and
+// with sendfile from the open file otherwise
+static bool send_part(int connfd, int fd, const char *data, off_t off, size_t len) {
+    if (data) {
+        struct iovec iov = { (char *) data + off, len };
+        return io_writev_full(connfd, &iov, 1);
+    }
+    while (len > 0) {
+        ssize_t n = sendfile(connfd, fd, &off, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+// sends a 200 response with the extra header lines in headers. a body in
+// memory goes out with the head in a single writev, a file with sendfile
+static bool send_body(int connfd, int fd, const char *data, size_t len, const char *headers) {
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s\r\n", len, headers);
+    if (data) {
+        struct iovec iov[2] = { { header, header_len }, { (char *) data, len } };
+        return io_writev_full(connfd, iov, 2);
+    }
+    return io_writev_full(connfd, &(struct iovec) { header, header_len }, 1)
+           && send_part(connfd, fd, NULL, 0, len);
+}
+
+// takes a per-URI lock and records the wait, returns when it was acquired
+static uint64_t lock_timed(rwlock_t *lock, metric_lock_t kind) {
+    uint64_t start = now_ns();
+    if (kind == METRIC_READER) {
+        reader_lock(lock);
+    } else {
+        writer_lock(lock);
+    }
+    uint64_t acquired = now_ns();
+    metrics_lock_wait(kind, acquired - start);
+    return acquired;
+}
+
+// releases a lock taken with lock_timed and records how long it was held
+static void unlock_timed(rwlock_t *lock, metric_lock_t kind, uint64_t acquired) {
+    metrics_lock_hold(kind, now_ns() - acquired);
+    if (kind == METRIC_READER) {
+        reader_unlock(lock);
+    } else {
+        writer_unlock(lock);
+    }
+}
+
+// passes a piece of the metrics page on to the chunked response
+static bool write_metrics(void *arg, const char *data, size_t len) {
+    return chunked_write(arg, data, len);
+}
+
+// answers the reserved metrics URI from memory, the filesystem is not touched.
+// returns whether the connection can be reused
+static bool handle_metrics(conn_t *conn, int connfd, const char *uri) {
+    // the page is generated while it is sent, so its length is not known up front
+    chunked_writer_t *w = malloc(sizeof(chunked_writer_t));
+    if (w) {
+        chunked_writer_init(w, connfd, "HTTP/1.1 200 OK\r\n");
+    }
+    bool written = w && metrics_write(write_metrics, w);
+    if (!written && (!w || !w->started)) {
+        log_request("GET", uri, 500, conn_get_header(conn, "Request-Id"));
+        conn_send_response(conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+        free(w);
+        return true;
+    }
+    // once the head is out a failure can only be signalled by closing before
+    // the last chunk, so the client sees a truncated body instead of a whole one
+    written = written && chunked_end(w);
+    metrics_bytes_sent(w->sent);
+    free(w);
+    log_request("GET", uri, written ? 200 : 500, conn_get_header(conn, "Request-Id"));
+    return written;
+}
+
+// one satisfiable byte range, both ends inclusive
+typedef struct byte_range {
+    off_t first, last;
+} byte_range_t;
+
+// parses a decimal number, returns the position after it or NULL if there is none
+static const char *parse_offset(const char *s, off_t *value) {
+    if (*s < '0' || *s > '9') {
+        return NULL;
+    }
+    errno = 0;
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    if (errno == ERANGE) {
+        return NULL;
+    }
+    *value = v;
+    return end;
+}
+
+// parses a Range header for a file of size bytes into ranges. returns how many
+// ranges can be satisfied, 0 if none can, and -1 if the header is malformed,
+// not in bytes or lists more than MAX_RANGES ranges, in which case the header
+// is ignored and the whole file is sent
+static int parse_ranges(const char *header, off_t size, byte_range_t *ranges) {
+    if (strncasecmp(header, "bytes=", 6) != 0) {
+        return -1;
+    }
+
+    int specs = 0, count = 0;
+    const char *p = header + 6;
+    while (1) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (++specs > MAX_RANGES) {
+            return -1;
+        }
+
+        off_t first, last;
+        if (*p == '-') {
+            // suffix range, the last n bytes
+            off_t n;
+            if (!(p = parse_offset(p + 1, &n))) {
+                return -1;
+            }
+            first = n < size ? size - n : 0;
+            last = n > 0 ? size - 1 : -1;
+        } else {
+            if (!(p = parse_offset(p, &first)) || *p++ != '-') {
+                return -1;
+            }
+            last = size - 1;
+            if (*p >= '0' && *p <= '9') {
+                off_t end;
+                p = parse_offset(p, &end);
+                if (!p || end < first) {
+                    return -1;
+                }
+                if (end < last) {
+                    last = end;
+                }
+            }
+        }
+        if (first < size && first <= last) {
+            ranges[count].first = first;
+            ranges[count].last = last;
+            count++;
+        }
+
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0') {
+            return count;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+}
+
+// writes the head of one multipart/byteranges part into buf
+static int part_header(char *buf, size_t size, const byte_range_t *r, off_t file_size) {
+    return snprintf(buf, size,
+        "\r\n--" RANGE_BOUNDARY "\r\nContent-Type: application/octet-stream\r\n"
+        "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        (long long) r->first, (long long) r->last, (long long) file_size);
 }
 
-void handle_get(conn_t *conn) {
+// answers a Range request with 206 and the extra header lines in headers. a
+// single range is sent as is, several are sent as multipart/byteranges.
+// returns the body bytes sent
+static size_t send_ranges(int connfd, int fd, const char *data, off_t size,
+    const byte_range_t *ranges, int count, const char *headers) {
+    char header[384];
+    int header_len;
+    size_t body = 0;
+    if (count == 1) {
+        body = ranges[0].last - ranges[0].first + 1;
+        header_len = snprintf(header, sizeof(header),
+            "HTTP/1.1 206 Partial Content\r\nContent-Length: %zu\r\n"
+            "Content-Range: bytes %lld-%lld/%lld\r\n%s\r\n",
+            body, (long long) ranges[0].first, (long long) ranges[0].last, (long long) size,
+            headers);
+        if (!io_writev_full(connfd, &(struct iovec) { header, header_len }, 1)) {
+            return 0;
+        }
+        return send_part(connfd, fd, data, ranges[0].first, body) ? body : 0;
+    }
+
+    // the length of every part head is known up front, so is the whole body
+    static const char tail[] = "\r\n--" RANGE_BOUNDARY "--\r\n";
+    char part[256];
+    size_t length = sizeof(tail) - 1;
+    for (int i = 0; i < count; i++) {
+        length += part_header(part, sizeof(part), &ranges[i], size);
+        length += ranges[i].last - ranges[i].first + 1;
+    }
+    header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 206 Partial Content\r\nContent-Length: %zu\r\n"
+        "Content-Type: multipart/byteranges; boundary=" RANGE_BOUNDARY "\r\n%s\r\n",
+        length, headers);
+    if (!io_writev_full(connfd, &(struct iovec) { header, header_len }, 1)) {
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        size_t len = ranges[i].last - ranges[i].first + 1;
+        struct iovec iov = { part, part_header(part, sizeof(part), &ranges[i], size) };
+        if (!io_writev_full(connfd, &iov, 1) || !send_part(connfd, fd, data, ranges[i].first, len)) {
+            return body;
+        }
+        body += len;
+    }
+    io_writev_full(connfd, &(struct iovec) { (char *) tail, sizeof(tail) - 1 }, 1);
+    return body;
+}
+
+// answers a Range request none of whose ranges lies inside the file
+static void send_unsatisfiable(int connfd, off_t size) {
+    char header[160];
+    int header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 22\r\n"
+        "Content-Range: bytes */%lld\r\n\r\nRange Not Satisfiable\n",
+        (long long) size);
+    io_writev_full(connfd, &(struct iovec) { header, header_len }, 1);
+}
+
+// validators of the contents a GET is about to serve
+typedef struct validators {
+    char etag[64]; // quoted entity tag
+    time_t mtime; // Last-Modified, in whole seconds
+    char headers[160]; // ETag and Last-Modified header lines for the response
+} validators_t;
+
+// derives the validators from the file's inode, mtime and size. every PUT
+// renames a new inode into place, so a rewrite changes the tag even within
+// the file system's timestamp granularity. with -D a duplicate PUT links the
+// URI to an older blob whose mtime would move Last-Modified backwards, so
+// there it is the ctime, which the link and rename bump
+static void make_validators(
+    validators_t *v, ino_t ino, struct timespec mtime, struct timespec ctime, off_t size) {
+    snprintf(v->etag, sizeof(v->etag), "\"%lx-%llx-%llx\"", (unsigned long) ino,
+        (unsigned long long) mtime.tv_sec * 1000000000 + mtime.tv_nsec, (unsigned long long) size);
+    v->mtime = blob_store ? ctime.tv_sec : mtime.tv_sec;
+
+    char date[64];
+    struct tm tm;
+    gmtime_r(&v->mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    snprintf(v->headers, sizeof(v->headers), "ETag: %s\r\nLast-Modified: %s\r\n", v->etag, date);
+}
+
+// parses an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT"
+static bool parse_http_date(const char *s, time_t *t) {
+    struct tm tm = { 0 };
+    const char *end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end != '\0') {
+        return false;
+    }
+    *t = timegm(&tm);
+    return true;
+}
+
+// checks an If-None-Match list for etag, with the weak comparison RFC 9110
+// asks for. "*" matches any existing file
+static bool etag_listed(const char *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (*p == '*') {
+            return true;
+        }
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+        size_t len = strcspn(p, ",");
+        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+            len--;
+        }
+        if (len == etag_len && strncmp(p, etag, len) == 0) {
+            return true;
+        }
+        p += strcspn(p, ",");
+    }
+    return false;
+}
+
+// returns whether a conditional GET can be answered with 304. If-Modified-Since
+// is only looked at when there is no If-None-Match
+static bool not_modified(conn_t *conn, const validators_t *v) {
+    const char *inm = conn_get_header(conn, "If-None-Match");
+    if (inm) {
+        return etag_listed(inm, v->etag);
+    }
+    const char *ims = conn_get_header(conn, "If-Modified-Since");
+    time_t since;
+    return ims && parse_http_date(ims, &since) && v->mtime <= since;
+}
+
+// returns whether the Range header applies: an If-Range must name the
+// current contents, by strong entity tag or exact Last-Modified date
+static bool if_range_matches(conn_t *conn, const validators_t *v) {
+    const char *if_range = conn_get_header(conn, "If-Range");
+    time_t date;
+    if (!if_range) {
+        return true;
+    }
+    if (if_range[0] == '"') {
+        return strcmp(if_range, v->etag) == 0;
+    }
+    return parse_http_date(if_range, &date) && date == v->mtime;
+}
+
+// answers a conditional GET whose validators still match, without a body
+static void send_not_modified(int connfd, const validators_t *v) {
+    char header[256];
+    int header_len
+        = snprintf(header, sizeof(header), "HTTP/1.1 304 Not Modified\r\n%s\r\n", v->headers);
+    io_writev_full(connfd, &(struct iovec) { header, header_len }, 1);
+}
+
+// reads a whole file into memory and caches it, called under the reader lock
+// so the copy matches the file until the next writer invalidates it
+static cached_object_t *cache_fill(
+    const char *uri, uint64_t hash, int fd, const struct stat *st) {
+    size_t size = st->st_size;
+    char *data = malloc(size ? size : 1);
+    if (!data) {
+        return NULL;
+    }
+
+    if (!io_pread_full(fd, data, size, 0)) {
+        free(data);
+        return NULL;
+    }
+    return object_cache_put(object_cache, uri, hash, data, size, st);
+}
+
+// the response a GET gets, decided from the contents' metadata and the
+// request headers before anything is sent
+typedef struct get_plan {
+    int status; // 200, 206, 304 or 416
+    validators_t v;
+    byte_range_t ranges[MAX_RANGES];
+    int count; // ranges sent with 206
+} get_plan_t;
+
+static void plan_get(conn_t *conn, get_plan_t *plan, ino_t ino, struct timespec mtime,
+    struct timespec ctime, off_t size) {
+    make_validators(&plan->v, ino, mtime, ctime, size);
+
+    // a Range request gets only the parts it asks for
+    const char *range = conn_get_header(conn, "Range");
+    plan->count = -1;
+    if (range && if_range_matches(conn, &plan->v)) {
+        plan->count = parse_ranges(range, size, plan->ranges);
+    }
+
+    if (not_modified(conn, &plan->v)) {
+        plan->status = 304;
+    } else if (plan->count > 0) {
+        plan->status = 206;
+    } else if (plan->count == 0) {
+        plan->status = 416;
+    } else {
+        plan->status = 200;
+    }
+}
+
+// sends the planned response for contents of size bytes, from data when they
+// are in memory and from fd otherwise
+static void send_get(int connfd, int fd, const char *data, off_t size, const get_plan_t *plan) {
+    if (plan->status == 304) {
+        // the client's copy is current, the file is not read
+        send_not_modified(connfd, &plan->v);
+    } else if (plan->status == 206) {
+        metrics_bytes_sent(
+            send_ranges(connfd, fd, data, size, plan->ranges, plan->count, plan->v.headers));
+    } else if (plan->status == 416) {
+        send_unsatisfiable(connfd, size);
+    } else {
+        send_body(connfd, fd, data, size, plan->v.headers);
+        metrics_bytes_sent(size);
+    }
+}
+
+// returns whether a cached copy was read from the given version
+static bool cached_from(const cached_object_t *obj, const struct stat *st) {
+    return obj->ino == st->st_ino && obj->mtime.tv_sec == st->st_mtim.tv_sec
+           && obj->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// caches a version's contents, unless a PUT has published a newer one while
+// they were being read
+static cached_object_t *cache_fill_version(
+    const char *uri, uint64_t hash, file_lock_t *fl, file_version_t *v) {
+    size_t size = v->st.st_size;
+    char *data = malloc(size ? size : 1);
+    if (!data) {
+        return NULL;
+    }
+    if (!io_pread_full(v->fd, data, size, 0)) {
+        free(data);
+        return NULL;
+    }
+
+    cached_object_t *obj = NULL;
+    pthread_mutex_lock(&fl->publish_lock);
+    if (fl->version == v) {
+        obj = object_cache_put(object_cache, uri, hash, data, size, &v->st);
+    } else {
+        free(data);
+    }
+    pthread_mutex_unlock(&fl->publish_lock);
+    return obj;
+}
+
+// GET in versioning mode. publish_lock is only held to pick up the current
+// version and log, which orders the read against PUTs. the body is then sent
+// from that version with nothing held, so a PUT never waits for the transfer
+// and the reader keeps its version even if a newer one is published meanwhile
+static void handle_get_version(
+    conn_t *conn, int connfd, const char *uri, uint64_t hash, file_lock_t *fl) {
+    get_plan_t plan;
+
+    pthread_mutex_lock(&fl->publish_lock);
+    if (!fl->version) {
+        // nothing published since the entry was created, load the file as it is
+        fl->version = file_version_open(uri);
+    }
+    file_version_t *v = fl->version;
+    if (v) {
+        file_version_ref(v);
+        plan_get(conn, &plan, v->st.st_ino, v->st.st_mtim, v->st.st_ctim, v->st.st_size);
+    }
+    log_request("GET", uri, v ? plan.status : 404, conn_get_header(conn, "Request-Id"));
+    pthread_mutex_unlock(&fl->publish_lock);
+
+    if (!v) {
+        conn_send_response(conn, &RESPONSE_NOT_FOUND);
+        return;
+    }
+
+    // a cached copy of another version is ignored
+    cached_object_t *obj = object_cache ? object_cache_get(object_cache, uri, hash) : NULL;
+    if (obj && !cached_from(obj, &v->st)) {
+        object_cache_release(object_cache, obj);
+        obj = NULL;
+    }
+    if (!obj && plan.status != 304 && object_cache_admits(object_cache, v->st.st_size)) {
+        obj = cache_fill_version(uri, hash, fl, v);
+    }
+
+    send_get(connfd, v->fd, obj ? obj->data : NULL, v->st.st_size, &plan);
+    if (obj) {
+        object_cache_release(object_cache, obj);
+    }
+    file_version_release(&v);
+}
+
+// returns whether the connection can be reused
+bool handle_get(conn_t *conn, int connfd) {
     char *uri = conn_get_uri(conn);
-    rwlock_t *lock = get_file_lock(uri);
-
-    reader_lock(lock);
-
-    int fd = open(uri, O_RDONLY);
-    if (fd >= 0) {
-        struct stat file_stat;
-        if (fstat(fd, &file_stat) == 0) {
-            conn_send_file(conn, fd, file_stat.st_size);
-            close(fd);
-            // log after sending response but before releasing the lock
-            log_request("GET", uri, 200, conn_get_header(conn, "Request-Id"));
-            reader_unlock(lock);
-            return;
+    if (strcmp(uri[0] == '/' ? uri + 1 : uri, METRICS_URI) == 0) {
+        return handle_metrics(conn, connfd, uri);
+    }
+
+    uint64_t hash = uri_hash(uri);
+    file_lock_t *fl = lock_table_acquire(lock_table, uri, hash);
+    if (!fl) {
+        log_request("GET", uri, 500, conn_get_header(conn, "Request-Id"));
+        conn_send_response(conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+        return true;
+    }
+    if (versioning) {
+        handle_get_version(conn, connfd, uri, hash, fl);
+        lock_table_release(lock_table, fl);
+        return true;
+    }
+    rwlock_t *lock = fl->lock;
+
+    uint64_t locked_at = lock_timed(lock, METRIC_READER);
+
+    // hot files are served straight from memory
+    cached_object_t *obj = object_cache ? object_cache_get(object_cache, uri, hash) : NULL;
+
+    // otherwise from a descriptor, kept open across requests with -o
+    file_version_t *v = NULL;
+    if (!obj) {
+        v = fd_cache ? fd_cache_open(fd_cache, uri, hash) : file_version_open(uri);
+    }
+    if (obj || v) {
+        if (!obj && object_cache_admits(object_cache, v->st.st_size)) {
+            obj = cache_fill(uri, hash, v->fd, &v->st);
         }
-        close(fd);
+        off_t size = obj ? (off_t) obj->len : v->st.st_size;
+        get_plan_t plan;
+        plan_get(conn, &plan, obj ? obj->ino : v->st.st_ino, obj ? obj->mtime : v->st.st_mtim,
+            obj ? obj->ctime : v->st.st_ctim, size);
+        send_get(connfd, v ? v->fd : -1, obj ? obj->data : NULL, size, &plan);
+        if (obj) {
+            object_cache_release(object_cache, obj);
+        }
+        file_version_release(&v);
+        // log after sending response but before releasing the lock
+        log_request("GET", uri, plan.status, conn_get_header(conn, "Request-Id"));
+        unlock_timed(lock, METRIC_READER, locked_at);
+        lock_table_release(lock_table, fl);
+        return true;
     }
 
     log_request("GET", uri, 404, conn_get_header(conn, "Request-Id"));
     conn_send_response(conn, &RESPONSE_NOT_FOUND);
-    reader_unlock(lock);
+    unlock_timed(lock, METRIC_READER, locked_at);
+    lock_table_release(lock_table, fl);
+    return true;
 }
 
-void *worker_thread(__attribute__((unused)) void *arg) {
+// a connection waiting for a worker
+typedef struct job {
+    int connfd; // -1 asks the worker that takes it to exit
+    uint64_t enqueued_ns; // when it was queued, for the queue wait time
+    sched_request_t req; // how the scheduler queued it (-R)
+} job_t;
+
+// round robin position of the calling thread, each dispatching thread keeps
+// its own so that picking a worker needs no shared state
+static __thread unsigned next_worker = 0;
+
+// answers a connection with 503 without reading its request, so an
+// overloaded server fails fast instead of queueing without bound
+static void shed_connection(int connfd, metric_shed_t reason) {
+    static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 20\r\n"
+                                   "Retry-After: 1\r\nConnection: close\r\n\r\n"
+                                   "Service Unavailable\n";
+    io_writev_full(connfd, &(struct iovec) { (char *) response, sizeof(response) - 1 }, 1);
+    metrics_shed(reason);
+    if (event_loop) {
+        event_loop_done(event_loop, connfd, false);
+    } else {
+        close(connfd);
+    }
+}
+
+// picks the deque for a connection. with -p it is that of a worker pinned to
+// the CPU whose softirq received the connection's packets, so the socket's
+// state is still in that CPU's cache when the worker reads it
+static int pick_worker(int connfd) {
+    if (affinity) {
+        int cpu;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(connfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+            int worker = affinity_worker_for(affinity, cpu, thread_count, next_worker++);
+            if (worker >= 0) {
+                return worker;
+            }
+        }
+    }
+    return next_worker++ % thread_count;
+}
+
+// hands a connection with a request waiting to the worker threads
+void dispatch_connection(int connfd) {
+    if (admission) {
+        // a full queue would block the acceptor, shed instead
+        int64_t depth = metrics_queue_depth();
+        if (depth >= queue_capacity) {
+            shed_connection(connfd, METRIC_SHED_FULL);
+            return;
+        }
+        if (!admission_admit(admission, depth)) {
+            shed_connection(connfd, METRIC_SHED_DELAY);
+            return;
+        }
+    }
+
+    job_t *job = malloc(sizeof(job_t));
+    if (!job) {
+        close(connfd);
+        return;
+    }
+    job->connfd = connfd;
+    job->enqueued_ns = now_ns();
+    if (scheduler) {
+        scheduler_classify(connfd, &job->req);
+    }
+
+    if (autoscaler) {
+        autoscaler_job_queued(autoscaler);
+    }
+    metrics_queue_push();
+    if (work_pool) {
+        work_pool_push(work_pool, pick_worker(connfd), job);
+    } else if (scheduler) {
+        // fails only when out of memory, like the allocation of the job
+        if (!scheduler_push(scheduler, job, &job->req)) {
+            metrics_queue_pop();
+            free(job);
+            close(connfd);
+        }
+    } else {
+        queue_push(request_queue, job);
+    }
+}
+
+// takes the next job for a worker, blocking until there is one
+static bool next_job(int worker, job_t **job) {
+    void *data = NULL;
+    bool popped;
+    if (autoscaler) {
+        autoscaler_worker_idle(autoscaler);
+    }
+    if (work_pool) {
+        popped = work_pool_pop(work_pool, worker, &data);
+    } else if (scheduler) {
+        popped = scheduler_pop(scheduler, &data);
+    } else {
+        popped = queue_pop(request_queue, &data);
+    }
+    if (autoscaler) {
+        autoscaler_worker_busy(autoscaler);
+    }
+    *job = data;
+    if (popped && data && (*job)->connfd >= 0) {
+        metrics_queue_pop();
+    }
+    return popped && data;
+}
+
+void *worker_thread(void *arg) {
+    int worker = (int) (intptr_t) arg;
+    if (affinity && work_pool) {
+        // pinned from the start, so this allocation lands on the worker's node
+        work_pool_localize(work_pool, worker);
+    }
     while (1) {
-        void *data;
-        if (queue_pop(request_queue, &data)) { // check return value properly
-            int connfd = (intptr_t) data;
-            if (connfd >= 0) {
-                handle_connection(connfd);
+        job_t *job;
+        if (next_job(worker, &job)) { // check return value properly
+            int connfd = job->connfd;
+            if (connfd < 0) {
+                // retired by the autoscaler
+                free(job);
+                autoscaler_worker_exited(autoscaler);
+                return NULL;
+            }
+            uint64_t now = now_ns();
+            if (autoscaler) {
+                autoscaler_job_started(autoscaler, now - job->enqueued_ns);
+            }
+            bool admitted = !admission || admission_dequeue(admission, now - job->enqueued_ns, now);
+            sched_request_t req = job->req;
+            free(job);
+            if (!admitted) {
+                shed_connection(connfd, METRIC_SHED_DELAY);
+            } else if (event_loop) {
+                // the event loop waits for the next request instead of this worker
+                event_loop_done(event_loop, connfd, handle_connection(connfd));
+            } else {
+                serve_connection(connfd);
                 close(connfd);
             }
+            if (scheduler) {
+                scheduler_done(scheduler, &req);
+            }
         }
     }
     return NULL;
 }
 
-void handle_put(conn_t *conn) {
-    char *uri = conn_get_uri(conn);
-    rwlock_t *lock = get_file_lock(uri);
+// starts a worker thread, pinned to the CPU of the given slot with -p
+static int start_worker(pthread_t *tid, int slot) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (affinity) {
+        affinity_set(affinity, &attr, slot);
+    }
+    int rc = pthread_create(tid, &attr, worker_thread, (void *) (intptr_t) slot);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+// called by the autoscaler. its workers share one queue, the slot only picks
+// the CPU, and only the autoscaler thread spawns so the counter needs no lock
+static int spawn_worker(void) {
+    static int spawned = 0;
+    pthread_t tid;
+    if (start_worker(&tid, spawned++) != 0) {
+        return -1;
+    }
+    return pthread_detach(tid);
+}
+
+// queues a stop job, the worker that takes it exits
+static void retire_worker(void) {
+    job_t *job = calloc(1, sizeof(job_t));
+    if (job) {
+        job->connfd = -1;
+        job->enqueued_ns = now_ns();
+        job->req.cls = CLASS_OTHER;
+        if (scheduler) {
+            if (!scheduler_push(scheduler, job, &job->req)) {
+                free(job);
+            }
+        } else {
+            queue_push(request_queue, job);
+        }
+    }
+}
+
+// creates the temporary file for a PUT body in the destination's directory,
+// so the finished file can be renamed into place. falls back to /tmp, in which
+// case the body has to be copied. returns the fd and sets *same_dir
+static int make_temp_file(const char *uri, char *path, size_t size, bool *same_dir) {
+    const char *slash = strrchr(uri, '/');
+    int dir_len = slash ? (int) (slash - uri + 1) : 0;
+
+    *same_dir = true;
+    if (snprintf(path, size, "%.*s.httpserver_XXXXXX", dir_len, uri) < (int) size) {
+        int fd = mkstemp(path);
+        if (fd >= 0) {
+            return fd;
+        }
+    }
+
+    *same_dir = false;
+    snprintf(path, size, "/tmp/httpserver_XXXXXX");
+    return mkstemp(path);
+}
+
+// copies count bytes between files inside the kernel, using read/write only
+// when neither copy_file_range nor sendfile can be used
+static bool copy_file(int src_fd, int dest_fd, off_t count) {
+    off_t copied = 0;
+    while (copied < count) {
+        ssize_t n = copy_file_range(src_fd, NULL, dest_fd, NULL, count - copied, 0);
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL)) {
+            n = sendfile(dest_fd, src_fd, NULL, count - copied);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        copied += n;
+    }
+
+    char buffer[4096];
+    ssize_t bytes_read;
+    while (copied < count && (bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
+        if (write(dest_fd, buffer, bytes_read) != bytes_read) {
+            return false;
+        }
+        copied += bytes_read;
+    }
+    return copied == count;
+}
+
+// renames a temp file over uri. returns 201 if uri was created, 200 if it was
+// replaced and 500 on failure
+static int rename_into_place(const char *uri, const char *temp_path) {
+    // RENAME_NOREPLACE tells a new file from a replaced one atomically
+    if (io_rename(temp_path, uri, RENAME_NOREPLACE) == 0) {
+        return 201;
+    }
+    if (errno == EEXIST) {
+        return io_rename(temp_path, uri, 0) == 0 ? 200 : 500;
+    }
+    if (errno == EINVAL || errno == ENOSYS) {
+        // the file system does not support RENAME_NOREPLACE
+        int is_new_file = (access(uri, F_OK) != 0);
+        if (io_rename(temp_path, uri, 0) == 0) {
+            return is_new_file ? 201 : 200;
+        }
+    }
+    return 500;
+}
+
+// whether uri already is a link to the blob about to be published. rename
+// does nothing when both names refer to the same file, so the temp link is
+// removed instead
+static bool linked_already(const blob_ref_t *old, int temp_fd) {
+    struct stat a, b;
+    return old->fd >= 0 && fstat(old->fd, &a) == 0 && fstat(temp_fd, &b) == 0
+           && a.st_ino == b.st_ino && a.st_dev == b.st_dev;
+}
+
+// publishes a received body as uri, called with the writer lock held.
+// a temp file in the same directory is renamed over uri, so the lock only
+// covers the metadata swap. returns 201 if uri was created, 200 if it was
+// replaced and 500 on failure. *renamed tells whether temp_path was moved
+// to uri, otherwise the caller still has to remove it
+static int commit_put(
+    const char *uri, const char *temp_path, int temp_fd, bool same_dir, bool *renamed) {
+    *renamed = false;
+    if (same_dir) {
+        int status = rename_into_place(uri, temp_path);
+        if (status != 500) {
+            *renamed = true;
+            return status;
+        }
+    }
+
+    // the body is not next to the destination, copy it in place. in
+    // durability mode the copy would have to be synced under the writer
+    // lock, stalling every reader of uri for a whole batch, so it is refused
+    struct stat temp_stat;
+    if (group_commit) {
+        return 500;
+    }
+    if (fstat(temp_fd, &temp_stat) != 0 || lseek(temp_fd, 0, SEEK_SET) != 0) {
+        return 500;
+    }
+
+    int is_new_file = (access(uri, F_OK) != 0);
+    if (blob_store) {
+        // uri may be a link to a stored blob, which must not be overwritten
+        unlink(uri);
+    }
+    int dest_fd = open(uri, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest_fd < 0) {
+        return 500;
+    }
+    bool copied = copy_file(temp_fd, dest_fd, temp_stat.st_size);
+    close(dest_fd);
+    if (!copied) {
+        return 500;
+    }
+    return is_new_file ? 201 : 200;
+}
+
+// removes the temp file of a body that was not published, and in dedup mode
+// the blob filed for it unless a URI links to it, then closes temp_fd
+static void discard_temp(const char *temp_path, int temp_fd) {
+    unlink(temp_path);
+    if (blob_store) {
+        blob_store_forget(blob_store, temp_fd);
+    }
+    close(temp_fd);
+}
+
+// PUT in versioning mode. the temp file becomes the new version: under
+// publish_lock it is renamed over uri and swapped in, which is where the
+// write takes effect and is logged. readers still sending older versions hold
+// their own descriptors and are not waited for. a body that could not be
+// staged next to uri would have to be copied into the inode those readers
+// are sending, so it is refused. takes ownership of temp_fd and removes
+// temp_path if it was not published
+static int publish_version(const char *uri, uint64_t hash, file_lock_t *fl, const char *temp_path,
+    int temp_fd, bool same_dir, const char *request_id) {
+    struct stat st;
+    file_version_t *v = NULL;
+    if (same_dir && fstat(temp_fd, &st) == 0) {
+        v = file_version_new(temp_fd, &st);
+    }
+    if (!v) {
+        discard_temp(temp_path, temp_fd);
+    }
+
+    int status = 500;
+    blob_ref_t old = { -1 };
+    pthread_mutex_lock(&fl->publish_lock);
+    if (v) {
+        if (blob_store) {
+            blob_store_hold(blob_store, uri, &old);
+        }
+        if (linked_already(&old, v->fd)) {
+            status = unlink(temp_path) == 0 ? 200 : 500;
+        } else {
+            status = rename_into_place(uri, temp_path);
+        }
+    }
+    if (status != 500) {
+        file_version_release(&fl->version);
+        fl->version = v;
+        v = NULL;
+        if (object_cache) {
+            object_cache_invalidate(object_cache, uri, hash);
+        }
+    }
+    if (blob_store) {
+        blob_store_release(blob_store, &old);
+    }
+    log_request("PUT", uri, status, request_id);
+    pthread_mutex_unlock(&fl->publish_lock);
+
+    if (v) {
+        unlink(temp_path);
+        if (blob_store) {
+            blob_store_forget(blob_store, v->fd);
+        }
+        file_version_release(&v);
+    }
+    return status;
+}
+
+// waits until the directory entry of uri is on disk, so a rename or create is durable
+static bool commit_dir_entry(const char *uri) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(uri, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int) (slash - uri), uri);
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    return group_commit_dir(group_commit, dir);
+}
+
+// where the body of a PUT comes from: read by the helper library when it is
+// framed by Content-Length, or decoded here from the socket when it is chunked
+typedef struct put_source {
+    conn_t *conn; // NULL for a chunked body
+    int connfd;
+    const char *uri;
+    const char *request_id;
+    const char *content_range; // set when the body is one part of an upload
+} put_source_t;
+
+// answers a PUT with the status commit_put or publish_version returned. a
+// chunked request never went through conn_parse, so its answer is written
+// directly in the same form the helper library uses, as are the 202 and 413
+// for a part of an upload, which the helper library has no response for
+static void send_put_response(const put_source_t *src, int status) {
+    if (src->conn && status != 202 && status != 413) {
+        if (status == 201) {
+            conn_send_response(src->conn, &RESPONSE_CREATED);
+        } else if (status == 200) {
+            conn_send_response(src->conn, &RESPONSE_OK);
+        } else if (status == 400) {
+            conn_send_response(src->conn, &RESPONSE_BAD_REQUEST);
+        } else if (status == 403) {
+            conn_send_response(src->conn, &RESPONSE_FORBIDDEN);
+        } else {
+            conn_send_response(src->conn, &RESPONSE_INTERNAL_SERVER_ERROR);
+        }
+        return;
+    }
+
+    char response[96];
+    int len;
+    if (status == 201) {
+        len = snprintf(response, sizeof(response),
+            "HTTP/1.1 201 Created\r\nContent-Length: 8\r\n\r\nCreated\n");
+    } else if (status == 200) {
+        len = snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nOK\n");
+    } else if (status == 202) {
+        len = snprintf(response, sizeof(response),
+            "HTTP/1.1 202 Accepted\r\nContent-Length: 9\r\n\r\nAccepted\n");
+    } else if (status == 400) {
+        len = snprintf(response, sizeof(response),
+            "HTTP/1.1 400 Bad Request\r\nContent-Length: 12\r\n\r\nBad Request\n");
+    } else if (status == 403) {
+        len = snprintf(response, sizeof(response),
+            "HTTP/1.1 403 Forbidden\r\nContent-Length: 10\r\n\r\nForbidden\n");
+    } else if (status == 413) {
+        len = snprintf(response, sizeof(response),
+            "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 18\r\n\r\nPayload Too Large\n");
+    } else {
+        len = snprintf(response, sizeof(response), "HTTP/1.1 500 Internal Server Error\r\n"
+                                                    "Content-Length: 22\r\n\r\nInternal Server Error\n");
+    }
+    io_writev_full(src->connfd, &(struct iovec) { response, len }, 1);
+}
+
+// receives the body of a PUT into fd at its current offset. a chunked body
+// longer than max bytes fails, one framed by Content-Length is as long as the
+// header says
+static bool recv_put_body(const put_source_t *src, int fd, int64_t max) {
+    if (src->conn) {
+        // conn_recv_file returns 0 on success
+        return conn_recv_file(src->conn, fd) == 0;
+    }
+    return chunked_recv(src->connfd, fd, max) >= 0;
+}
+
+// publishes a received body, staged at template, as src->uri and answers the
+// PUT. takes ownership of temp_fd. the status is logged under the lock, so the
+// log follows the lock order, and that logged status is the authoritative
+// outcome: it is what readers see from then on. in durability mode a write
+// whose directory sync fails after it became visible is therefore not
+// answered with another status, its connection is closed without an answer.
+// returns false in that case, as the connection cannot be reused
+static bool publish_put(const put_source_t *src, const char *template, int temp_fd, bool same_dir) {
+    const char *uri = src->uri;
+    uint64_t hash = uri_hash(uri);
+
+    // in dedup mode a body the store already holds is dropped for a link to
+    // the stored blob before it is synced or written back. a body that cannot
+    // be filed, e.g. on another file system than the store, is kept as it is
+    if (blob_store && same_dir) {
+        blob_store_add(blob_store, template, &temp_fd);
+    }
+
+    // in durability mode the body is on disk before it can replace anything,
+    // the fsync joins a batch and happens without holding any lock. a body
+    // that could not be staged next to uri cannot be renamed into place and
+    // is refused, see commit_put
+    if (group_commit && (!same_dir || !group_commit_file(group_commit, temp_fd))) {
+        discard_temp(template, temp_fd);
+        send_put_response(src, 500);
+        log_request("PUT", uri, 500, src->request_id);
+        return true;
+    }
+
+    // now acquire the writer lock to update the actual file
+    file_lock_t *fl = lock_table_acquire(lock_table, uri, hash);
+    if (!fl) {
+        discard_temp(template, temp_fd);
+        send_put_response(src, 500);
+        log_request("PUT", uri, 500, src->request_id);
+        return true;
+    }
+    if (versioning) {
+        int status = publish_version(uri, hash, fl, template, temp_fd, same_dir,
+            src->request_id);
+        lock_table_release(lock_table, fl);
+        if (status != 500 && group_commit && !commit_dir_entry(uri)) {
+            return false;
+        }
+        send_put_response(src, status);
+        return true;
+    }
+    // with -R no reader of this URI is started while the writer waits, the
+    // readers already running drain and workers serve other URIs meanwhile
+    bool held = scheduler && scheduler_hold(scheduler, hash);
+    rwlock_t *lock = fl->lock;
+    uint64_t locked_at = lock_timed(lock, METRIC_WRITER);
+
+    blob_ref_t old = { -1 };
+    int status;
+    bool renamed = false;
+    if (blob_store) {
+        blob_store_hold(blob_store, uri, &old);
+    }
+    if (same_dir && linked_already(&old, temp_fd)) {
+        status = unlink(template) == 0 ? 200 : 500;
+        renamed = true; // the temp link is gone either way
+    } else {
+        status = commit_put(uri, template, temp_fd, same_dir, &renamed);
+    }
+    if (blob_store) {
+        // the replaced body's blob goes once no URI links to it
+        blob_store_release(blob_store, &old);
+    }
+
+    // readers that get the lock after this one must not see the old contents
+    if (status != 500 && object_cache) {
+        object_cache_invalidate(object_cache, uri, hash);
+    }
+    if (status != 500 && fd_cache) {
+        fd_cache_invalidate(fd_cache, uri, hash);
+    }
+
+    // cleans up, the temp file is already gone if it was renamed. one that
+    // was copied into place, or not published at all, is still there
+    if (renamed) {
+        close(temp_fd);
+    } else {
+        discard_temp(template, temp_fd);
+    }
+
+    log_request("PUT", uri, status, src->request_id);
+
+    unlock_timed(lock, METRIC_WRITER, locked_at);
+    if (held) {
+        scheduler_release(scheduler, hash);
+    }
+    lock_table_release(lock_table, fl);
+
+    // the write is ordered and logged, in durability mode it is only
+    // acknowledged once its directory entry is on disk. a sync that fails
+    // after the rename cannot undo it, so the client gets no answer rather
+    // than one that disagrees with the log
+    if (status != 500 && group_commit && !commit_dir_entry(uri)) {
+        return false;
+    }
+    send_put_response(src, status);
+    return true;
+}
+
+// parses the Content-Range of a part, "bytes first-last/total" with a known
+// total. returns false unless the range lies inside the total
+static bool parse_content_range(const char *value, off_t *first, off_t *last, off_t *total) {
+    if (strncasecmp(value, "bytes ", 6) != 0) {
+        return false;
+    }
+    const char *s = value + 6;
+    while (*s == ' ') {
+        s++;
+    }
+    if (!(s = parse_offset(s, first)) || *s++ != '-' || !(s = parse_offset(s, last))
+        || *s++ != '/' || !(s = parse_offset(s, total))) {
+        return false;
+    }
+    return *s == '\0' && *first <= *last && *last < *total;
+}
+
+// stores one part of an upload sent in byte ranges. every part is written at
+// its offset in the upload's staging file through a descriptor of its own, so
+// parts on different connections are received in parallel. the part that
+// completes the upload publishes it and is answered like a whole PUT, the
+// others get 202. returns whether the whole body was read
+static bool put_part(const put_source_t *src) {
+    const char *uri = src->uri;
+    off_t first, last, total;
+    bool framed = parse_content_range(src->content_range, &first, &last, &total);
+    if (framed && src->conn) {
+        // the helper library reads Content-Length bytes, which have to be the range
+        const char *length = conn_get_header(src->conn, "Content-Length");
+        framed = length && strtoll(length, NULL, 10) == last - first + 1;
+    }
+    staged_upload_t *u = framed ? staging_join(staging, uri, total) : NULL;
+    if (!u) {
+        // a malformed range, one whose total disagrees with the upload under
+        // way, or a total over the limit
+        int status = !framed || errno == EINVAL ? 400 : errno == EFBIG ? 413 : 500;
+        send_put_response(src, status);
+        log_request("PUT", uri, status, src->request_id);
+        return false;
+    }
+
+    int part_fd = open(u->path, O_WRONLY | O_CLOEXEC);
+    bool received = part_fd >= 0 && lseek(part_fd, first, SEEK_SET) == first;
+    if (received) {
+        deadline_t dl;
+        deadlines_arm(deadlines, &dl, src->connfd, DEADLINE_BODY, body_timeout_ms);
+        received = recv_put_body(src, part_fd, last - first + 1)
+                   && lseek(part_fd, 0, SEEK_CUR) == last + 1;
+        deadlines_cancel(deadlines, &dl);
+        metrics_bytes_received(received ? last - first + 1 : 0);
+    }
+    if (part_fd >= 0) {
+        close(part_fd);
+    }
+
+    if (!staging_leave(staging, u, first, last + 1, received)) {
+        int status = received ? 202 : 500;
+        send_put_response(src, status);
+        log_request("PUT", uri, status, src->request_id);
+        return received;
+    }
+
+    // the upload is complete, its staging file is published like a temp file
+    char template[PATH_MAX];
+    snprintf(template, sizeof(template), "%s", u->path);
+    int temp_fd = u->fd;
+    staged_upload_delete(&u);
+    if (fchmod(temp_fd, 0644) != 0) {
+        close(temp_fd);
+        unlink(template);
+        send_put_response(src, 500);
+        log_request("PUT", uri, 500, src->request_id);
+        return received;
+    }
+    return publish_put(src, template, temp_fd, true) && received;
+}
+
+// stores the body of a PUT at src->uri, returns whether the whole body was
+// read so that the connection is still in step with the client
+static bool put_file(const put_source_t *src) {
+    const char *uri = src->uri;
+
+    // the stored blobs are named by their contents, a client may not write them
+    if (blob_store && blob_store_contains(blob_store, uri)) {
+        send_put_response(src, 403);
+        log_request("PUT", uri, 403, src->request_id);
+        return false;
+    }
+    if (src->content_range) {
+        return put_part(src);
+    }
 
     // creates a temporary file for receiving data
-    char template[256];
-    snprintf(template, sizeof(template), "/tmp/httpserver_XXXXXX");
-    int temp_fd = mkstemp(template);
+    char template[PATH_MAX];
+    bool same_dir;
+    int temp_fd = make_temp_file(uri, template, sizeof(template), &same_dir);
 
     if (temp_fd < 0) {
         // failed to create temp file
-        conn_send_response(conn, &RESPONSE_INTERNAL_SERVER_ERROR);
-        log_request("PUT", uri, 500, conn_get_header(conn, "Request-Id"));
-        return;
+        send_put_response(src, 500);
+        log_request("PUT", uri, 500, src->request_id);
+        return false;
     }
 
     // receive file contents to temporary file (outside the lock)
-    // conn_recv_file returns 0 on success
-    int recv_success = (conn_recv_file(conn, temp_fd) == 0);
-    if (!recv_success) {
+    // a body that stops arriving for body_timeout_ms is cut off
+    deadline_t dl;
+    deadlines_arm(deadlines, &dl, src->connfd, DEADLINE_BODY, body_timeout_ms);
+    bool recv_success = recv_put_body(src, temp_fd, INT64_MAX);
+    deadlines_cancel(deadlines, &dl);
+    if (!recv_success || fchmod(temp_fd, 0644) != 0) {
         // failed to receive file
         close(temp_fd);
         unlink(template); // deletes the temp file
-        conn_send_response(conn, &RESPONSE_INTERNAL_SERVER_ERROR);
-        log_request("PUT", uri, 500, conn_get_header(conn, "Request-Id"));
-        return;
+        send_put_response(src, 500);
+        log_request("PUT", uri, 500, src->request_id);
+        return false;
+    }
+    struct stat temp_stat;
+    if (fstat(temp_fd, &temp_stat) == 0) {
+        metrics_bytes_received(temp_stat.st_size);
     }
+    return publish_put(src, template, temp_fd, same_dir);
+}
 
-    // now acquire the writer lock to update the actual file
-    writer_lock(lock);
+// returns whether the connection can be reused
+bool handle_put(conn_t *conn, int connfd) {
+    put_source_t src = { conn, connfd, conn_get_uri(conn), conn_get_header(conn, "Request-Id"),
+        conn_get_header(conn, "Content-Range") };
+    return put_file(&src);
+}
 
-    // check if the file already exists
-    int is_new_file = (access(uri, F_OK) != 0);
+// handles a PUT with a chunked body, its head was consumed by
+// chunked_peek_request. returns whether the connection can be reused
+bool handle_chunked_put(int connfd, const chunked_request_t *req) {
+    put_source_t src = { NULL, connfd, req->uri, req->request_id[0] ? req->request_id : NULL,
+        req->content_range[0] ? req->content_range : NULL };
+    if (req->bad_uri) {
+        // the body was never read, so the connection is not reused
+        send_put_response(&src, 400);
+        return false;
+    }
+    if (req->expect_continue) {
+        static const char proceed[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        io_writev_full(connfd, &(struct iovec) { (char *) proceed, sizeof(proceed) - 1 }, 1);
+    }
+    return put_file(&src) && !req->close;
+}
 
-    // open the destination file
-    int dest_fd = open(uri, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (dest_fd < 0) {
-        writer_unlock(lock);
-        close(temp_fd);
-        unlink(template);
-        conn_send_response(conn, &RESPONSE_INTERNAL_SERVER_ERROR);
-        log_request("PUT", uri, 500, conn_get_header(conn, "Request-Id"));
-        return;
+// passes a freshly accepted connection on. reads are bounded by the header,
+// body and idle deadlines rather than a socket timeout
+void accept_connection(int connfd) {
+    if (event_loop) {
+        if (!event_loop_add(event_loop, connfd)) {
+            close(connfd);
+        }
+    } else {
+        dispatch_connection(connfd);
     }
+}
 
-    // copies data from temp file to destination file
-    lseek(temp_fd, 0, SEEK_SET); // rewinds temp file to beginning
-    char buffer[4096];
-    ssize_t bytes_read;
+// passes on the socketpair of an h2c stream like an accepted connection. the
+// h2c thread must not block on a full request queue while workers wait to
+// write to it, so streams are only taken while the queue is less than half
+// full, which leaves room for accepted connections and racing h2c threads
+bool accept_stream(int fd) {
+    if (!event_loop && metrics_queue_depth() >= queue_capacity / 2) {
+        return false;
+    }
+    accept_connection(fd);
+    return true;
+}
 
-    while ((bytes_read = read(temp_fd, buffer, sizeof(buffer))) > 0) {
-        if (write(dest_fd, buffer, bytes_read) != bytes_read) {
-            // writes error
-            close(temp_fd);
-            close(dest_fd);
-            unlink(template);
-            writer_unlock(lock);
-            conn_send_response(conn, &RESPONSE_INTERNAL_SERVER_ERROR);
-            log_request("PUT", uri, 500, conn_get_header(conn, "Request-Id"));
-            return;
-        }
+// opens a listening socket that shares its port with the other acceptors,
+// the kernel spreads incoming connections across all of them
+static int reuseport_listener(size_t port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
     }
 
-    // cleans up
-    close(temp_fd);
-    close(dest_fd);
-    unlink(template); // deletes temp file
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
 
-    // sends responses
-    if (is_new_file) {
-        conn_send_response(conn, &RESPONSE_CREATED);
-        log_request("PUT", uri, 201, conn_get_header(conn, "Request-Id"));
-    } else {
-        conn_send_response(conn, &RESPONSE_OK);
-        log_request("PUT", uri, 200, conn_get_header(conn, "Request-Id"));
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    writer_unlock(lock);
+// accepts connections on one SO_REUSEPORT socket. acceptor i starts its
+// round robin at worker i, so the acceptors spread over different deques
+void *acceptor_thread(void *arg) {
+    int acceptor = (int) (intptr_t) arg;
+    int listenfd = listen_fds[acceptor];
+    next_worker = acceptor;
+    while (1) {
+        int connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (connfd >= 0) {
+            accept_connection(connfd);
+        } else if (errno == EMFILE || errno == ENFILE) {
+            usleep(1000); // out of descriptors, give workers time to close some
+        }
+    }
+    return NULL;
 }
 
 //main function
 int main(int argc, char **argv) {
     int opt;
-    while ((opt = getopt(argc, argv, "t:")) != -1) {
+    int event_mode = 0;
+    int async_log = 0;
+    size_t cache_bytes = 0;
+    size_t open_files = 0;
+    int pin_threads = 0;
+    int dedup = 0;
+    int fair_queueing = 0;
+    int acceptor_count = 0;
+    int min_threads = DEFAULT_MIN_THREADS;
+    int max_threads = 0;
+    int target_wait_ms = DEFAULT_TARGET_WAIT_MS;
+    int shed_target_ms = 0;
+    int shed_interval_ms = DEFAULT_SHED_INTERVAL_MS;
+    int commit_window_ms = -1;
+    int commit_batch = DEFAULT_COMMIT_BATCH;
+    while ((opt = getopt(argc, argv, "t:ek:i:ac:A:m:M:L:VH:B:S:I:F:G:o:pD2R")) != -1) {
         if (opt == 't') {
             thread_count = atoi(optarg);
+        } else if (opt == 'e') {
+            event_mode = 1;
+        } else if (opt == 'k') {
+            max_requests = atoi(optarg);
+        } else if (opt == 'i') {
+            idle_timeout_ms = atoi(optarg);
+        } else if (opt == 'a') {
+            async_log = 1;
+        } else if (opt == 'c') {
+            cache_bytes = strtoull(optarg, NULL, 10);
+        } else if (opt == 'A') {
+            acceptor_count = atoi(optarg);
+        } else if (opt == 'm') {
+            min_threads = atoi(optarg);
+        } else if (opt == 'M') {
+            max_threads = atoi(optarg);
+        } else if (opt == 'L') {
+            target_wait_ms = atoi(optarg);
+        } else if (opt == 'V') {
+            versioning = true;
+        } else if (opt == 'H') {
+            header_timeout_ms = atoi(optarg);
+        } else if (opt == 'B') {
+            body_timeout_ms = atoi(optarg);
+        } else if (opt == 'S') {
+            shed_target_ms = atoi(optarg);
+        } else if (opt == 'I') {
+            shed_interval_ms = atoi(optarg);
+        } else if (opt == 'F') {
+            commit_window_ms = atoi(optarg);
+        } else if (opt == 'G') {
+            commit_batch = atoi(optarg);
+        } else if (opt == 'o') {
+            open_files = strtoull(optarg, NULL, 10);
+        } else if (opt == 'p') {
+            pin_threads = 1;
+        } else if (opt == 'D') {
+            dedup = 1;
+        } else if (opt == '2') {
+            h2c = true;
+        } else if (opt == 'R') {
+            fair_queueing = 1;
         }
     }
     if (optind >= argc) {
-        fprintf(stderr, "Usage: %s [-t threads] <port>\n", argv[0]);
+        fprintf(stderr,
+            "Usage: %s [-t threads] [-e] [-k max_requests] [-i idle_ms] [-a]\n"
+            "          [-c cache_bytes] [-A acceptors] [-m min_threads -M max_threads\n"
+            "          -L target_wait_ms] [-V] [-H header_ms] [-B body_ms]\n"
+            "          [-S shed_target_ms [-I shed_interval_ms]]\n"
+            "          [-F commit_window_ms [-G commit_batch]] [-o open_files] [-p] [-D] [-2]\n"
+            "          [-R] <port>\n",
+            argv[0]);
         return EXIT_FAILURE;
     }
 
+    // per-worker deques are tied to a fixed set of workers
+    if (max_threads > 0 && acceptor_count > 0) {
+        errx(EXIT_FAILURE, "Autoscaling (-M) cannot be combined with -A");
+    }
+    // a smaller cache could not hold the files it is meant for
+    if (cache_bytes > 0 && cache_bytes < CACHE_MAX_OBJECT) {
+        errx(EXIT_FAILURE, "The object cache (-c) needs at least %d bytes", CACHE_MAX_OBJECT);
+    }
+    // requests are classified from their buffered heads, one at a time
+    if (fair_queueing && (!event_mode || acceptor_count > 0)) {
+        errx(EXIT_FAILURE, "The scheduler (-R) needs -e and cannot be combined with -A");
+    }
+
     size_t port = strtoull(argv[optind], NULL, 10);
     signal(SIGPIPE, SIG_IGN);
-    Listener_Socket_t *sock = ls_new(port);
-    if (!sock) {
-        errx(EXIT_FAILURE, "Failed to open socket");
+
+    // with -A every acceptor gets its own SO_REUSEPORT socket instead
+    Listener_Socket_t *sock = NULL;
+    if (acceptor_count > 0) {
+        listen_fds = malloc(acceptor_count * sizeof(int));
+        for (int i = 0; i < acceptor_count; i++) {
+            listen_fds[i] = reuseport_listener(port);
+            if (listen_fds[i] < 0) {
+                errx(EXIT_FAILURE, "Failed to open socket");
+            }
+        }
+    } else {
+        sock = ls_new(port);
+        if (!sock) {
+            errx(EXIT_FAILURE, "Failed to open socket");
+        }
     }
 
-    request_queue = queue_new(QUEUE_SIZE);
-    if (!request_queue) {
-        errx(EXIT_FAILURE, "Failed to initialize queue");
+    if (async_log) {
+        // every thread started after this inherits the blocked signals, so
+        // only signal_thread sees them and can flush the log first
+        static sigset_t term_signals;
+        sigemptyset(&term_signals);
+        sigaddset(&term_signals, SIGINT);
+        sigaddset(&term_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &term_signals, NULL);
+
+        audit_log = audit_log_new(STDERR_FILENO);
+        if (!audit_log) {
+            errx(EXIT_FAILURE, "Failed to initialize audit log");
+        }
+
+        pthread_t signal_tid;
+        pthread_create(&signal_tid, NULL, signal_thread, &term_signals);
     }
 
-    if (thread_count < 8) {
+    lock_table = lock_table_new(READERS, 0);
+    if (!lock_table) {
+        errx(EXIT_FAILURE, "Failed to initialize lock table");
+    }
+
+    deadlines = deadlines_new(DEADLINE_TICK_MS);
+    if (!deadlines) {
+        errx(EXIT_FAILURE, "Failed to initialize deadlines");
+    }
+
+    staging = staging_new(STAGING_TIMEOUT_MS, STAGING_MAX_TOTAL);
+    if (!staging) {
+        errx(EXIT_FAILURE, "Failed to initialize upload staging");
+    }
+
+    if (commit_window_ms >= 0) {
+        group_commit = group_commit_new(commit_window_ms, commit_batch);
+        if (!group_commit) {
+            errx(EXIT_FAILURE, "Failed to initialize group commit");
+        }
+    }
+
+    if (dedup) {
+        blob_store = blob_store_new(BLOB_STORE_DIR);
+        if (!blob_store) {
+            errx(EXIT_FAILURE, "Failed to initialize blob store");
+        }
+    }
+
+    if (cache_bytes > 0) {
+        object_cache = object_cache_new(cache_bytes, CACHE_MAX_OBJECT);
+        if (!object_cache) {
+            errx(EXIT_FAILURE, "Failed to initialize object cache");
+        }
+    }
+
+    if (pin_threads) {
+        affinity = affinity_new();
+        if (!affinity) {
+            errx(EXIT_FAILURE, "Failed to read the CPU affinity mask");
+        }
+    }
+
+    if (open_files > 0 && !versioning) {
+        fd_cache = fd_cache_new(open_files);
+        if (!fd_cache) {
+            errx(EXIT_FAILURE, "Failed to initialize descriptor cache");
+        }
+    }
+
+    if (thread_count < 8 && max_threads == 0) {
         thread_count = 8;
     }
 
-    worker_threads = malloc(thread_count * sizeof(pthread_t));
-    for (int i = 0; i < thread_count; i++) {
-        pthread_create(&worker_threads[i], NULL, worker_thread, NULL);
+    if (shed_target_ms > 0) {
+        admission = admission_new(shed_target_ms, shed_interval_ms);
+        if (!admission) {
+            errx(EXIT_FAILURE, "Failed to initialize admission control");
+        }
+    }
+
+    if (acceptor_count > 0) {
+        queue_capacity = thread_count * QUEUE_SIZE;
+        work_pool = work_pool_new(thread_count, QUEUE_SIZE);
+        if (!work_pool) {
+            errx(EXIT_FAILURE, "Failed to initialize work pool");
+        }
+    } else if (fair_queueing) {
+        scheduler = scheduler_new(QUEUE_SIZE);
+        if (!scheduler) {
+            errx(EXIT_FAILURE, "Failed to initialize scheduler");
+        }
+    } else {
+        request_queue = queue_new(QUEUE_SIZE);
+        if (!request_queue) {
+            errx(EXIT_FAILURE, "Failed to initialize queue");
+        }
+    }
+
+    if (max_requests < 1) {
+        max_requests = 1;
+    }
+    if (max_requests > 1 && !helper_keeps_pipelined()) {
+        warnx("The helper library reads past a request, keep-alive (-k) is disabled");
+        max_requests = 1;
+    }
+
+    // in event mode idle and slow connections wait in epoll instead of holding a worker
+    if (event_mode) {
+        event_loop = event_loop_new(
+            dispatch_connection, max_requests, idle_timeout_ms, header_timeout_ms);
+        if (!event_loop) {
+            errx(EXIT_FAILURE, "Failed to initialize event loop");
+        }
+    }
+
+    if (max_threads > 0) {
+        // the autoscaler starts and retires the workers itself
+        autoscaler
+            = autoscaler_new(min_threads, max_threads, target_wait_ms, spawn_worker, retire_worker);
+        if (!autoscaler || !autoscaler_start(autoscaler, thread_count)) {
+            errx(EXIT_FAILURE, "Failed to initialize autoscaler");
+        }
+    } else {
+        worker_threads = malloc(thread_count * sizeof(pthread_t));
+        for (int i = 0; i < thread_count; i++) {
+            start_worker(&worker_threads[i], i);
+        }
+    }
+
+    if (acceptor_count > 0) {
+        pthread_t *acceptors = malloc(acceptor_count * sizeof(pthread_t));
+        for (int i = 0; i < acceptor_count; i++) {
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            if (affinity) {
+                // the kernel hands a new connection to the listener bound to
+                // the CPU that received it, and its acceptor runs there too
+                int cpu = affinity_cpu(affinity, i);
+                setsockopt(listen_fds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+                affinity_set(affinity, &attr, i);
+            }
+            pthread_create(&acceptors[i], &attr, acceptor_thread, (void *) (intptr_t) i);
+            pthread_attr_destroy(&attr);
+        }
+        for (int i = 0; i < acceptor_count; i++) {
+            pthread_join(acceptors[i], NULL);
+        }
+        return EXIT_SUCCESS;
     }
 
     while (1) {
         int connfd = ls_accept(sock);
         if (connfd >= 0) {
-            // sets a more aggressive timeout for socket operations
-            struct timeval tv;
-            tv.tv_sec = 0; // 0 seconds
-            tv.tv_usec = 500000; // 500 milliseconds
-            setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-            queue_push(request_queue, (void *) (intptr_t) connfd);
+            accept_connection(connfd);
         }
     }
 
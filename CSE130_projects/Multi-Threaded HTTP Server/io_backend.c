@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include "io_backend.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+// submission queue entries per thread, enough for the largest batch
+#define RING_ENTRIES 8
+
+// one io_uring instance, mapped rings included
+typedef struct uring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+static __thread uring_t *thread_ring = NULL;
+static __thread bool thread_ring_failed = false;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void uring_free(void *arg) {
+    uring_t *r = arg;
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if (r->sq_ptr) {
+        munmap(r->sq_ptr, r->sq_size);
+    }
+    close(r->fd);
+    free(r);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create(&ring_key, uring_free);
+}
+
+// sets up the calling thread's ring the first time it is needed. returns
+// NULL when io_uring is unavailable, and the thread then stays on syscalls
+static uring_t *uring_get(void) {
+    if (thread_ring || thread_ring_failed) {
+        return thread_ring;
+    }
+    thread_ring_failed = true;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int) syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    uring_t *r = calloc(1, sizeof(uring_t));
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_size = r->cq_size = r->sq_size > r->cq_size ? r->sq_size : r->cq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        uring_free(r);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            uring_free(r);
+            return NULL;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_free(r);
+        return NULL;
+    }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // the ring is released when the thread exits
+    pthread_once(&ring_key_once, ring_key_init);
+    pthread_setspecific(ring_key, r);
+
+    thread_ring = r;
+    thread_ring_failed = false;
+    return r;
+}
+
+// returns the i-th free submission slot after the current tail, cleared
+static struct io_uring_sqe *uring_sqe(uring_t *r, unsigned i) {
+    unsigned tail = *r->sq_tail + i;
+    unsigned idx = tail & *r->sq_mask;
+    r->sq_array[idx] = idx;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = i;
+    return sqe;
+}
+
+// submits n prepared entries with one syscall, waits for all of them and
+// stores each result by submission index
+static bool uring_submit_wait(uring_t *r, unsigned n, int *res) {
+    atomic_store_explicit((_Atomic unsigned *) r->sq_tail, *r->sq_tail + n, memory_order_release);
+
+    unsigned done = 0;
+    while (done < n) {
+        int ret = (int) syscall(__NR_io_uring_enter, r->fd, done == 0 ? n : 0, n - done,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            return false;
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *) r->cq_tail, memory_order_acquire);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->user_data < n) {
+                res[cqe->user_data] = cqe->res;
+            }
+            head++;
+            done++;
+        }
+        atomic_store_explicit((_Atomic unsigned *) r->cq_head, head, memory_order_release);
+    }
+    return true;
+}
+
+// copies the fields the handlers use from a statx result
+static void statx_to_stat(const struct statx *sx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_size = sx->stx_size;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+}
+
+#endif
+
+// opens and stats a file. with io_uring the open and the statx of the same
+// path go out in one submission. callers hold the URI's lock, so nobody can
+// swap the file between the two
+int io_open_stat(const char *path, int *fd, struct stat *st) {
+#ifdef USE_IO_URING
+    uring_t *r = uring_get();
+    if (r) {
+        struct statx sx;
+        struct io_uring_sqe *sqe = uring_sqe(r, 0);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+        sqe = uring_sqe(r, 1);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t) &sx;
+
+        int res[2] = { -EIO, -EIO };
+        if (uring_submit_wait(r, 2, res) && res[0] != -EINVAL && res[1] != -EINVAL) {
+            if (res[0] >= 0 && res[1] == 0) {
+                *fd = res[0];
+                statx_to_stat(&sx, st);
+                return 0;
+            }
+            if (res[0] >= 0) {
+                close(res[0]);
+            }
+            errno = res[0] < 0 ? -res[0] : -res[1];
+            return -1;
+        }
+        // the kernel does not know these opcodes, use the syscalls
+    }
+#endif
+    *fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (*fd < 0) {
+        return -1;
+    }
+    if (fstat(*fd, st) != 0) {
+        int saved = errno;
+        close(*fd);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// reads exactly len bytes at off
+bool io_pread_full(int fd, char *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = -1;
+#ifdef USE_IO_URING
+        uring_t *r = uring_get();
+        int res = -EINVAL;
+        if (r) {
+            struct io_uring_sqe *sqe = uring_sqe(r, 0);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t) (buf + done);
+            sqe->len = len - done;
+            sqe->off = off + done;
+            if (!uring_submit_wait(r, 1, &res)) {
+                res = -EINVAL;
+            }
+        }
+        if (res != -EINVAL) {
+            n = res;
+            if (res < 0) {
+                errno = -res;
+            }
+        } else
+#endif
+            n = pread(fd, buf + done, len - done, off + done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// advances an iovec array past n written bytes, returns the remaining count
+static int iov_advance(struct iovec **iov, int iovcnt, size_t n) {
+    while (iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        iovcnt--;
+    }
+    if (iovcnt > 0) {
+        (*iov)->iov_base = (char *) (*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+    return iovcnt;
+}
+
+// writes all of an iovec array
+bool io_writev_full(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = -1;
+#ifdef USE_IO_URING
+        uring_t *r = uring_get();
+        int res = -EINVAL;
+        if (r) {
+            struct io_uring_sqe *sqe = uring_sqe(r, 0);
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t) iov;
+            sqe->len = iovcnt;
+            sqe->off = (__u64) -1; // use and advance the file position, as writev does
+            if (!uring_submit_wait(r, 1, &res)) {
+                res = -EINVAL;
+            }
+        }
+        if (res != -EINVAL) {
+            n = res;
+            if (res < 0) {
+                errno = -res;
+            }
+        } else
+#endif
+            n = writev(fd, iov, iovcnt);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        iovcnt = iov_advance(&iov, iovcnt, n);
+    }
+    return true;
+}
+
+// renames a file, with io_uring when the kernel supports IORING_OP_RENAMEAT
+int io_rename(const char *from, const char *to, unsigned int flags) {
+#ifdef USE_IO_URING
+    uring_t *r = uring_get();
+    if (r) {
+        struct io_uring_sqe *sqe = uring_sqe(r, 0);
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) from;
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (uintptr_t) to;
+        sqe->rename_flags = flags;
+
+        int res = -EINVAL;
+        if (uring_submit_wait(r, 1, &res) && res != -EINVAL) {
+            if (res < 0) {
+                errno = -res;
+                return -1;
+            }
+            return 0;
+        }
+    }
+#endif
+    return renameat2(AT_FDCWD, from, AT_FDCWD, to, flags);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// file and socket I/O used by the request handlers. built with -DUSE_IO_URING
+// (make URING=1) the calls go through a per-thread io_uring, so operations
+// that belong together are submitted with a single syscall. when io_uring is
+// not compiled in, or the kernel refuses it, the plain syscalls are used.
+
+// opens path read-only and stats it. returns 0 and sets *fd and *st, or -1
+// with errno set
+int io_open_stat(const char *path, int *fd, struct stat *st);
+
+// reads exactly len bytes at offset off, returns false on error or short file
+bool io_pread_full(int fd, char *buf, size_t len, off_t off);
+
+// writes all of an iovec array, iov is modified on partial writes
+bool io_writev_full(int fd, struct iovec *iov, int iovcnt);
+
+// renameat2 relative to the working directory. returns 0, or -1 with errno set
+int io_rename(const char *from, const char *to, unsigned int flags);
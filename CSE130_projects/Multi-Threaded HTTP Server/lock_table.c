@@ -0,0 +1,140 @@
+#include "lock_table.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// number of independently locked shards, a power of two
+#define SHARDS 64
+// buckets per shard, a power of two. only URIs in use are stored, so the
+// chains stay short no matter how many distinct URIs have been seen
+#define BUCKETS 64
+
+// one shard of the table, its mutex covers its buckets and refcounts
+typedef struct shard {
+    pthread_mutex_t mutex;
+    file_lock_t *buckets[BUCKETS];
+} shard_t;
+
+// structure for the lock table
+typedef struct lock_table {
+    PRIORITY priority; // priority of every rwlock in the table
+    uint32_t n; // N_WAY value for the rwlocks
+    shard_t shards[SHARDS];
+} lock_table_t;
+
+// the low bits pick the shard and the next bits pick the bucket
+static shard_t *shard_for(lock_table_t *t, uint64_t hash) {
+    return &t->shards[hash & (SHARDS - 1)];
+}
+
+static file_lock_t **bucket_for(shard_t *s, uint64_t hash) {
+    return &s->buckets[(hash >> 6) & (BUCKETS - 1)];
+}
+
+// creates a new lock table
+lock_table_t *lock_table_new(PRIORITY priority, uint32_t n) {
+    lock_table_t *t = calloc(1, sizeof(lock_table_t));
+    if (!t) {
+        return NULL;
+    }
+
+    t->priority = priority;
+    t->n = n;
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_init(&t->shards[i].mutex, NULL);
+    }
+    return t;
+}
+
+// frees an entry, its lock and its reference to the published version
+static void file_lock_free(file_lock_t *fl) {
+    file_version_release(&fl->version);
+    pthread_mutex_destroy(&fl->publish_lock);
+    rwlock_delete(&fl->lock);
+    free(fl->uri);
+    free(fl);
+}
+
+// frees the lock table and every entry left in it
+void lock_table_delete(lock_table_t **t) {
+    if (!t || !*t) {
+        return;
+    }
+
+    for (int i = 0; i < SHARDS; i++) {
+        shard_t *s = &(*t)->shards[i];
+        for (int b = 0; b < BUCKETS; b++) {
+            for (file_lock_t *fl = s->buckets[b]; fl;) {
+                file_lock_t *next = fl->next;
+                file_lock_free(fl);
+                fl = next;
+            }
+        }
+        pthread_mutex_destroy(&s->mutex);
+    }
+    free(*t);
+    *t = NULL;
+}
+
+// returns the entry for uri with a reference held, creating it if needed
+file_lock_t *lock_table_acquire(lock_table_t *t, const char *uri, uint64_t hash) {
+    shard_t *s = shard_for(t, hash);
+    file_lock_t **bucket = bucket_for(s, hash);
+
+    pthread_mutex_lock(&s->mutex);
+
+    for (file_lock_t *fl = *bucket; fl; fl = fl->next) {
+        if (fl->hash == hash && strcmp(fl->uri, uri) == 0) {
+            fl->refcount++;
+            pthread_mutex_unlock(&s->mutex);
+            return fl;
+        }
+    }
+
+    file_lock_t *fl = calloc(1, sizeof(file_lock_t));
+    if (fl) {
+        fl->uri = strdup(uri);
+        fl->lock = rwlock_new(t->priority, t->n);
+        if (!fl->uri || !fl->lock) {
+            free(fl->uri);
+            rwlock_delete(&fl->lock);
+            free(fl);
+            fl = NULL;
+        }
+    }
+    if (fl) {
+        pthread_mutex_init(&fl->publish_lock, NULL);
+        fl->hash = hash;
+        fl->refcount = 1;
+        fl->next = *bucket;
+        *bucket = fl;
+    }
+
+    pthread_mutex_unlock(&s->mutex);
+    return fl;
+}
+
+// drops a reference, unlinking and freeing the entry when it was the last one
+void lock_table_release(lock_table_t *t, file_lock_t *fl) {
+    if (!fl) {
+        return;
+    }
+
+    shard_t *s = shard_for(t, fl->hash);
+    pthread_mutex_lock(&s->mutex);
+
+    if (--fl->refcount > 0) {
+        pthread_mutex_unlock(&s->mutex);
+        return;
+    }
+
+    file_lock_t **link = bucket_for(s, fl->hash);
+    while (*link != fl) {
+        link = &(*link)->next;
+    }
+    *link = fl->next;
+
+    pthread_mutex_unlock(&s->mutex);
+    file_lock_free(fl);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "rwlock.h"
+#include "file_version.h"
+#include "uri_hash.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+// one reader-writer lock per URI that some request currently holds
+typedef struct file_lock {
+    char *uri;
+    uint64_t hash; // uri_hash(uri), compared before the string
+    rwlock_t *lock;
+    // versioning mode (-V): the published version, swapped and read under
+    // publish_lock instead of taking the rwlock. NULL until first loaded
+    file_version_t *version;
+    pthread_mutex_t publish_lock;
+    int refcount; // requests holding this entry, protected by the shard mutex
+    struct file_lock *next; // next entry in the same bucket
+} file_lock_t;
+
+// sharded hash table of file locks. entries are created on first use and freed
+// when the last request releases them, so the table only holds URIs in use.
+typedef struct lock_table lock_table_t;
+
+// creates a new lock table whose locks use the given rwlock priority
+lock_table_t *lock_table_new(PRIORITY priority, uint32_t n);
+
+// frees the lock table and every entry left in it
+void lock_table_delete(lock_table_t **t);
+
+// returns the lock entry for uri with a reference held by the caller
+file_lock_t *lock_table_acquire(lock_table_t *t, const char *uri, uint64_t hash);
+
+// drops the caller's reference, freeing the entry when nobody holds it
+void lock_table_release(lock_table_t *t, file_lock_t *fl);
@@ -0,0 +1,153 @@
+// tests lock_table.c: entries are shared while referenced and freed with the
+// last release, also for URIs whose hashes collide and under threads taking
+// and dropping references at once. "lock_tabletest -v" prints each step
+
+#include "lock_table.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS 8
+#define ROUNDS 20000
+#define URIS 16
+
+static bool verbose;
+
+// a version of some open file, so the test can see the table drop its reference
+static file_version_t *some_version(void) {
+    int fd = open("/dev/null", O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+    file_version_t *v = file_version_new(fd, &st);
+    assert(v);
+    return v;
+}
+
+// references to one URI share its entry, which goes with the last of them
+static void test_refcount(void) {
+    lock_table_t *t = lock_table_new(N_WAY, 1);
+    assert(t);
+    file_lock_t *a = lock_table_acquire(t, "a", uri_hash("a"));
+    file_lock_t *b = lock_table_acquire(t, "a", uri_hash("a"));
+    assert(a && a == b && a->refcount == 2);
+    assert(strcmp(a->uri, "a") == 0 && a->lock && !a->version);
+
+    // the entry holds a reference to its published version
+    file_version_t *v = some_version();
+    file_version_ref(v);
+    a->version = v;
+    lock_table_release(t, b);
+    assert(a->refcount == 1 && a->version == v && v->refcount == 2);
+    lock_table_release(t, a);
+    assert(v->refcount == 1);
+    file_version_release(&v);
+
+    // a URI taken again after its last release gets a fresh entry
+    a = lock_table_acquire(t, "a", uri_hash("a"));
+    assert(a && a->refcount == 1 && !a->version);
+    if (verbose) {
+        printf("refcount: entry freed with its last reference\n");
+    }
+    // entries still referenced go with the table
+    lock_table_delete(&t);
+    assert(!t);
+}
+
+// URIs with the same hash get their own entries, and releasing one in the
+// middle of a chain keeps the others
+static void test_collisions(void) {
+    lock_table_t *t = lock_table_new(N_WAY, 1);
+    assert(t);
+    static const char *uris[] = { "x", "y", "z" };
+    file_lock_t *fl[3];
+    for (int i = 0; i < 3; i++) {
+        fl[i] = lock_table_acquire(t, uris[i], 42);
+        assert(fl[i] && fl[i]->hash == 42 && strcmp(fl[i]->uri, uris[i]) == 0);
+    }
+    assert(fl[0] != fl[1] && fl[1] != fl[2] && fl[0] != fl[2]);
+
+    lock_table_release(t, fl[1]);
+    for (int i = 0; i < 3; i += 2) {
+        file_lock_t *again = lock_table_acquire(t, uris[i], 42);
+        assert(again == fl[i] && again->refcount == 2);
+        lock_table_release(t, again);
+        lock_table_release(t, fl[i]);
+    }
+    if (verbose) {
+        printf("collisions: three entries under one hash\n");
+    }
+    lock_table_delete(&t);
+}
+
+typedef struct worker {
+    lock_table_t *t;
+    unsigned seed;
+    int *counts; // per URI, only changed under its writer lock
+} worker_t;
+
+static const char *uri_name(int i) {
+    static const char *names[URIS]
+        = { "u0", "u1", "u2", "u3", "u4", "u5", "u6", "u7", "u8", "u9", "u10", "u11", "u12",
+              "u13", "u14", "u15" };
+    return names[i];
+}
+
+// takes and drops references to random URIs, counting under the writer lock
+static void *work(void *arg) {
+    worker_t *w = arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        int u = rand_r(&w->seed) % URIS;
+        file_lock_t *fl = lock_table_acquire(w->t, uri_name(u), uri_hash(uri_name(u)));
+        assert(fl && strcmp(fl->uri, uri_name(u)) == 0);
+        writer_lock(fl->lock);
+        w->counts[u]++;
+        writer_unlock(fl->lock);
+        lock_table_release(w->t, fl);
+    }
+    return NULL;
+}
+
+// concurrent references never share an entry between URIs or lose one, so
+// the writer locks serialize every count and the table ends up empty
+static void test_threads(void) {
+    lock_table_t *t = lock_table_new(N_WAY, 1);
+    assert(t);
+    int counts[URIS] = { 0 };
+    pthread_t threads[THREADS];
+    worker_t workers[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        workers[i] = (worker_t) { t, i + 1, counts };
+        assert(pthread_create(&threads[i], NULL, work, &workers[i]) == 0);
+    }
+    int total = 0;
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    for (int u = 0; u < URIS; u++) {
+        total += counts[u];
+        file_lock_t *fl = lock_table_acquire(t, uri_name(u), uri_hash(uri_name(u)));
+        assert(fl && fl->refcount == 1);
+        lock_table_release(t, fl);
+    }
+    assert(total == THREADS * ROUNDS);
+    if (verbose) {
+        printf("threads: %d references taken and dropped\n", total);
+    }
+    lock_table_delete(&t);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    test_refcount();
+    test_collisions();
+    test_threads();
+    printf("lock_tabletest: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,334 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// sub-buckets per power of two
+#define SUB_BUCKETS 16
+// enough buckets for values up to 2^40 ns, about 18 minutes
+#define BUCKETS (38 * SUB_BUCKETS)
+
+// log-linear histogram of nanosecond values
+typedef struct histogram {
+    _Atomic uint64_t buckets[BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} histogram_t;
+
+// one thread's counters, only written by that thread
+typedef struct thread_metrics {
+    _Atomic uint64_t requests[METRIC_METHODS];
+    _Atomic uint64_t bytes_sent;
+    _Atomic uint64_t bytes_received;
+    _Atomic uint64_t timeouts[METRIC_TIMEOUT_KINDS];
+    _Atomic uint64_t shed[METRIC_SHED_KINDS];
+    histogram_t latency;
+    histogram_t lock_wait[METRIC_LOCK_KINDS];
+    histogram_t lock_hold[METRIC_LOCK_KINDS];
+    atomic_bool in_use; // claimed by a live thread
+    struct thread_metrics *next;
+} thread_metrics_t;
+
+static _Atomic(thread_metrics_t *) all_metrics = NULL;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+// the queue depth is shared by nature, it is one counter next to the queue
+static _Atomic int64_t queue_depth = 0;
+static _Atomic int64_t queue_depth_peak = 0;
+
+static const char *method_names[METRIC_METHODS] = { "GET", "PUT", "OTHER" };
+static const char *lock_names[METRIC_LOCK_KINDS] = { "reader", "writer" };
+static const char *timeout_names[METRIC_TIMEOUT_KINDS] = { "header", "body", "idle" };
+static const char *shed_names[METRIC_SHED_KINDS] = { "delay", "full" };
+
+// hands the slot to the next thread that needs one, counts are kept
+static void metrics_release(void *arg) {
+    thread_metrics_t *m = arg;
+    atomic_store(&m->in_use, false);
+}
+
+static void metrics_key_init(void) {
+    pthread_key_create(&metrics_key, metrics_release);
+}
+
+// returns the calling thread's slot, claiming a free one or creating it
+static thread_metrics_t *self(void) {
+    static __thread thread_metrics_t *mine = NULL;
+    if (mine) {
+        return mine;
+    }
+
+    pthread_once(&metrics_key_once, metrics_key_init);
+    thread_metrics_t *m;
+    for (m = atomic_load(&all_metrics); m; m = m->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&m->in_use, &expected, true)) {
+            break;
+        }
+    }
+    if (!m) {
+        m = calloc(1, sizeof(thread_metrics_t));
+        if (!m) {
+            return NULL;
+        }
+        atomic_store(&m->in_use, true);
+        m->next = atomic_load(&all_metrics);
+        while (!atomic_compare_exchange_weak(&all_metrics, &m->next, m)) {
+        }
+    }
+
+    pthread_setspecific(metrics_key, m);
+    mine = m;
+    return m;
+}
+
+// adds to a counter that only the calling thread writes, no atomic RMW needed
+static void bump(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// bucket of a value: exact below 16, then 16 linear steps per power of two
+static int bucket_index(uint64_t v) {
+    if (v < SUB_BUCKETS) {
+        return (int) v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int idx = (msb - 3) * SUB_BUCKETS + (int) ((v >> (msb - 4)) & (SUB_BUCKETS - 1));
+    return idx < BUCKETS ? idx : BUCKETS - 1;
+}
+
+// smallest value that falls in a bucket
+static uint64_t bucket_value(int idx) {
+    if (idx < SUB_BUCKETS) {
+        return idx;
+    }
+    int msb = idx / SUB_BUCKETS + 3;
+    return (uint64_t) (SUB_BUCKETS + idx % SUB_BUCKETS) << (msb - 4);
+}
+
+static void histogram_record(histogram_t *h, uint64_t v) {
+    bump(&h->buckets[bucket_index(v)], 1);
+    bump(&h->count, 1);
+    bump(&h->sum, v);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+    }
+}
+
+void metrics_request(metric_method_t method, uint64_t latency_ns) {
+    thread_metrics_t *m = self();
+    if (m && method < METRIC_METHODS) {
+        bump(&m->requests[method], 1);
+        histogram_record(&m->latency, latency_ns);
+    }
+}
+
+void metrics_bytes_sent(uint64_t n) {
+    thread_metrics_t *m = self();
+    if (m) {
+        bump(&m->bytes_sent, n);
+    }
+}
+
+void metrics_bytes_received(uint64_t n) {
+    thread_metrics_t *m = self();
+    if (m) {
+        bump(&m->bytes_received, n);
+    }
+}
+
+void metrics_lock_wait(metric_lock_t kind, uint64_t ns) {
+    thread_metrics_t *m = self();
+    if (m && kind < METRIC_LOCK_KINDS) {
+        histogram_record(&m->lock_wait[kind], ns);
+    }
+}
+
+void metrics_lock_hold(metric_lock_t kind, uint64_t ns) {
+    thread_metrics_t *m = self();
+    if (m && kind < METRIC_LOCK_KINDS) {
+        histogram_record(&m->lock_hold[kind], ns);
+    }
+}
+
+void metrics_timeout(metric_timeout_t kind) {
+    thread_metrics_t *m = self();
+    if (m && kind < METRIC_TIMEOUT_KINDS) {
+        bump(&m->timeouts[kind], 1);
+    }
+}
+
+void metrics_shed(metric_shed_t kind) {
+    thread_metrics_t *m = self();
+    if (m && kind < METRIC_SHED_KINDS) {
+        bump(&m->shed[kind], 1);
+    }
+}
+
+void metrics_queue_push(void) {
+    int64_t depth = atomic_fetch_add(&queue_depth, 1) + 1;
+    int64_t peak = atomic_load(&queue_depth_peak);
+    while (depth > peak && !atomic_compare_exchange_weak(&queue_depth_peak, &peak, depth)) {
+    }
+}
+
+void metrics_queue_pop(void) {
+    atomic_fetch_sub(&queue_depth, 1);
+}
+
+int64_t metrics_queue_depth(void) {
+    return atomic_load_explicit(&queue_depth, memory_order_relaxed);
+}
+
+// a histogram summed over every thread
+typedef struct merged {
+    uint64_t buckets[BUCKETS];
+    uint64_t count, sum, max;
+} merged_t;
+
+static void merge(merged_t *out, histogram_t *h) {
+    for (int i = 0; i < BUCKETS; i++) {
+        out->buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    }
+    out->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+    out->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    if (max > out->max) {
+        out->max = max;
+    }
+}
+
+// value at quantile q, reported as the lower bound of its bucket
+static uint64_t quantile(const merged_t *h, double q) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (q * (h->count - 1)) + 1, seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return bucket_value(i);
+        }
+    }
+    return h->max;
+}
+
+// output of the page, every line is handed to the sink as it is formatted
+typedef struct page {
+    metrics_sink_t sink;
+    void *arg;
+    bool failed;
+} page_t;
+
+static void put(page_t *p, const char *fmt, ...) {
+    if (p->failed) {
+        return;
+    }
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t) n >= sizeof(line) || !p->sink(p->arg, line, n)) {
+        p->failed = true;
+    }
+}
+
+// writes one histogram as a Prometheus summary in microseconds
+static void put_summary(page_t *p, const char *name, const char *labels, const merged_t *h) {
+    static const double qs[] = { 0.5, 0.99, 0.999 };
+    static const char *qnames[] = { "0.5", "0.99", "0.999" };
+    const char *sep = labels[0] ? "," : "";
+    for (int i = 0; i < 3; i++) {
+        put(p, "%s{%s%squantile=\"%s\"} %.3f\n", name, labels, sep, qnames[i],
+            quantile(h, qs[i]) / 1000.0);
+    }
+
+    // the totals carry the labels alone, and no braces when there are none
+    const char *lbrace = labels[0] ? "{" : "", *rbrace = labels[0] ? "}" : "";
+    put(p, "%s_sum%s%s%s %.3f\n", name, lbrace, labels, rbrace, h->sum / 1000.0);
+    put(p, "%s_count%s%s%s %lu\n", name, lbrace, labels, rbrace, (unsigned long) h->count);
+    put(p, "%s_max%s%s%s %.3f\n", name, lbrace, labels, rbrace, h->max / 1000.0);
+}
+
+// sums every thread's slot and renders the page
+bool metrics_write(metrics_sink_t sink, void *arg) {
+    uint64_t requests[METRIC_METHODS] = { 0 };
+    uint64_t sent = 0, received = 0;
+    uint64_t timeouts[METRIC_TIMEOUT_KINDS] = { 0 };
+    uint64_t shed[METRIC_SHED_KINDS] = { 0 };
+    merged_t *latency = calloc(1 + 2 * METRIC_LOCK_KINDS, sizeof(merged_t));
+    if (!latency) {
+        return false;
+    }
+    merged_t *wait = latency + 1, *hold = wait + METRIC_LOCK_KINDS;
+
+    for (thread_metrics_t *m = atomic_load(&all_metrics); m; m = m->next) {
+        for (int i = 0; i < METRIC_METHODS; i++) {
+            requests[i] += atomic_load_explicit(&m->requests[i], memory_order_relaxed);
+        }
+        sent += atomic_load_explicit(&m->bytes_sent, memory_order_relaxed);
+        received += atomic_load_explicit(&m->bytes_received, memory_order_relaxed);
+        for (int i = 0; i < METRIC_TIMEOUT_KINDS; i++) {
+            timeouts[i] += atomic_load_explicit(&m->timeouts[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < METRIC_SHED_KINDS; i++) {
+            shed[i] += atomic_load_explicit(&m->shed[i], memory_order_relaxed);
+        }
+        merge(latency, &m->latency);
+        for (int k = 0; k < METRIC_LOCK_KINDS; k++) {
+            merge(&wait[k], &m->lock_wait[k]);
+            merge(&hold[k], &m->lock_hold[k]);
+        }
+    }
+
+    page_t p = { .sink = sink, .arg = arg };
+
+    put(&p, "# TYPE httpserver_requests_total counter\n");
+    for (int i = 0; i < METRIC_METHODS; i++) {
+        put(&p, "httpserver_requests_total{method=\"%s\"} %lu\n", method_names[i],
+            (unsigned long) requests[i]);
+    }
+    put(&p, "# TYPE httpserver_request_latency_us summary\n");
+    put_summary(&p, "httpserver_request_latency_us", "", latency);
+    put(&p, "# TYPE httpserver_queue_depth gauge\n");
+    put(&p, "httpserver_queue_depth %ld\n", (long) atomic_load(&queue_depth));
+    put(&p, "httpserver_queue_depth_peak %ld\n", (long) atomic_load(&queue_depth_peak));
+    put(&p, "# TYPE httpserver_bytes_sent_total counter\n");
+    put(&p, "httpserver_bytes_sent_total %lu\n", (unsigned long) sent);
+    put(&p, "# TYPE httpserver_bytes_received_total counter\n");
+    put(&p, "httpserver_bytes_received_total %lu\n", (unsigned long) received);
+    put(&p, "# TYPE httpserver_timeouts_total counter\n");
+    for (int i = 0; i < METRIC_TIMEOUT_KINDS; i++) {
+        put(&p, "httpserver_timeouts_total{phase=\"%s\"} %lu\n", timeout_names[i],
+            (unsigned long) timeouts[i]);
+    }
+    put(&p, "# TYPE httpserver_shed_total counter\n");
+    for (int i = 0; i < METRIC_SHED_KINDS; i++) {
+        put(&p, "httpserver_shed_total{reason=\"%s\"} %lu\n", shed_names[i],
+            (unsigned long) shed[i]);
+    }
+    put(&p, "# TYPE httpserver_lock_wait_us summary\n");
+    for (int k = 0; k < METRIC_LOCK_KINDS; k++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "lock=\"%s\"", lock_names[k]);
+        put_summary(&p, "httpserver_lock_wait_us", labels, &wait[k]);
+    }
+    put(&p, "# TYPE httpserver_lock_hold_us summary\n");
+    for (int k = 0; k < METRIC_LOCK_KINDS; k++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "lock=\"%s\"", lock_names[k]);
+        put_summary(&p, "httpserver_lock_hold_us", labels, &hold[k]);
+    }
+
+    free(latency);
+    return !p.failed;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// server metrics. every thread counts into its own slot, so recording is a
+// few uncontended stores. the slots are only summed when the metrics page is
+// rendered. latencies go into HDR-style log-linear histograms with 16
+// sub-buckets per power of two, about 6% resolution.
+
+typedef enum { METRIC_GET, METRIC_PUT, METRIC_OTHER, METRIC_METHODS } metric_method_t;
+
+typedef enum { METRIC_READER, METRIC_WRITER, METRIC_LOCK_KINDS } metric_lock_t;
+
+typedef enum {
+    METRIC_HEADER_TIMEOUT,
+    METRIC_BODY_TIMEOUT,
+    METRIC_IDLE_TIMEOUT,
+    METRIC_TIMEOUT_KINDS
+} metric_timeout_t;
+
+// one request answered, with its latency
+void metrics_request(metric_method_t method, uint64_t latency_ns);
+
+// body bytes sent to and received from clients
+void metrics_bytes_sent(uint64_t n);
+void metrics_bytes_received(uint64_t n);
+
+// time spent waiting for and holding a per-URI rwlock
+void metrics_lock_wait(metric_lock_t kind, uint64_t ns);
+void metrics_lock_hold(metric_lock_t kind, uint64_t ns);
+
+// a connection was cut off because a deadline passed
+void metrics_timeout(metric_timeout_t kind);
+
+typedef enum { METRIC_SHED_DELAY, METRIC_SHED_FULL, METRIC_SHED_KINDS } metric_shed_t;
+
+// a connection was answered with 503 by admission control
+void metrics_shed(metric_shed_t kind);
+
+// a connection entered or left the request queue
+void metrics_queue_push(void);
+void metrics_queue_pop(void);
+
+// connections currently in the request queue
+int64_t metrics_queue_depth(void);
+
+// receives the rendered page piece by piece, returns false to stop rendering
+typedef bool (*metrics_sink_t)(void *arg, const char *data, size_t len);
+
+// renders every metric in the Prometheus text format and passes it to sink
+// as it is produced, so the page is never held in memory as a whole. returns
+// false when out of memory, before anything was passed on, or when sink
+// failed
+bool metrics_write(metrics_sink_t sink, void *arg);
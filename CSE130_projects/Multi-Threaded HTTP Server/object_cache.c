@@ -0,0 +1,218 @@
+#include "object_cache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// number of independently locked shards, a power of two
+#define SHARDS 16
+// buckets per shard, a power of two
+#define BUCKETS 256
+
+// one shard of the cache, its mutex covers its buckets, LRU list and size
+typedef struct shard {
+    pthread_mutex_t mutex;
+    cached_object_t *buckets[BUCKETS];
+    cached_object_t *lru_head, *lru_tail; // most recently used first
+    size_t bytes; // sum of object sizes in the shard
+} shard_t;
+
+// structure for the object cache
+typedef struct object_cache {
+    uint64_t shard_mask; // shards in use minus one
+    size_t shard_budget; // bytes each shard may hold
+    size_t max_object; // largest object that is cached
+    shard_t shards[SHARDS];
+} object_cache_t;
+
+static shard_t *shard_for(object_cache_t *c, uint64_t hash) {
+    return &c->shards[hash & c->shard_mask];
+}
+
+static cached_object_t **bucket_for(shard_t *s, uint64_t hash) {
+    return &s->buckets[(hash >> 4) & (BUCKETS - 1)];
+}
+
+// creates a new object cache
+object_cache_t *object_cache_new(size_t budget, size_t max_object) {
+    object_cache_t *c = calloc(1, sizeof(object_cache_t));
+    if (!c) {
+        return NULL;
+    }
+
+    // as many shards as the budget allows with room for a largest object in
+    // each, a small budget spreads its lookups over fewer locks instead
+    size_t shards = SHARDS;
+    while (shards > 1 && budget / shards < max_object) {
+        shards /= 2;
+    }
+    c->shard_mask = shards - 1;
+    c->shard_budget = budget / shards;
+    c->max_object = max_object < c->shard_budget ? max_object : c->shard_budget;
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_mutex_init(&c->shards[i].mutex, NULL);
+    }
+    return c;
+}
+
+// frees an object once no reader holds it
+static void object_unref(cached_object_t *obj) {
+    if (atomic_fetch_sub_explicit(&obj->refcount, 1, memory_order_acq_rel) == 1) {
+        free(obj->uri);
+        free(obj->data);
+        free(obj);
+    }
+}
+
+static void object_ref(cached_object_t *obj) {
+    atomic_fetch_add_explicit(&obj->refcount, 1, memory_order_relaxed);
+}
+
+// LRU helpers, callers hold the shard mutex
+static void lru_unlink(shard_t *s, cached_object_t *obj) {
+    if (obj->lru_prev) {
+        obj->lru_prev->lru_next = obj->lru_next;
+    } else {
+        s->lru_head = obj->lru_next;
+    }
+    if (obj->lru_next) {
+        obj->lru_next->lru_prev = obj->lru_prev;
+    } else {
+        s->lru_tail = obj->lru_prev;
+    }
+    obj->lru_prev = obj->lru_next = NULL;
+}
+
+static void lru_push_front(shard_t *s, cached_object_t *obj) {
+    obj->lru_prev = NULL;
+    obj->lru_next = s->lru_head;
+    if (s->lru_head) {
+        s->lru_head->lru_prev = obj;
+    } else {
+        s->lru_tail = obj;
+    }
+    s->lru_head = obj;
+}
+
+// takes an object out of its shard and drops the cache's reference
+static void shard_remove(shard_t *s, cached_object_t *obj) {
+    cached_object_t **link = bucket_for(s, obj->hash);
+    while (*link != obj) {
+        link = &(*link)->next;
+    }
+    *link = obj->next;
+    lru_unlink(s, obj);
+    s->bytes -= obj->len;
+    object_unref(obj);
+}
+
+static cached_object_t *shard_find(shard_t *s, const char *uri, uint64_t hash) {
+    for (cached_object_t *obj = *bucket_for(s, hash); obj; obj = obj->next) {
+        if (obj->hash == hash && strcmp(obj->uri, uri) == 0) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+// frees the cache and drops its references
+void object_cache_delete(object_cache_t **c) {
+    if (!c || !*c) {
+        return;
+    }
+
+    for (int i = 0; i < SHARDS; i++) {
+        shard_t *s = &(*c)->shards[i];
+        while (s->lru_head) {
+            shard_remove(s, s->lru_head);
+        }
+        pthread_mutex_destroy(&s->mutex);
+    }
+    free(*c);
+    *c = NULL;
+}
+
+int object_cache_admits(object_cache_t *c, size_t len) {
+    return c && len <= c->max_object;
+}
+
+// looks up uri, a hit moves the object to the front of its shard's LRU list
+cached_object_t *object_cache_get(object_cache_t *c, const char *uri, uint64_t hash) {
+    shard_t *s = shard_for(c, hash);
+    pthread_mutex_lock(&s->mutex);
+
+    cached_object_t *obj = shard_find(s, uri, hash);
+    if (obj) {
+        object_ref(obj);
+        if (s->lru_head != obj) {
+            lru_unlink(s, obj);
+            lru_push_front(s, obj);
+        }
+    }
+
+    pthread_mutex_unlock(&s->mutex);
+    return obj;
+}
+
+// inserts or replaces the object for uri, evicting the least recently used
+// objects of the shard until it fits the budget
+cached_object_t *object_cache_put(object_cache_t *c, const char *uri, uint64_t hash, char *data,
+    size_t len, const struct stat *st) {
+    if (!object_cache_admits(c, len)) {
+        free(data);
+        return NULL;
+    }
+
+    cached_object_t *obj = calloc(1, sizeof(cached_object_t));
+    if (!obj || !(obj->uri = strdup(uri))) {
+        free(obj);
+        free(data);
+        return NULL;
+    }
+    obj->hash = hash;
+    obj->data = data;
+    obj->len = len;
+    obj->ino = st->st_ino;
+    obj->mtime = st->st_mtim;
+    obj->ctime = st->st_ctim;
+    atomic_init(&obj->refcount, 2); // the cache's reference and the caller's
+
+    shard_t *s = shard_for(c, hash);
+    pthread_mutex_lock(&s->mutex);
+
+    cached_object_t *old = shard_find(s, uri, hash);
+    if (old) {
+        shard_remove(s, old);
+    }
+    while (s->lru_tail && s->bytes + len > c->shard_budget) {
+        shard_remove(s, s->lru_tail);
+    }
+
+    cached_object_t **bucket = bucket_for(s, hash);
+    obj->next = *bucket;
+    *bucket = obj;
+    lru_push_front(s, obj);
+    s->bytes += len;
+
+    pthread_mutex_unlock(&s->mutex);
+    return obj;
+}
+
+// removes the object for uri so the next reader goes back to the file
+void object_cache_invalidate(object_cache_t *c, const char *uri, uint64_t hash) {
+    shard_t *s = shard_for(c, hash);
+    pthread_mutex_lock(&s->mutex);
+
+    cached_object_t *obj = shard_find(s, uri, hash);
+    if (obj) {
+        shard_remove(s, obj);
+    }
+
+    pthread_mutex_unlock(&s->mutex);
+}
+
+void object_cache_release(__attribute__((unused)) object_cache_t *c, cached_object_t *obj) {
+    if (obj) {
+        object_unref(obj);
+    }
+}
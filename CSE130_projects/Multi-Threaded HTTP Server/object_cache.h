@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// an immutable copy of a file's contents. readers hold a reference while
+// sending it, so an entry evicted or replaced mid-send stays valid
+typedef struct cached_object {
+    char *uri;
+    uint64_t hash; // uri_hash(uri)
+    char *data;
+    size_t len;
+    ino_t ino; // inode, mtime and ctime of the file the copy was read from,
+    struct timespec mtime; // so hits can still answer conditional requests
+    struct timespec ctime;
+    _Atomic int refcount; // cache's own reference plus one per reader
+    struct cached_object *next; // next entry in the same bucket
+    struct cached_object *lru_prev, *lru_next; // recency order within a shard
+} cached_object_t;
+
+// bounded, byte-budgeted cache of file contents keyed by URI. callers look up
+// and fill entries under the URI's reader lock and invalidate them under its
+// writer lock, so a hit always matches what the file held at that point.
+typedef struct object_cache object_cache_t;
+
+// creates a new cache holding at most budget bytes, objects larger than
+// max_object bytes, or than the budget, are never cached
+object_cache_t *object_cache_new(size_t budget, size_t max_object);
+
+// frees the cache, objects still referenced by readers are freed on release
+void object_cache_delete(object_cache_t **c);
+
+// returns whether an object of len bytes may be cached
+int object_cache_admits(object_cache_t *c, size_t len);
+
+// returns the object for uri with a reference held, or NULL on a miss
+cached_object_t *object_cache_get(object_cache_t *c, const char *uri, uint64_t hash);
+
+// caches len bytes of data for uri, read from the file described by st, taking
+// ownership of data. returns the new object with a reference held for the
+// caller, or NULL if it was not cached (data is freed in that case)
+cached_object_t *object_cache_put(object_cache_t *c, const char *uri, uint64_t hash, char *data,
+    size_t len, const struct stat *st);
+
+// drops the cached copy of uri, if there is one
+void object_cache_invalidate(object_cache_t *c, const char *uri, uint64_t hash);
+
+// drops a reference returned by object_cache_get or object_cache_put
+void object_cache_release(object_cache_t *c, cached_object_t *obj);
@@ -0,0 +1,174 @@
+// tests object_cache.c: which sizes are admitted, eviction in LRU order within
+// the byte budget, replacement and invalidation, and that readers keep their
+// copies through all of them. "object_cachetest -v" prints each step
+
+#include "object_cache.h"
+#include "uri_hash.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KIB 1024
+#define MIB (1024 * 1024)
+
+static bool verbose;
+
+// caches len bytes of fill for uri and drops the returned reference
+static bool put(object_cache_t *c, const char *uri, size_t len, char fill) {
+    char *data = malloc(len);
+    assert(data);
+    memset(data, fill, len);
+    struct stat st = { .st_ino = (ino_t) len };
+    cached_object_t *obj = object_cache_put(c, uri, uri_hash(uri), data, len, &st);
+    if (!obj) {
+        return false;
+    }
+    assert(obj->len == len && obj->ino == st.st_ino && strcmp(obj->uri, uri) == 0);
+    object_cache_release(c, obj);
+    return true;
+}
+
+// whether uri is cached, with len bytes of fill if so
+static bool cached(object_cache_t *c, const char *uri, size_t len, char fill) {
+    cached_object_t *obj = object_cache_get(c, uri, uri_hash(uri));
+    if (!obj) {
+        return false;
+    }
+    assert(obj->len == len);
+    for (size_t i = 0; i < len; i++) {
+        assert(obj->data[i] == fill);
+    }
+    object_cache_release(c, obj);
+    return true;
+}
+
+// the largest object fits whatever the budget, down to one shard of it
+static void test_admits(void) {
+    static const size_t budgets[] = { MIB, 3 * MIB, 4 * MIB, 16 * MIB, 64 * MIB };
+    for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); i++) {
+        object_cache_t *c = object_cache_new(budgets[i], MIB);
+        assert(c);
+        assert(object_cache_admits(c, MIB) && !object_cache_admits(c, MIB + 1));
+        assert(put(c, "big", MIB, 'b') && cached(c, "big", MIB, 'b'));
+        assert(!put(c, "bigger", MIB + 1, 'b') && !cached(c, "bigger", MIB + 1, 'b'));
+        object_cache_delete(&c);
+        assert(!c);
+    }
+    // a budget below the largest object caps the objects instead
+    object_cache_t *c = object_cache_new(64 * KIB, MIB);
+    assert(c);
+    assert(object_cache_admits(c, 64 * KIB) && !object_cache_admits(c, 64 * KIB + 1));
+    assert(!object_cache_admits(NULL, 1));
+    object_cache_delete(&c);
+    if (verbose) {
+        printf("admits: 1 MiB objects fit budgets from 1 MiB up\n");
+    }
+}
+
+// a one shard cache evicts its least recently used objects to fit a new one
+static void test_lru(void) {
+    object_cache_t *c = object_cache_new(MIB, MIB);
+    assert(c);
+    assert(put(c, "a", 300 * KIB, 'a') && put(c, "b", 300 * KIB, 'b'));
+    assert(put(c, "c", 300 * KIB, 'c'));
+    // a hit makes a the most recently used, so b goes first
+    assert(cached(c, "a", 300 * KIB, 'a'));
+    assert(put(c, "d", 300 * KIB, 'd'));
+    assert(!cached(c, "b", 300 * KIB, 'b'));
+    assert(cached(c, "c", 300 * KIB, 'c') && cached(c, "a", 300 * KIB, 'a'));
+    assert(cached(c, "d", 300 * KIB, 'd'));
+
+    // the hits above left c used longest ago, then a. a larger object takes both
+    assert(put(c, "e", 600 * KIB, 'e'));
+    assert(!cached(c, "c", 300 * KIB, 'c') && !cached(c, "a", 300 * KIB, 'a'));
+    assert(cached(c, "d", 300 * KIB, 'd') && cached(c, "e", 600 * KIB, 'e'));
+    object_cache_delete(&c);
+    if (verbose) {
+        printf("lru: least recently used evicted first\n");
+    }
+}
+
+// replaced, invalidated and evicted objects stay valid for the readers holding them
+static void test_references(void) {
+    object_cache_t *c = object_cache_new(MIB, MIB);
+    assert(c);
+    assert(put(c, "r", 400 * KIB, '1'));
+    cached_object_t *held = object_cache_get(c, "r", uri_hash("r"));
+    assert(held);
+
+    // a put of the same URI replaces the copy
+    assert(put(c, "r", 100 * KIB, '2'));
+    assert(cached(c, "r", 100 * KIB, '2'));
+    assert(held->len == 400 * KIB && held->data[400 * KIB - 1] == '1');
+
+    // an invalidated URI misses until it is put again
+    cached_object_t *second = object_cache_get(c, "r", uri_hash("r"));
+    assert(second);
+    object_cache_invalidate(c, "r", uri_hash("r"));
+    assert(!cached(c, "r", 100 * KIB, '2'));
+    object_cache_invalidate(c, "r", uri_hash("r"));
+    assert(second->data[0] == '2');
+
+    // and one evicted while held too
+    assert(put(c, "s", 10 * KIB, 's'));
+    cached_object_t *third = object_cache_get(c, "s", uri_hash("s"));
+    assert(third && put(c, "t", MIB, 't') && !cached(c, "s", 10 * KIB, 's'));
+    assert(third->data[10 * KIB - 1] == 's');
+
+    object_cache_release(c, held);
+    object_cache_release(c, second);
+    // a reader may outlive the cache
+    object_cache_delete(&c);
+    assert(third->data[0] == 's');
+    object_cache_release(NULL, third);
+    if (verbose) {
+        printf("references: held copies outlive replacement, invalidation and eviction\n");
+    }
+}
+
+// many objects over many shards never hold more than the budget
+static void test_budget(void) {
+    object_cache_t *c = object_cache_new(4 * MIB, MIB);
+    assert(c);
+    enum { OBJECTS = 400 };
+    size_t lens[OBJECTS];
+    char uri[16];
+    srand(1);
+    for (int i = 0; i < OBJECTS; i++) {
+        lens[i] = 1 + (size_t) rand() % (100 * KIB);
+        snprintf(uri, sizeof(uri), "o%d", i);
+        assert(put(c, uri, lens[i], (char) i));
+    }
+
+    size_t held = 0;
+    int hits = 0;
+    for (int i = 0; i < OBJECTS; i++) {
+        snprintf(uri, sizeof(uri), "o%d", i);
+        if (cached(c, uri, lens[i], (char) i)) {
+            held += lens[i];
+            hits++;
+        }
+    }
+    assert(held <= 4 * MIB && hits > 0);
+    // the last object put is always there
+    snprintf(uri, sizeof(uri), "o%d", OBJECTS - 1);
+    assert(cached(c, uri, lens[OBJECTS - 1], (char) (OBJECTS - 1)));
+    if (verbose) {
+        printf("budget: %d objects, %zu bytes cached\n", hits, held);
+    }
+    object_cache_delete(&c);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    test_admits();
+    test_lru();
+    test_references();
+    test_budget();
+    printf("object_cachetest: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include "scheduler.h"
+#include "uri_hash.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+
+// maximum size of a request head, the same limit the event loop peeks with
+#define HEAD_MAX 2048
+// buckets of the table of URIs with queued, running or held requests
+#define BUCKETS 256
+// deficit a URI's queue gains per visit. costs are capped at one quantum, so
+// every visit serves at least one request
+#define QUANTUM (256 * 1024)
+// estimated cost of a GET, whose size is not known before its file is opened
+#define READ_COST (16 * 1024)
+// estimated cost of a request that is answered without touching a file
+#define OTHER_COST 1024
+
+// quanta a class gains per visit, reads get the larger share
+static const int class_weight[CLASS_COUNT] = { 4, 1, 1 };
+
+// a queued request
+typedef struct item {
+    void *elem;
+    sched_request_t req;
+    struct item *next;
+} item_t;
+
+typedef struct uri_entry uri_entry_t;
+
+// the queued requests of one class for one URI
+typedef struct flow {
+    uri_entry_t *owner;
+    item_t *head, *tail;
+    int64_t deficit;
+    bool granted; // got its quantum for the current visit
+    struct flow *prev, *next; // in the class's round robin while it has requests
+} flow_t;
+
+// one URI with queued, running or held requests
+struct uri_entry {
+    uint64_t key;
+    flow_t flows[CLASS_COUNT];
+    int queued; // requests in the flows
+    int serial_running; // serial requests being served
+    int holds; // writers waiting for or holding the URI's lock
+    struct uri_entry *next; // next entry in the same bucket
+};
+
+// one class's round robin over its URIs
+typedef struct sched_class_state {
+    flow_t *cursor; // flow being visited, NULL when the class has nothing queued
+    int flows; // flows in the round robin
+    int64_t deficit;
+    bool granted;
+} sched_class_state_t;
+
+// structure for the scheduler
+typedef struct scheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t runnable; // workers sleep here while nothing can run
+    pthread_cond_t not_full; // producers sleep here while the scheduler is full
+    int count; // requests queued
+    int capacity;
+    item_t *items; // capacity items, handed out from free_items
+    item_t *free_items;
+    uri_entry_t *buckets[BUCKETS];
+    sched_class_state_t classes[CLASS_COUNT];
+    int class_cursor; // class being visited
+} scheduler_t;
+
+scheduler_t *scheduler_new(int capacity) {
+    if (capacity <= 0) {
+        return NULL;
+    }
+    scheduler_t *s = calloc(1, sizeof(scheduler_t));
+    if (!s) {
+        return NULL;
+    }
+    s->items = calloc(capacity, sizeof(item_t));
+    if (!s->items) {
+        free(s);
+        return NULL;
+    }
+    s->capacity = capacity;
+    for (int i = 0; i < capacity; i++) {
+        s->items[i].next = s->free_items;
+        s->free_items = &s->items[i];
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->runnable, NULL);
+    pthread_cond_init(&s->not_full, NULL);
+    return s;
+}
+
+void scheduler_delete(scheduler_t **s) {
+    if (!s || !*s) {
+        return;
+    }
+    for (int i = 0; i < BUCKETS; i++) {
+        uri_entry_t *e = (*s)->buckets[i];
+        while (e) {
+            uri_entry_t *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free((*s)->items);
+    pthread_mutex_destroy(&(*s)->lock);
+    pthread_cond_destroy(&(*s)->runnable);
+    pthread_cond_destroy(&(*s)->not_full);
+    free(*s);
+    *s = NULL;
+}
+
+// finds the entry of a URI, creating it when create is set. returns NULL
+// when it does not exist or cannot be allocated
+static uri_entry_t *find_entry(scheduler_t *s, uint64_t key, bool create) {
+    uri_entry_t **bucket = &s->buckets[(key >> 8) & (BUCKETS - 1)];
+    for (uri_entry_t *e = *bucket; e; e = e->next) {
+        if (e->key == key) {
+            return e;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    uri_entry_t *e = calloc(1, sizeof(uri_entry_t));
+    if (!e) {
+        return NULL;
+    }
+    e->key = key;
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        e->flows[c].owner = e;
+    }
+    e->next = *bucket;
+    *bucket = e;
+    return e;
+}
+
+// frees an entry once nothing is queued, running or held for its URI
+static void drop_entry_if_idle(scheduler_t *s, uri_entry_t *e) {
+    if (e->queued > 0 || e->serial_running > 0 || e->holds > 0) {
+        return;
+    }
+    for (uri_entry_t **link = &s->buckets[(e->key >> 8) & (BUCKETS - 1)]; *link;
+         link = &(*link)->next) {
+        if (*link == e) {
+            *link = e->next;
+            free(e);
+            return;
+        }
+    }
+}
+
+// whether the request at the head of a flow may start now
+static bool flow_runnable(const flow_t *f) {
+    const uri_entry_t *e = f->owner;
+    return e->holds == 0 && !(f->head->req.serial && e->serial_running > 0);
+}
+
+// adds a flow that just got its first request to the end of its class's
+// round robin, right before the flow being visited
+static void ring_insert(sched_class_state_t *c, flow_t *f) {
+    c->flows++;
+    if (!c->cursor) {
+        f->prev = f->next = f;
+        c->cursor = f;
+        return;
+    }
+    f->next = c->cursor;
+    f->prev = c->cursor->prev;
+    f->prev->next = f;
+    c->cursor->prev = f;
+}
+
+// takes a flow that ran out of requests out of the round robin
+static void ring_remove(sched_class_state_t *c, flow_t *f) {
+    c->flows--;
+    if (f->next == f) {
+        c->cursor = NULL;
+    } else {
+        f->prev->next = f->next;
+        f->next->prev = f->prev;
+        if (c->cursor == f) {
+            c->cursor = f->next;
+        }
+    }
+    f->prev = f->next = NULL;
+    f->deficit = 0;
+    f->granted = false;
+}
+
+// moves a class's round robin to the flow that serves next and returns it,
+// or NULL if none of its flows can run. a flow that cannot run loses its
+// deficit like an empty one would, so a held URI saves up no extra share
+static flow_t *next_flow(sched_class_state_t *c) {
+    // a freshly granted flow can always pay for its head, so every flow is
+    // visited at most twice before one serves
+    for (int visits = 0; visits < 2 * c->flows; visits++) {
+        flow_t *f = c->cursor;
+        if (!flow_runnable(f)) {
+            f->deficit = 0;
+            f->granted = false;
+            c->cursor = f->next;
+            continue;
+        }
+        if (!f->granted) {
+            f->deficit += QUANTUM;
+            f->granted = true;
+        }
+        if (f->head->req.cost <= f->deficit) {
+            return f;
+        }
+        f->granted = false;
+        c->cursor = f->next;
+    }
+    return NULL;
+}
+
+// takes the next request in deficit round robin order over the classes and,
+// within the chosen class, over its URIs. returns NULL if nothing can run
+static item_t *pick(scheduler_t *s) {
+    for (int visits = 0; visits <= 2 * CLASS_COUNT; visits++) {
+        sched_class_state_t *c = &s->classes[s->class_cursor];
+        flow_t *f = next_flow(c);
+        if (!f) {
+            c->deficit = 0;
+            c->granted = false;
+            s->class_cursor = (s->class_cursor + 1) % CLASS_COUNT;
+            continue;
+        }
+        if (!c->granted) {
+            c->deficit += (int64_t) class_weight[s->class_cursor] * QUANTUM;
+            c->granted = true;
+        }
+        item_t *it = f->head;
+        if (it->req.cost > c->deficit) {
+            c->granted = false;
+            s->class_cursor = (s->class_cursor + 1) % CLASS_COUNT;
+            continue;
+        }
+        c->deficit -= it->req.cost;
+        f->deficit -= it->req.cost;
+
+        f->head = it->next;
+        if (!f->head) {
+            f->tail = NULL;
+            ring_remove(c, f);
+        }
+        uri_entry_t *e = f->owner;
+        e->queued--;
+        if (it->req.serial) {
+            e->serial_running++;
+        }
+        return it;
+    }
+    return NULL;
+}
+
+bool scheduler_push(scheduler_t *s, void *elem, const sched_request_t *req) {
+    pthread_mutex_lock(&s->lock);
+    while (s->count == s->capacity) {
+        pthread_cond_wait(&s->not_full, &s->lock);
+    }
+    uri_entry_t *e = find_entry(s, req->key, true);
+    if (!e) {
+        pthread_mutex_unlock(&s->lock);
+        return false;
+    }
+    item_t *it = s->free_items;
+    s->free_items = it->next;
+    it->elem = elem;
+    it->req = *req;
+    it->next = NULL;
+
+    flow_t *f = &e->flows[req->cls];
+    if (f->tail) {
+        f->tail->next = it;
+    } else {
+        f->head = it;
+        ring_insert(&s->classes[req->cls], f);
+    }
+    f->tail = it;
+    e->queued++;
+    s->count++;
+    pthread_cond_signal(&s->runnable);
+    pthread_mutex_unlock(&s->lock);
+    return true;
+}
+
+bool scheduler_pop(scheduler_t *s, void **elem) {
+    pthread_mutex_lock(&s->lock);
+    item_t *it;
+    while (!(it = pick(s))) {
+        pthread_cond_wait(&s->runnable, &s->lock);
+    }
+    *elem = it->elem;
+    it->next = s->free_items;
+    s->free_items = it;
+    s->count--;
+    // taking a URI's head may have made the request behind it runnable, which
+    // no push or release announces
+    if (s->count > 0) {
+        pthread_cond_signal(&s->runnable);
+    }
+    pthread_cond_signal(&s->not_full);
+    pthread_mutex_unlock(&s->lock);
+    return true;
+}
+
+void scheduler_done(scheduler_t *s, const sched_request_t *req) {
+    if (!req->serial) {
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    uri_entry_t *e = find_entry(s, req->key, false);
+    if (e) {
+        e->serial_running--;
+        if (e->queued > 0) {
+            pthread_cond_broadcast(&s->runnable);
+        }
+        drop_entry_if_idle(s, e);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+bool scheduler_hold(scheduler_t *s, uint64_t key) {
+    pthread_mutex_lock(&s->lock);
+    uri_entry_t *e = find_entry(s, key, true);
+    if (e) {
+        e->holds++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return e != NULL;
+}
+
+void scheduler_release(scheduler_t *s, uint64_t key) {
+    pthread_mutex_lock(&s->lock);
+    uri_entry_t *e = find_entry(s, key, false);
+    if (e) {
+        e->holds--;
+        if (e->queued > 0) {
+            pthread_cond_broadcast(&s->runnable);
+        }
+        drop_entry_if_idle(s, e);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// finds a header in a request head and returns its value without leading
+// whitespace, or NULL. the value ends at the next \r
+static const char *find_header(const char *head, const char *name) {
+    size_t len = strlen(name);
+    for (const char *line = strstr(head, "\r\n"); line && line[2] != '\0';
+         line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, name, len) == 0 && line[2 + len] == ':') {
+            const char *value = line + 3 + len;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+void scheduler_classify(int fd, sched_request_t *req) {
+    *req = (sched_request_t) { CLASS_OTHER, 0, OTHER_COST, false };
+
+    char head[HEAD_MAX + 1];
+    ssize_t n;
+    do {
+        n = recv(fd, head, HEAD_MAX, MSG_PEEK | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return;
+    }
+    head[n] = '\0';
+    char *end = strstr(head, "\r\n\r\n");
+    if (!end) {
+        return;
+    }
+    end[2] = '\0'; // keeps the last header line's \r\n for find_header
+
+    // the key is the target as the handlers see it, without the leading '/'
+    char *target = strchr(head, ' ');
+    char *line_end = strstr(head, "\r\n");
+    if (!target || target > line_end || target[1] != '/') {
+        return;
+    }
+    char *target_end = memchr(target + 1, ' ', line_end - target - 1);
+    if (!target_end) {
+        return;
+    }
+    *target_end = '\0';
+    req->key = uri_hash(target + 2);
+
+    size_t method_len = target - head;
+    if ((method_len == 3 && memcmp(head, "GET", 3) == 0)
+        || (method_len == 4 && memcmp(head, "HEAD", 4) == 0)) {
+        req->cls = CLASS_READ;
+        req->cost = READ_COST;
+    } else if (method_len == 3 && memcmp(head, "PUT", 3) == 0) {
+        // a body of unknown length is charged as the largest
+        req->cls = CLASS_WRITE;
+        req->cost = QUANTUM;
+        const char *length = find_header(line_end, "Content-Length");
+        if (length && !find_header(line_end, "Transfer-Encoding")) {
+            unsigned long long bytes = strtoull(length, NULL, 10);
+            req->cost = bytes < OTHER_COST ? OTHER_COST : bytes < QUANTUM ? bytes : QUANTUM;
+        }
+        req->serial = !find_header(line_end, "Content-Range");
+    }
+}
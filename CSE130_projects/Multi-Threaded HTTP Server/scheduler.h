@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// request scheduler that replaces the FIFO request queue in event mode (-R).
+// every request is classified from its peeked head and queued by class and
+// by URI. workers take requests in deficit round robin order, first over the
+// classes, weighted towards reads, then over the URIs queued in a class, so
+// a burst of requests for one URI or of one kind gets its share and no more.
+// a URI's requests are held back while one of its PUTs waits for or holds
+// the writer lock, and whole-body PUTs of a URI run one at a time, so
+// workers take runnable requests for other URIs instead of sleeping in the
+// URI's rwlock.
+typedef struct scheduler scheduler_t;
+
+// classes of requests, each with its own round robin of per-URI queues
+typedef enum {
+    CLASS_READ, // GET and HEAD
+    CLASS_WRITE, // PUT
+    CLASS_OTHER, // anything else, or a head that could not be read
+    CLASS_COUNT
+} sched_class_t;
+
+// what the scheduler knows about a request before a worker parses it
+typedef struct sched_request {
+    sched_class_t cls;
+    uint64_t key; // uri_hash of the target without its leading '/'
+    uint32_t cost; // estimated work in bytes, at most one quantum
+    bool serial; // runs only while no other serial request of its URI does
+} sched_request_t;
+
+// creates a scheduler that holds up to capacity requests
+scheduler_t *scheduler_new(int capacity);
+
+// frees the scheduler and the requests still queued in it
+void scheduler_delete(scheduler_t **s);
+
+// classifies the request whose head is buffered on fd, without consuming or
+// waiting for anything. a whole-body PUT is serial, one sent in parts with
+// Content-Range is not
+void scheduler_classify(int fd, sched_request_t *req);
+
+// queues elem as a request described by req, blocking while the scheduler is
+// full. returns false if the URI's queues cannot be allocated
+bool scheduler_push(scheduler_t *s, void *elem, const sched_request_t *req);
+
+// takes the next request to serve, blocking until one is runnable
+bool scheduler_pop(scheduler_t *s, void **elem);
+
+// a worker has finished serving a request taken with scheduler_pop
+void scheduler_done(scheduler_t *s, const sched_request_t *req);
+
+// holds back the requests of a URI while the caller waits for and holds its
+// writer lock. returns false if the hold could not be recorded, in which
+// case scheduler_release must not be called
+bool scheduler_hold(scheduler_t *s, uint64_t key);
+
+// lets the requests held back by scheduler_hold run again
+void scheduler_release(scheduler_t *s, uint64_t key);
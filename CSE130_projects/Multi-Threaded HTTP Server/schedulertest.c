@@ -0,0 +1,168 @@
+// tests the deficit round robin of scheduler.c: the order requests are taken
+// in across classes and URIs, holds, serial PUTs and the classification of
+// request heads. "schedulertest -v" prints the order of every run
+
+#include "scheduler.h"
+#include "uri_hash.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// the scheduler's quantum and the cost it charges a GET
+#define QUANTUM (256 * 1024)
+#define READ_COST (16 * 1024)
+
+static bool verbose;
+
+// queues count requests named by letter, the letter is what a pop returns
+static void push(scheduler_t *s, char *letter, sched_class_t cls, uint64_t key, uint32_t cost,
+    int count) {
+    sched_request_t req = { cls, key, cost, false };
+    for (int i = 0; i < count; i++) {
+        assert(scheduler_push(s, letter, &req));
+    }
+}
+
+// pops every queued request and checks their order
+static void check_order(scheduler_t *s, const char *expected) {
+    char order[256];
+    size_t len = strlen(expected);
+    assert(len < sizeof(order));
+    for (size_t i = 0; i < len; i++) {
+        void *elem;
+        assert(scheduler_pop(s, &elem));
+        order[i] = *(char *) elem;
+    }
+    order[len] = '\0';
+    if (verbose) {
+        printf("%s\n", order);
+    }
+    assert(strcmp(order, expected) == 0);
+}
+
+// reads get four quanta for every one of writes
+static void test_classes(void) {
+    static char read = 'R', write = 'W';
+    scheduler_t *s = scheduler_new(64);
+    assert(s);
+    push(s, &read, CLASS_READ, 1, QUANTUM, 8);
+    push(s, &write, CLASS_WRITE, 2, QUANTUM, 8);
+    check_order(s, "RRRRWRRRRWWWWWWW");
+    scheduler_delete(&s);
+}
+
+// the URIs of a class take turns, each for a quantum's worth of requests
+static void test_uris(void) {
+    static char a = 'A', b = 'B';
+    scheduler_t *s = scheduler_new(64);
+    assert(s);
+    push(s, &a, CLASS_READ, 1, QUANTUM, 3);
+    push(s, &b, CLASS_READ, 2, QUANTUM, 3);
+    check_order(s, "ABABAB");
+
+    push(s, &a, CLASS_READ, 1, READ_COST, 20);
+    push(s, &b, CLASS_READ, 2, READ_COST, 20);
+    check_order(s, "AAAAAAAAAAAAAAAABBBBBBBBBBBBBBBBAAAABBBB");
+    scheduler_delete(&s);
+}
+
+// a held URI is passed over until it is released
+static void test_hold(void) {
+    static char a = 'A', b = 'B';
+    scheduler_t *s = scheduler_new(64);
+    assert(s);
+    assert(scheduler_hold(s, 1));
+    push(s, &a, CLASS_READ, 1, READ_COST, 2);
+    push(s, &b, CLASS_READ, 2, READ_COST, 1);
+    check_order(s, "B");
+    scheduler_release(s, 1);
+    check_order(s, "AA");
+    scheduler_delete(&s);
+}
+
+// pops one request and flags that it got it
+typedef struct popper {
+    scheduler_t *s;
+    bool popped;
+} popper_t;
+
+static void *pop_one(void *arg) {
+    popper_t *p = arg;
+    void *elem;
+    assert(scheduler_pop(p->s, &elem));
+    __atomic_store_n(&p->popped, true, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+// a serial PUT waits for the one before it on its URI, others do not
+static void test_serial(void) {
+    static char put = 'P', get = 'G';
+    scheduler_t *s = scheduler_new(64);
+    assert(s);
+    sched_request_t req = { CLASS_WRITE, 1, 5000, true };
+    assert(scheduler_push(s, &put, &req));
+    assert(scheduler_push(s, &put, &req));
+    push(s, &get, CLASS_READ, 1, READ_COST, 1);
+    check_order(s, "GP");
+
+    popper_t p = { s, false };
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, pop_one, &p) == 0);
+    usleep(100 * 1000);
+    assert(!__atomic_load_n(&p.popped, __ATOMIC_SEQ_CST));
+    scheduler_done(s, &req);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(p.popped);
+    scheduler_done(s, &req);
+    scheduler_delete(&s);
+}
+
+// classifies a request head sent over a socket
+static sched_request_t classify(const char *head) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert(write(sv[0], head, strlen(head)) == (ssize_t) strlen(head));
+    sched_request_t req;
+    scheduler_classify(sv[1], &req);
+    // the head is only peeked at
+    char buf[256];
+    assert(recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT) == (ssize_t) strlen(head));
+    close(sv[0]);
+    close(sv[1]);
+    return req;
+}
+
+static void test_classify(void) {
+    sched_request_t req = classify("PUT /a HTTP/1.1\r\nContent-Length: 5000\r\n\r\n");
+    assert(req.cls == CLASS_WRITE && req.key == uri_hash("a") && req.cost == 5000 && req.serial);
+
+    req = classify("PUT /a HTTP/1.1\r\nContent-Length: 9999999\r\n"
+                   "Content-Range: bytes 0-9/10\r\n\r\n");
+    assert(req.cls == CLASS_WRITE && req.cost == QUANTUM && !req.serial);
+
+    req = classify("HEAD /dir/b HTTP/1.1\r\n\r\n");
+    assert(req.cls == CLASS_READ && req.key == uri_hash("dir/b") && req.cost == READ_COST);
+
+    req = classify("GET /a HTTP/1.1\r\nHost: x\r\n"); // head not complete yet
+    assert(req.cls == CLASS_OTHER && !req.serial);
+    req = classify("DELETE /a HTTP/1.1\r\n\r\n");
+    assert(req.cls == CLASS_OTHER && !req.serial);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    test_classes();
+    test_uris();
+    test_hold();
+    test_serial();
+    test_classify();
+    printf("schedulertest: all tests passed\n");
+    return 0;
+}
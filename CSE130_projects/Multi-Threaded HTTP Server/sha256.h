@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 (FIPS 180-4), used to name stored blobs by their contents
+#define SHA256_DIGEST 32
+
+// running state of one hash, lives wherever the caller keeps it
+typedef struct sha256 {
+    uint32_t state[8];
+    uint64_t length; // bytes hashed so far
+    uint8_t block[64]; // partial block not yet compressed
+    size_t used; // bytes in block
+} sha256_t;
+
+// starts a new hash
+void sha256_init(sha256_t *h);
+
+// adds len bytes to the hash
+void sha256_update(sha256_t *h, const void *data, size_t len);
+
+// finishes the hash and writes the digest
+void sha256_final(sha256_t *h, uint8_t digest[SHA256_DIGEST]);
@@ -0,0 +1,88 @@
+// tests sha256.c against the FIPS 180-4 example messages and checks that the
+// digest does not depend on how the input is split into updates.
+// "sha256test -v" prints every digest
+
+#include "sha256.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool verbose;
+
+// hashes len bytes of data in pieces of at most step bytes into a hex digest
+static void hex_digest(
+    const void *data, size_t len, size_t step, char hex[2 * SHA256_DIGEST + 1]) {
+    sha256_t h;
+    sha256_init(&h);
+    for (size_t off = 0; off < len; off += step) {
+        sha256_update(&h, (const char *) data + off, len - off < step ? len - off : step);
+    }
+    uint8_t digest[SHA256_DIGEST];
+    sha256_final(&h, digest);
+    for (int i = 0; i < SHA256_DIGEST; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+}
+
+static void check(const void *data, size_t len, const char *expected) {
+    char hex[2 * SHA256_DIGEST + 1];
+    hex_digest(data, len, len ? len : 1, hex);
+    if (verbose) {
+        printf("%s\n", hex);
+    }
+    assert(strcmp(hex, expected) == 0);
+}
+
+// the examples of FIPS 180-4 and the NIST test vectors. the two longer
+// messages need a second block for their padding
+static void test_vectors(void) {
+    check("", 0, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    check("abc", 3, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    static const char *two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    check(two_blocks, strlen(two_blocks),
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    static const char *long_message
+        = "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqr"
+          "lmnopqrsmnopqrstnopqrstu";
+    check(long_message, strlen(long_message),
+        "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+
+    size_t million = 1000000;
+    char *a = malloc(million);
+    assert(a);
+    memset(a, 'a', million);
+    check(a, million, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    free(a);
+}
+
+// any split of the input into updates gives the digest of the whole
+static void test_splits(void) {
+    static char data[1000];
+    srand(1);
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char) rand();
+    }
+    for (size_t len = 0; len <= 200; len++) {
+        char whole[2 * SHA256_DIGEST + 1], split[2 * SHA256_DIGEST + 1];
+        hex_digest(data, len, len ? len : 1, whole);
+        for (size_t step = 1; step <= 130; step++) {
+            hex_digest(data, len, step, split);
+            assert(strcmp(whole, split) == 0);
+        }
+    }
+    if (verbose) {
+        printf("splits: every split of up to 200 bytes agrees\n");
+    }
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    test_vectors();
+    test_splits();
+    printf("sha256test: all tests passed\n");
+    return 0;
+}
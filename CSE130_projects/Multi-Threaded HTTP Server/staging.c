@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include "staging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// resolution of the reaper, abandoned uploads go at most this late
+#define REAP_TICK_MS 1000
+
+// structure for the staging table. there are few uploads in flight at a
+// time, so they are kept in one list under one mutex
+typedef struct staging {
+    int timeout_ms;
+    off_t max_total;
+    pthread_mutex_t lock;
+    staged_upload_t *head;
+    // an upload without writers waits in the wheel until it times out
+    timer_wheel_t *wheel;
+    pthread_t reaper;
+    pthread_cond_t stop_cond;
+    bool stop;
+    bool running; // the reaper thread was started
+} staging_t;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// drops an unfinished upload and its staging file
+static void discard(staged_upload_t *u) {
+    unlink(u->path);
+    close(u->fd);
+    staged_upload_delete(&u);
+}
+
+// an upload went timeout_ms without a part, called with the table locked
+static void expire(wheel_timer_t *timer, void *arg) {
+    staging_t *s = arg;
+    staged_upload_t *u = (staged_upload_t *) timer;
+    for (staged_upload_t **link = &s->head; *link; link = &(*link)->next) {
+        if (*link == u) {
+            *link = u->next;
+            break;
+        }
+    }
+    discard(u);
+}
+
+// advances the wheel once per tick until staging_delete
+static void *reaper_thread(void *arg) {
+    staging_t *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += REAP_TICK_MS / 1000;
+        pthread_cond_timedwait(&s->stop_cond, &s->lock, &ts);
+        timer_wheel_advance(s->wheel, now_ms(), expire, s);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+staging_t *staging_new(int timeout_ms, off_t max_total) {
+    staging_t *s = calloc(1, sizeof(staging_t));
+    if (!s) {
+        return NULL;
+    }
+    s->timeout_ms = timeout_ms;
+    s->max_total = max_total;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->stop_cond, NULL);
+    s->wheel = timer_wheel_new(now_ms(), REAP_TICK_MS);
+    if (s->wheel && pthread_create(&s->reaper, NULL, reaper_thread, s) == 0) {
+        s->running = true;
+        return s;
+    }
+    staging_delete(&s);
+    return NULL;
+}
+
+void staging_delete(staging_t **s) {
+    if (!s || !*s) {
+        return;
+    }
+    pthread_mutex_lock(&(*s)->lock);
+    (*s)->stop = true;
+    pthread_cond_signal(&(*s)->stop_cond);
+    pthread_mutex_unlock(&(*s)->lock);
+    if ((*s)->running) {
+        pthread_join((*s)->reaper, NULL);
+    }
+
+    staged_upload_t *u = (*s)->head;
+    while (u) {
+        staged_upload_t *next = u->next;
+        discard(u);
+        u = next;
+    }
+    timer_wheel_delete(&(*s)->wheel);
+    pthread_mutex_destroy(&(*s)->lock);
+    pthread_cond_destroy(&(*s)->stop_cond);
+    free(*s);
+    *s = NULL;
+}
+
+void staged_upload_delete(staged_upload_t **u) {
+    if (!u || !*u) {
+        return;
+    }
+    free((*u)->spans);
+    free((*u)->uri);
+    free(*u);
+    *u = NULL;
+}
+
+// creates the staging file of uri in the URI's directory, so it can be
+// renamed into place, and sizes it so parts can be written in any order.
+// the file is sparse, blocks are only taken as parts arrive
+static staged_upload_t *create_upload(const char *uri, off_t total) {
+    staged_upload_t *u = calloc(1, sizeof(staged_upload_t));
+    if (!u) {
+        return NULL;
+    }
+    u->uri = strdup(uri);
+    const char *slash = strrchr(uri, '/');
+    int dir_len = slash ? (int) (slash - uri + 1) : 0;
+    if (!u->uri
+        || snprintf(u->path, sizeof(u->path), "%.*s.httpserver_XXXXXX", dir_len, uri)
+               >= (int) sizeof(u->path)) {
+        staged_upload_delete(&u);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    u->fd = mkstemp(u->path);
+    if (u->fd < 0) {
+        staged_upload_delete(&u);
+        return NULL;
+    }
+
+    if (ftruncate(u->fd, total) != 0) {
+        int saved = errno;
+        discard(u);
+        errno = saved;
+        return NULL;
+    }
+    u->total = total;
+    return u;
+}
+
+staged_upload_t *staging_join(staging_t *s, const char *uri, off_t total) {
+    if (total > s->max_total) {
+        errno = EFBIG;
+        return NULL;
+    }
+    pthread_mutex_lock(&s->lock);
+    staged_upload_t *found = NULL;
+    for (staged_upload_t *u = s->head; u && !found; u = u->next) {
+        if (strcmp(u->uri, uri) == 0) {
+            found = u;
+        }
+    }
+
+    if (found && found->total != total) {
+        pthread_mutex_unlock(&s->lock);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!found) {
+        found = create_upload(uri, total);
+        if (!found) {
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+        found->next = s->head;
+        s->head = found;
+    }
+    // a part is in flight, the upload is not abandoned
+    timer_wheel_cancel(s->wheel, &found->timer);
+    found->writers++;
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+// records [start, end) as received, merging it with the spans it overlaps or touches
+static bool add_span(staged_upload_t *u, off_t start, off_t end) {
+    size_t i = 0;
+    while (i < u->span_count && u->spans[i].end < start) {
+        i++;
+    }
+    size_t j = i;
+    while (j < u->span_count && u->spans[j].start <= end) {
+        if (u->spans[j].start < start) {
+            start = u->spans[j].start;
+        }
+        if (u->spans[j].end > end) {
+            end = u->spans[j].end;
+        }
+        j++;
+    }
+
+    if (i == j) {
+        // nothing to merge with, a new span goes in at i
+        if (u->span_count == u->span_cap) {
+            size_t cap = u->span_cap ? u->span_cap * 2 : 8;
+            byte_span_t *grown = realloc(u->spans, cap * sizeof(byte_span_t));
+            if (!grown) {
+                return false;
+            }
+            u->spans = grown;
+            u->span_cap = cap;
+        }
+        memmove(&u->spans[i + 1], &u->spans[i], (u->span_count - i) * sizeof(byte_span_t));
+        u->span_count++;
+    } else {
+        // spans i to j - 1 collapse into one
+        memmove(&u->spans[i + 1], &u->spans[j], (u->span_count - j) * sizeof(byte_span_t));
+        u->span_count -= j - i - 1;
+    }
+    u->spans[i] = (byte_span_t) { start, end };
+    return true;
+}
+
+bool staging_leave(staging_t *s, staged_upload_t *u, off_t start, off_t end, bool ok) {
+    pthread_mutex_lock(&s->lock);
+    u->writers--;
+    if (ok) {
+        add_span(u, start, end);
+    }
+    bool complete = u->span_count == 1 && u->spans[0].start == 0 && u->spans[0].end == u->total;
+    if (!complete || u->writers > 0) {
+        if (u->writers == 0) {
+            timer_wheel_add(s->wheel, &u->timer, now_ms() + s->timeout_ms);
+        }
+        pthread_mutex_unlock(&s->lock);
+        return false;
+    }
+
+    // the last writer of a complete upload takes it out for publishing
+    for (staged_upload_t **link = &s->head; *link; link = &(*link)->next) {
+        if (*link == u) {
+            *link = u->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    u->next = NULL;
+    return true;
+}
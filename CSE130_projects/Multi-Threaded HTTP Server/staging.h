@@ -0,0 +1,63 @@
+#pragma once
+
+#include "timer_wheel.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// staging of uploads sent in parts. a client may PUT byte ranges of the
+// same URI over several connections at once, each with a Content-Range
+// header carrying the total size. the first part creates a staging file of
+// that size next to the URI and every part writes its bytes at its own
+// offset through its own descriptor. the received ranges are tracked, and
+// once they cover the whole file and no part is still being written, the
+// part that finished last takes the upload out of the table and publishes
+// it like the temp file of an ordinary PUT. uploads that stop receiving
+// parts are removed by a reaper thread after a timeout. the staging file is
+// sparse and uploads larger than a limit are refused, so a client cannot
+// reserve space it does not send.
+typedef struct staging staging_t;
+
+// a range of received bytes, [start, end)
+typedef struct byte_span {
+    off_t start, end;
+} byte_span_t;
+
+// one upload being staged
+typedef struct staged_upload {
+    wheel_timer_t timer; // pending while no part is being written
+    char path[PATH_MAX]; // staging file, next to the URI
+    int fd; // descriptor of the staging file, handed to the publisher
+    off_t total; // size of the finished file
+    // the rest belongs to the staging table
+    char *uri;
+    int writers; // parts being written
+    byte_span_t *spans; // received bytes, sorted, disjoint and not adjacent
+    size_t span_count, span_cap;
+    struct staged_upload *next;
+} staged_upload_t;
+
+// creates an empty table and starts its reaper. uploads without a part in
+// flight for timeout_ms are dropped, uploads of more than max_total bytes
+// are refused
+staging_t *staging_new(int timeout_ms, off_t max_total);
+
+// frees the table and removes the staging files of unfinished uploads
+void staging_delete(staging_t **s);
+
+// joins the upload of uri with the given total size, creating its staging
+// file on first use, to write one part. returns NULL with errno EFBIG if
+// total is over the limit, EINVAL if an upload of uri with another total
+// size is under way, or with the errno of the failed creation
+staged_upload_t *staging_join(staging_t *s, const char *uri, off_t total);
+
+// leaves the upload after writing the part [start, end), which is counted
+// only if ok. returns true if the caller has to publish the upload: it is
+// complete and no other part is being written. it is then out of the table,
+// owned by the caller and freed with staged_upload_delete
+bool staging_leave(staging_t *s, staged_upload_t *u, off_t start, off_t end, bool ok);
+
+// frees an upload taken out of the table. the staging file and its
+// descriptor are left to the publisher
+void staged_upload_delete(staged_upload_t **u);
@@ -0,0 +1,148 @@
+// tests staging.c in a fresh temporary directory: the size checks of joining,
+// how the received spans merge, which part publishes an upload and the
+// reaping of abandoned ones. "stagingtest -v" prints the spans after each part
+
+#include "staging.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool verbose;
+
+// checks the spans of u against pairs of offsets ending in -1
+static void check_spans(const staged_upload_t *u, const off_t *expected) {
+    if (verbose) {
+        for (size_t i = 0; i < u->span_count; i++) {
+            printf("[%lld, %lld) ", (long long) u->spans[i].start, (long long) u->spans[i].end);
+        }
+        printf("\n");
+    }
+    size_t i = 0;
+    for (; expected[2 * i] >= 0; i++) {
+        assert(i < u->span_count);
+        assert(u->spans[i].start == expected[2 * i] && u->spans[i].end == expected[2 * i + 1]);
+    }
+    assert(i == u->span_count);
+}
+
+static bool exists(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+// the staging file is sized on join, parts of another size are refused
+static void test_join(void) {
+    staging_t *s = staging_new(60000, 1000);
+    assert(s);
+    staged_upload_t *u = staging_join(s, "sized", 1000);
+    assert(u);
+    struct stat st;
+    assert(fstat(u->fd, &st) == 0 && st.st_size == 1000);
+    assert(strncmp(u->path, ".httpserver_", 12) == 0);
+
+    errno = 0;
+    assert(!staging_join(s, "sized", 999) && errno == EINVAL);
+    errno = 0;
+    assert(!staging_join(s, "big", 1001) && errno == EFBIG);
+    assert(staging_join(s, "sized", 1000) == u);
+
+    assert(!staging_leave(s, u, 0, 10, true));
+    assert(!staging_leave(s, u, 10, 20, true));
+    // the file of the unfinished upload goes with the table
+    char path[PATH_MAX];
+    strcpy(path, u->path);
+    staging_delete(&s);
+    assert(!exists(path));
+}
+
+// spans merge when they overlap or touch, failed parts are not counted
+static void test_spans(void) {
+    staging_t *s = staging_new(60000, 1000);
+    assert(s);
+    // a part held open throughout keeps the upload in the table, so its
+    // spans can be looked at between the others
+    staged_upload_t *u = staging_join(s, "spans", 10);
+    assert(u);
+
+    assert(staging_join(s, "spans", 10) == u);
+    assert(!staging_leave(s, u, 6, 10, true));
+    check_spans(u, (off_t[]) { 6, 10, -1 });
+    assert(staging_join(s, "spans", 10) == u);
+    assert(!staging_leave(s, u, 0, 2, true));
+    check_spans(u, (off_t[]) { 0, 2, 6, 10, -1 });
+    assert(staging_join(s, "spans", 10) == u);
+    assert(!staging_leave(s, u, 2, 4, false));
+    check_spans(u, (off_t[]) { 0, 2, 6, 10, -1 });
+    assert(staging_join(s, "spans", 10) == u);
+    assert(!staging_leave(s, u, 3, 6, true));
+    check_spans(u, (off_t[]) { 0, 2, 3, 10, -1 });
+    // complete now, but the held part is still being written
+    assert(staging_join(s, "spans", 10) == u);
+    assert(!staging_leave(s, u, 1, 4, true));
+    check_spans(u, (off_t[]) { 0, 10, -1 });
+
+    // the last part to leave publishes, even one that failed
+    assert(staging_leave(s, u, 0, 0, false));
+    assert(exists(u->path));
+    unlink(u->path);
+    close(u->fd);
+    staged_upload_delete(&u);
+    assert(!u);
+
+    // the URI is free for a new upload of another size
+    u = staging_join(s, "spans", 20);
+    assert(u);
+    assert(staging_leave(s, u, 0, 20, true));
+    unlink(u->path);
+    close(u->fd);
+    staged_upload_delete(&u);
+    staging_delete(&s);
+}
+
+// uploads without a part in flight are reaped after the timeout, only those
+static void test_reaper(void) {
+    staging_t *s = staging_new(100, 1000);
+    assert(s);
+    staged_upload_t *idle = staging_join(s, "idle", 100);
+    staged_upload_t *busy = staging_join(s, "busy", 100);
+    assert(idle && busy);
+    char idle_path[PATH_MAX];
+    strcpy(idle_path, idle->path);
+    assert(!staging_leave(s, idle, 0, 50, true));
+
+    // the reaper ticks once a second
+    usleep(2500 * 1000);
+    assert(!exists(idle_path));
+    assert(exists(busy->path));
+    assert(!staging_leave(s, busy, 0, 50, true));
+
+    // a new upload of the reaped URI starts from nothing
+    idle = staging_join(s, "idle", 100);
+    assert(idle && idle->span_count == 0);
+    assert(!staging_leave(s, idle, 0, 0, false));
+    staging_delete(&s);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+    // staging files are created next to the URI, here in a directory of our own
+    char dir[] = "/tmp/stagingtest_XXXXXX";
+    assert(mkdtemp(dir));
+    assert(chdir(dir) == 0);
+
+    test_join();
+    test_spans();
+    test_reaper();
+
+    assert(chdir("/") == 0);
+    assert(rmdir(dir) == 0);
+    printf("stagingtest: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+
+#define LEVELS 4
+#define SLOT_BITS 6
+#define SLOTS (1 << SLOT_BITS)
+#define SLOT_MASK (SLOTS - 1)
+// furthest a timer can be placed, later ones are clamped and placed again on cascade
+#define MAX_DELTA ((1ULL << (LEVELS * SLOT_BITS)) - 1)
+
+// structure for the timer wheel
+typedef struct timer_wheel {
+    unsigned tick_ms;
+    uint64_t now; // next tick to process, every earlier one has been
+    wheel_timer_t *slots[LEVELS][SLOTS];
+} timer_wheel_t;
+
+timer_wheel_t *timer_wheel_new(uint64_t now_ms, unsigned tick_ms) {
+    timer_wheel_t *w = calloc(1, sizeof(timer_wheel_t));
+    if (!w) {
+        return NULL;
+    }
+    w->tick_ms = tick_ms ? tick_ms : 1;
+    w->now = now_ms / w->tick_ms;
+    return w;
+}
+
+void timer_wheel_delete(timer_wheel_t **w) {
+    if (!w || !*w) {
+        return;
+    }
+    free(*w);
+    *w = NULL;
+}
+
+// links a timer into the slot its distance from now calls for. a timer at
+// level l has between 64^l and 64^(l+1) ticks to go and sits in the slot of
+// its expiry at that level, which is reached exactly when the lower levels
+// wrap to it
+static void place(timer_wheel_t *w, wheel_timer_t *timer) {
+    uint64_t expires = timer->expires > w->now ? timer->expires : w->now;
+    uint64_t delta = expires - w->now;
+    if (delta > MAX_DELTA) {
+        expires = w->now + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ULL << ((level + 1) * SLOT_BITS))) {
+        level++;
+    }
+    wheel_timer_t **slot = &w->slots[level][(expires >> (level * SLOT_BITS)) & SLOT_MASK];
+
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    timer->slot = slot;
+}
+
+// unlinks a timer from its slot
+static void unlink_timer(wheel_timer_t *timer) {
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->slot = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = NULL;
+    timer->slot = NULL;
+}
+
+bool timer_pending(const wheel_timer_t *timer) {
+    return timer->slot != NULL;
+}
+
+void timer_wheel_add(timer_wheel_t *w, wheel_timer_t *timer, uint64_t expires_ms) {
+    if (timer->slot) {
+        unlink_timer(timer);
+    }
+    // rounded up, so a timer never fires early
+    timer->expires = (expires_ms + w->tick_ms - 1) / w->tick_ms;
+    place(w, timer);
+}
+
+void timer_wheel_cancel(timer_wheel_t *w, wheel_timer_t *timer) {
+    (void) w;
+    if (timer->slot) {
+        unlink_timer(timer);
+    }
+}
+
+// moves every timer of a coarse slot down to the level its distance now calls for
+static void cascade(timer_wheel_t *w, int level) {
+    wheel_timer_t **slot = &w->slots[level][(w->now >> (level * SLOT_BITS)) & SLOT_MASK];
+    wheel_timer_t *timer = *slot;
+    *slot = NULL;
+    while (timer) {
+        wheel_timer_t *next = timer->next;
+        place(w, timer);
+        timer = next;
+    }
+}
+
+void timer_wheel_advance(timer_wheel_t *w, uint64_t now_ms, timer_expire_t expire, void *arg) {
+    uint64_t target = now_ms / w->tick_ms;
+    for (; w->now <= target; w->now++) {
+        // coarse slots whose turn has come are spread out first, highest level first
+        for (int level = LEVELS - 1; level > 0; level--) {
+            if ((w->now & ((1ULL << (level * SLOT_BITS)) - 1)) == 0) {
+                cascade(w, level);
+            }
+        }
+
+        // the callback may add timers again, so the slot is drained one by one
+        wheel_timer_t **slot = &w->slots[0][w->now & SLOT_MASK];
+        while (*slot && (*slot)->expires <= w->now) {
+            wheel_timer_t *timer = *slot;
+            unlink_timer(timer);
+            expire(timer, arg);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// a timer embedded in the object it belongs to. the wheel links it into a slot
+// list, so adding and cancelling never allocate and cancelling is O(1)
+typedef struct wheel_timer {
+    uint64_t expires; // tick at which the timer fires
+    struct wheel_timer *prev, *next;
+    struct wheel_timer **slot; // head of the slot it is linked into, NULL if not pending
+} wheel_timer_t;
+
+// hierarchical timer wheel: 4 levels of 64 slots, each level 64 times coarser
+// than the one below. timers far out sit in a coarse slot and are moved down
+// as their time comes closer. not thread safe, callers serialize access.
+typedef struct timer_wheel timer_wheel_t;
+
+// called for every timer that expires, after it was removed from the wheel.
+// the callback may add the timer again for a later time
+typedef void (*timer_expire_t)(wheel_timer_t *timer, void *arg);
+
+// creates a new wheel whose time starts at now_ms and advances in tick_ms steps
+timer_wheel_t *timer_wheel_new(uint64_t now_ms, unsigned tick_ms);
+
+// frees the wheel, timers still pending are forgotten
+void timer_wheel_delete(timer_wheel_t **w);
+
+// schedules timer to fire at expires_ms, or on the next advance if that has
+// passed. a pending timer is moved
+void timer_wheel_add(timer_wheel_t *w, wheel_timer_t *timer, uint64_t expires_ms);
+
+// removes timer from the wheel if it is pending
+void timer_wheel_cancel(timer_wheel_t *w, wheel_timer_t *timer);
+
+// returns whether timer is waiting in a wheel
+bool timer_pending(const wheel_timer_t *timer);
+
+// moves the wheel's time forward to now_ms and passes every timer that
+// expired on the way to expire
+void timer_wheel_advance(timer_wheel_t *w, uint64_t now_ms, timer_expire_t expire, void *arg);
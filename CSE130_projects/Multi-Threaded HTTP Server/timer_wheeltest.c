@@ -0,0 +1,192 @@
+// tests timer_wheel.c against a plain list of deadlines: random timers on
+// every level of the wheel, cancelled and moved ones, timers re-added from
+// the callback and ones beyond the reach of the wheel. every timer has to
+// fire in the first advance whose tick is not before its deadline, and only
+// then. "timer_wheeltest -v" prints a summary of each run
+
+#include "timer_wheel.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIMERS 2000
+
+static bool verbose;
+
+typedef struct test_timer {
+    wheel_timer_t timer; // first, so the callback can cast back
+    uint64_t deadline_ms; // UINT64_MAX while not pending
+    uint64_t period_ms; // re-added this much later from the callback, if not 0
+    int fired;
+} test_timer_t;
+
+// state shared with the callback
+typedef struct run {
+    timer_wheel_t *wheel;
+    unsigned tick_ms;
+    uint64_t now_ms; // the time passed to the advance in progress
+    int fired;
+} run_t;
+
+static test_timer_t timers[TIMERS];
+
+// the tick a deadline falls into, rounded up as the wheel does
+static uint64_t due_ms(const run_t *r, uint64_t deadline_ms) {
+    return (deadline_ms + r->tick_ms - 1) / r->tick_ms * r->tick_ms;
+}
+
+static void expire(wheel_timer_t *timer, void *arg) {
+    run_t *r = arg;
+    test_timer_t *t = (test_timer_t *) timer;
+    assert(t->deadline_ms != UINT64_MAX);
+    // never early, advance checks that it is not late
+    assert(r->now_ms >= due_ms(r, t->deadline_ms));
+    assert(!timer_pending(timer));
+    t->fired++;
+    r->fired++;
+    t->deadline_ms = UINT64_MAX;
+    if (t->period_ms) {
+        t->deadline_ms = r->now_ms + t->period_ms;
+        timer_wheel_add(r->wheel, timer, t->deadline_ms);
+    }
+}
+
+// advances the wheel to now_ms and checks that exactly the timers due by then fired
+static void advance(run_t *r, uint64_t now_ms) {
+    // the timers due in this advance, by the reference
+    int due = 0;
+    for (int i = 0; i < TIMERS; i++) {
+        test_timer_t *t = &timers[i];
+        if (t->deadline_ms != UINT64_MAX
+            && (t->deadline_ms + r->tick_ms - 1) / r->tick_ms <= now_ms / r->tick_ms) {
+            due++;
+        }
+    }
+    r->now_ms = now_ms;
+    r->fired = 0;
+    int fired_before[TIMERS];
+    for (int i = 0; i < TIMERS; i++) {
+        fired_before[i] = timers[i].fired;
+    }
+    timer_wheel_advance(r->wheel, now_ms, expire, r);
+
+    // a periodic timer may fire again within the same advance, count it once
+    int distinct = 0;
+    for (int i = 0; i < TIMERS; i++) {
+        distinct += timers[i].fired > fired_before[i];
+    }
+    assert(distinct == due);
+    for (int i = 0; i < TIMERS; i++) {
+        test_timer_t *t = &timers[i];
+        // whatever is still pending lies in the future
+        assert(t->deadline_ms == UINT64_MAX
+               || (t->deadline_ms + r->tick_ms - 1) / r->tick_ms > now_ms / r->tick_ms);
+        assert(timer_pending(&t->timer) == (t->deadline_ms != UINT64_MAX));
+    }
+}
+
+// random timers up to max_ms ahead, advanced in random steps until all fired
+static void test_random(unsigned tick_ms, uint64_t start_ms, uint64_t max_ms, uint64_t step_ms) {
+    run_t r = { .tick_ms = tick_ms, .now_ms = start_ms };
+    r.wheel = timer_wheel_new(start_ms, tick_ms);
+    assert(r.wheel);
+    memset(timers, 0, sizeof(timers));
+    for (int i = 0; i < TIMERS; i++) {
+        timers[i].deadline_ms = start_ms + (uint64_t) rand() % max_ms;
+        timer_wheel_add(r.wheel, &timers[i].timer, timers[i].deadline_ms);
+    }
+
+    uint64_t now = start_ms;
+    int steps = 0;
+    bool pending = true;
+    while (pending) {
+        now += 1 + (uint64_t) rand() % step_ms;
+        // for a while some timers are cancelled or moved, then the rest run out
+        for (int k = 0; k < 5 && now < start_ms + max_ms; k++) {
+            test_timer_t *t = &timers[rand() % TIMERS];
+            if (rand() % 2) {
+                timer_wheel_cancel(r.wheel, &t->timer);
+                t->deadline_ms = UINT64_MAX;
+            } else {
+                t->deadline_ms = now + (uint64_t) rand() % max_ms;
+                timer_wheel_add(r.wheel, &t->timer, t->deadline_ms);
+            }
+        }
+        advance(&r, now);
+        steps++;
+        pending = false;
+        for (int i = 0; i < TIMERS && !pending; i++) {
+            pending = timers[i].deadline_ms != UINT64_MAX;
+        }
+    }
+    if (verbose) {
+        printf("tick %u ms, deadlines up to %llu ms: %d advances\n", tick_ms,
+            (unsigned long long) max_ms, steps);
+    }
+    timer_wheel_delete(&r.wheel);
+}
+
+// timers that re-add themselves keep firing at their period
+static void test_periodic(void) {
+    run_t r = { .tick_ms = 10 };
+    r.wheel = timer_wheel_new(0, 10);
+    assert(r.wheel);
+    memset(timers, 0, sizeof(timers));
+    for (int i = 0; i < TIMERS; i++) {
+        timers[i].deadline_ms = UINT64_MAX;
+    }
+    timers[0].period_ms = 100;
+    timers[0].deadline_ms = 100;
+    timer_wheel_add(r.wheel, &timers[0].timer, 100);
+    timers[1].period_ms = 5000;
+    timers[1].deadline_ms = 5000;
+    timer_wheel_add(r.wheel, &timers[1].timer, 5000);
+
+    for (uint64_t now = 10; now <= 100000; now += 10) {
+        advance(&r, now);
+    }
+    assert(timers[0].fired == 1000 && timers[1].fired == 20);
+    timer_wheel_delete(&r.wheel);
+}
+
+// a deadline beyond the reach of the wheel is placed again until it is due
+static void test_far(void) {
+    run_t r = { .tick_ms = 1 };
+    r.wheel = timer_wheel_new(0, 1);
+    assert(r.wheel);
+    memset(timers, 0, sizeof(timers));
+    for (int i = 0; i < TIMERS; i++) {
+        timers[i].deadline_ms = UINT64_MAX;
+    }
+    // 64^4 ticks is as far as the wheel reaches
+    timers[0].deadline_ms = 20000000;
+    timer_wheel_add(r.wheel, &timers[0].timer, timers[0].deadline_ms);
+    // a deadline in the past fires on the next advance
+    timers[1].deadline_ms = 0;
+    timer_wheel_add(r.wheel, &timers[1].timer, 0);
+
+    advance(&r, 1);
+    assert(timers[1].fired == 1 && timers[0].fired == 0);
+    advance(&r, 19999999);
+    assert(timers[0].fired == 0);
+    advance(&r, 20000000);
+    assert(timers[0].fired == 1);
+    timer_wheel_delete(&r.wheel);
+}
+
+int main(int argc, char **argv) {
+    verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+    srand(1);
+
+    test_random(1, 0, 100, 3); // level 0 and 1
+    test_random(1, 12345, 300000, 5000); // up to level 3
+    test_random(10, 1000003, 5000000, 20000); // a start and deadlines off the tick
+    test_periodic();
+    test_far();
+    printf("timer_wheeltest: all tests passed\n");
+    return 0;
+}
@@ -0,0 +1,11 @@
+#include "uri_hash.h"
+
+// hashes a URI with 64-bit FNV-1a
+uint64_t uri_hash(const char *uri) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *) uri; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+// hashes a URI (64-bit FNV-1a), computed once per request and reused as the key
+// of the lock table, the caches and the scheduler
+uint64_t uri_hash(const char *uri);
@@ -0,0 +1,210 @@
+#include "work_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+// how long an idle worker sleeps before looking for work to steal again
+#define STEAL_RETRY_NS 2000000
+
+// one worker's deque, a circular buffer under its own mutex
+typedef struct deque {
+    void **buffer;
+    int capacity;
+    int front; // index of the oldest element
+    int count; // current number of elements
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty; // the owner sleeps here when there is no work
+    pthread_cond_t not_full; // producers sleep here when every deque is full
+} deque_t;
+
+// structure for the work pool
+typedef struct work_pool {
+    int workers;
+    deque_t *deques;
+} work_pool_t;
+
+// creates a new work pool
+work_pool_t *work_pool_new(int workers, int capacity) {
+    if (workers <= 0 || capacity <= 0) {
+        return NULL;
+    }
+
+    work_pool_t *p = malloc(sizeof(work_pool_t));
+    if (!p) {
+        return NULL;
+    }
+    p->workers = workers;
+    p->deques = calloc(workers, sizeof(deque_t));
+    if (!p->deques) {
+        free(p);
+        return NULL;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        deque_t *d = &p->deques[i];
+        d->buffer = malloc(capacity * sizeof(void *));
+        if (!d->buffer) {
+            while (i-- > 0) {
+                free(p->deques[i].buffer);
+            }
+            free(p->deques);
+            free(p);
+            return NULL;
+        }
+        d->capacity = capacity;
+        pthread_mutex_init(&d->lock, NULL);
+        pthread_cond_init(&d->not_empty, NULL);
+        pthread_cond_init(&d->not_full, NULL);
+    }
+    return p;
+}
+
+// deletes the pool and frees all its memory
+void work_pool_delete(work_pool_t **p) {
+    if (!p || !*p) {
+        return;
+    }
+
+    for (int i = 0; i < (*p)->workers; i++) {
+        deque_t *d = &(*p)->deques[i];
+        free(d->buffer);
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->not_empty);
+        pthread_cond_destroy(&d->not_full);
+    }
+    free((*p)->deques);
+    free(*p);
+    *p = NULL;
+}
+
+// appends to the back of a deque, caller holds its lock and checked for room
+static void deque_push_back(deque_t *d, void *elem) {
+    d->buffer[(d->front + d->count) % d->capacity] = elem;
+    d->count++;
+    pthread_cond_signal(&d->not_empty);
+}
+
+// tries to push without blocking
+static bool deque_try_push(deque_t *d, void *elem) {
+    pthread_mutex_lock(&d->lock);
+    bool pushed = d->count < d->capacity;
+    if (pushed) {
+        deque_push_back(d, elem);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return pushed;
+}
+
+// takes the oldest element, used by the owner
+static bool deque_try_pop_front(deque_t *d, void **elem) {
+    pthread_mutex_lock(&d->lock);
+    bool popped = d->count > 0;
+    if (popped) {
+        *elem = d->buffer[d->front];
+        d->front = (d->front + 1) % d->capacity;
+        d->count--;
+        pthread_cond_signal(&d->not_full);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return popped;
+}
+
+// takes the newest element, used by thieves
+static bool deque_try_pop_back(deque_t *d, void **elem) {
+    pthread_mutex_lock(&d->lock);
+    bool popped = d->count > 0;
+    if (popped) {
+        d->count--;
+        *elem = d->buffer[(d->front + d->count) % d->capacity];
+        pthread_cond_signal(&d->not_full);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return popped;
+}
+
+// pushes an item, preferring the given worker
+bool work_pool_push(work_pool_t *p, int worker, void *elem) {
+    if (!p || worker < 0) {
+        return false;
+    }
+
+    worker %= p->workers;
+    for (int i = 0; i < p->workers; i++) {
+        if (deque_try_push(&p->deques[(worker + i) % p->workers], elem)) {
+            return true;
+        }
+    }
+
+    // every deque is full, wait for room in the preferred one
+    deque_t *d = &p->deques[worker];
+    pthread_mutex_lock(&d->lock);
+    while (d->count == d->capacity) {
+        pthread_cond_wait(&d->not_full, &d->lock);
+    }
+    deque_push_back(d, elem);
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+void work_pool_localize(work_pool_t *p, int worker) {
+    if (!p || worker < 0 || worker >= p->workers) {
+        return;
+    }
+
+    deque_t *d = &p->deques[worker];
+    void **buffer = malloc(d->capacity * sizeof(void *));
+    if (!buffer) {
+        return; // the old buffer still works, it is only remote
+    }
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < d->count; i++) {
+        buffer[i] = d->buffer[(d->front + i) % d->capacity];
+    }
+    void **old = d->buffer;
+    d->buffer = buffer;
+    d->front = 0;
+    pthread_mutex_unlock(&d->lock);
+    free(old);
+}
+
+// tries every other worker's deque, starting after the caller's own
+static bool steal(work_pool_t *p, int worker, void **elem) {
+    for (int i = 1; i < p->workers; i++) {
+        if (deque_try_pop_back(&p->deques[(worker + i) % p->workers], elem)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// pops an item for a worker, stealing when its own deque is empty
+bool work_pool_pop(work_pool_t *p, int worker, void **elem) {
+    if (!p || !elem || worker < 0 || worker >= p->workers) {
+        return false;
+    }
+
+    deque_t *d = &p->deques[worker];
+    while (1) {
+        if (deque_try_pop_front(d, elem) || steal(p, worker, elem)) {
+            return true;
+        }
+
+        // nothing anywhere, sleep until our deque gets work or it is time to
+        // look for a busy worker to steal from again
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += STEAL_RETRY_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&d->lock);
+        if (d->count == 0) {
+            pthread_cond_timedwait(&d->not_empty, &d->lock, &deadline);
+        }
+        pthread_mutex_unlock(&d->lock);
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+// per-worker work deques with stealing. producers push to a chosen worker's
+// deque and each deque has its own lock, so there is no single queue lock for
+// everyone to fight over. a worker takes the oldest item from its own deque
+// and, when that is empty, steals the newest item from another worker.
+typedef struct work_pool work_pool_t;
+
+// creates a pool with one deque of the given capacity per worker
+work_pool_t *work_pool_new(int workers, int capacity);
+
+// frees the pool and its deques
+void work_pool_delete(work_pool_t **p);
+
+// pushes an item to a worker's deque. if that deque is full the item goes
+// to the next worker with room, and the call blocks only if all are full
+bool work_pool_push(work_pool_t *p, int worker, void *elem);
+
+// pops an item for a worker, from its own deque or stolen from another.
+// blocks until an item is available
+bool work_pool_pop(work_pool_t *p, int worker, void **elem);
+
+// moves a worker's deque buffer into memory allocated by the calling thread,
+// which should be that worker. with the worker pinned, the kernel places the
+// new buffer on the worker's NUMA node. items already queued are kept
+void work_pool_localize(work_pool_t *p, int worker);